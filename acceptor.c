@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include "acceptor.h"
+
+#include <poll.h>
+
+/* connection to log, address kept in binary form */
+struct __peer {
+  struct sockaddr_storage addr;
+  socklen_t len;
+};
+
+static struct {
+  struct __peer *ring;
+  size_t head, tail; /* next entry to log, next free entry */
+  unsigned long dropped;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} peers = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+struct __acceptor {
+  int listenfd;
+  int log;
+  void (*handler)(int connfd);
+  pthread_t tid;
+};
+
+/**
+ * @brief Open a listening socket on @p port.
+ * @note Like Open_listenfd(), but with a deeper backlog and, if
+ * @p reuseport is set, SO_REUSEPORT so several sockets can share the port
+ * and the kernel spreads connections over them.
+ *
+ * @return Listening socket, -1 if no address could be bound.
+ */
+int acceptor_open_listenfd(const char *port, int reuseport) {
+  struct addrinfo hints, *listp, *p;
+  int listenfd = -1, optval = 1;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+  Getaddrinfo(NULL, port, &hints, &listp);
+
+  for (p = listp; p; p = p->ai_next) {
+    if ((listenfd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC,
+                           p->ai_protocol)) < 0) {
+      continue;
+    }
+    Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    if (reuseport) {
+      Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+    }
+    if (!bind(listenfd, p->ai_addr, p->ai_addrlen) &&
+        !listen(listenfd, ACCEPT_BACKLOG)) {
+      break;
+    }
+    Close(listenfd);
+    listenfd = -1;
+  }
+  Freeaddrinfo(listp);
+  return listenfd;
+}
+
+/**
+ * @brief Queue the address of a new connection for the log thread. Never
+ * blocks on it: when the log falls behind, entries are dropped and counted.
+ */
+static void __log_peer(const struct sockaddr_storage *addr, socklen_t len) {
+  pthread_mutex_lock(&peers.mutex);
+  if (peers.tail - peers.head == ACCEPT_LOG_SIZE) {
+    peers.dropped++;
+  } else {
+    struct __peer *p = &peers.ring[peers.tail++ % ACCEPT_LOG_SIZE];
+    memcpy(&p->addr, addr, len);
+    p->len = len;
+    pthread_cond_signal(&peers.cond);
+  }
+  pthread_mutex_unlock(&peers.mutex);
+}
+
+/**
+ * @brief Print queued connections, without name lookups.
+ */
+static void *__logger(void *vargp) {
+  char host[NI_MAXHOST], serv[NI_MAXSERV];
+  struct __peer peer;
+  unsigned long dropped;
+
+  pthread_mutex_lock(&peers.mutex);
+  while (1) {
+    if (peers.head == peers.tail && !peers.dropped) {
+      // caught up: let the lines out before sleeping
+      pthread_mutex_unlock(&peers.mutex);
+      fflush(stdout);
+      pthread_mutex_lock(&peers.mutex);
+    }
+    while (peers.head == peers.tail && !peers.dropped) {
+      pthread_cond_wait(&peers.cond, &peers.mutex);
+    }
+    dropped = peers.dropped;
+    peers.dropped = 0;
+    if (peers.head != peers.tail) {
+      peer = peers.ring[peers.head++ % ACCEPT_LOG_SIZE];
+    } else {
+      peer.len = 0;
+    }
+    pthread_mutex_unlock(&peers.mutex);
+
+    if (dropped) {
+      printf("%lu connections not logged\n", dropped);
+    }
+    if (peer.len &&
+        !getnameinfo((SA *)&peer.addr, peer.len, host, sizeof(host), serv,
+                     sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV)) {
+      printf("Connected to (%s, %s)\n", host, serv);
+    }
+    pthread_mutex_lock(&peers.mutex);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Accept loop of one listening socket.
+ * @note The socket is non-blocking: each wake-up drains up to ACCEPT_BATCH
+ * pending connections with accept4() before polling again.
+ */
+static void *__acceptor_thread(void *vargp) {
+  struct __acceptor *a = (struct __acceptor *)vargp;
+  struct pollfd pfd = {.fd = a->listenfd, .events = POLLIN};
+  struct sockaddr_storage addr;
+  socklen_t len;
+  int connfd, n;
+
+  while (1) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      unix_error("poll error");
+    }
+    for (n = 0; n < ACCEPT_BATCH; n++) {
+      len = sizeof(addr);
+      // connections stay blocking: pool workers read them with rio
+      connfd = accept4(a->listenfd, (SA *)&addr, &len, SOCK_CLOEXEC);
+      if (connfd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          fprintf(stderr, "accept4 error: %s\n", strerror(errno));
+        }
+        break;
+      }
+      if (a->log) {
+        __log_peer(&addr, len);
+      }
+      a->handler(connfd);
+    }
+    debug_print("acceptor on fd=%d took %d connections", a->listenfd, n);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Accept connections on @p port and pass each to @p handler. Never
+ * returns.
+ * @note With several acceptors each thread owns a SO_REUSEPORT socket, so
+ * they share no accept queue and never wake each other. Peer addresses are
+ * logged, if at all, from a separate thread, so no name lookup or stdio lock
+ * ever sits on the accept path.
+ *
+ * @param port Port to listen on
+ * @param nacceptors Number of accept threads
+ * @param log Print the numeric address of each connection
+ * @param handler Takes ownership of each accepted connection
+ */
+void acceptor_run(const char *port, int nacceptors, int log,
+                  void (*handler)(int connfd)) {
+  struct __acceptor *acceptors =
+      (struct __acceptor *)Calloc(nacceptors, sizeof(struct __acceptor));
+  pthread_t tid;
+  int flags;
+
+  if (log) {
+    peers.ring =
+        (struct __peer *)Calloc(ACCEPT_LOG_SIZE, sizeof(struct __peer));
+    Pthread_create(&tid, NULL, __logger, NULL);
+  }
+  for (int i = 0; i < nacceptors; i++) {
+    struct __acceptor *a = &acceptors[i];
+    if ((a->listenfd = acceptor_open_listenfd(port, nacceptors > 1)) < 0) {
+      unix_error("acceptor_open_listenfd error");
+    }
+    if ((flags = fcntl(a->listenfd, F_GETFL, 0)) < 0 ||
+        fcntl(a->listenfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      unix_error("fcntl error");
+    }
+    a->log = log;
+    a->handler = handler;
+    Pthread_create(&a->tid, NULL, __acceptor_thread, a);
+  }
+  debug_print("started %d acceptors on port %s", nacceptors, port);
+
+  for (int i = 0; i < nacceptors; i++) {
+    Pthread_join(acceptors[i].tid, NULL);
+  }
+}
@@ -0,0 +1,18 @@
+#ifndef __ACCEPTOR_H__
+#define __ACCEPTOR_H__
+
+#include "csapp.h"
+#include "misc.h"
+
+/* most connections accepted per wake-up before they are handed off */
+#define ACCEPT_BATCH 64
+/* pending connections the kernel queues per listening socket */
+#define ACCEPT_BACKLOG 4096
+/* peer addresses waiting to be logged. more are counted and dropped */
+#define ACCEPT_LOG_SIZE 1024
+
+int acceptor_open_listenfd(const char *port, int reuseport);
+void acceptor_run(const char *port, int nacceptors, int log,
+                  void (*handler)(int connfd));
+
+#endif /* __ACCEPTOR_H__ */
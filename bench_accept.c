@@ -0,0 +1,125 @@
+/*
+ * bench_accept.c - connections per second through each accept path
+ *
+ * Client threads connect in a loop and wait for the server to hang up; the
+ * server side closes every connection as soon as it has accepted it, so
+ * only the accept path is measured. The legacy path is the accept loop of
+ * before acceptor.c: blocking Accept(), Getnameinfo() with name lookups and
+ * a printf() per connection. Clients reset their side so no run leaves
+ * TIME_WAIT sockets behind for the next one.
+ */
+#include "acceptor.h"
+
+#define DEFAULT_CLIENTS 4
+#define DEFAULT_SECONDS 1
+#define BASE_PORT 15400
+
+static volatile int stop;
+static FILE *devnull, *report;
+
+static void *legacy(void *vargp) {
+  char host[MAXLINE], port[MAXLINE];
+  int listenfd = Open_listenfd((char *)vargp), connfd;
+  struct sockaddr_storage addr;
+  socklen_t len;
+
+  while (1) {
+    len = sizeof(addr);
+    connfd = Accept(listenfd, (SA *)&addr, &len);
+    Getnameinfo((SA *)&addr, len, host, MAXLINE, port, MAXLINE, 0);
+    fprintf(devnull, "Connected to (%s, %s)\n", host, port);
+    Close(connfd);
+  }
+  return NULL;
+}
+
+static void hang_up(int connfd) { Close(connfd); }
+
+struct __run {
+  const char *port;
+  int nacceptors;
+  int log;
+};
+
+static void *acceptors(void *vargp) {
+  struct __run *run = (struct __run *)vargp;
+  acceptor_run(run->port, run->nacceptors, run->log, hang_up);
+  return NULL;
+}
+
+struct __client {
+  char *port;
+  long ops;
+};
+
+static void *client(void *vargp) {
+  struct __client *cl = (struct __client *)vargp;
+  struct linger lg = {.l_onoff = 1, .l_linger = 0};
+  char c;
+  int fd;
+
+  while (!stop) {
+    fd = Open_clientfd("127.0.0.1", cl->port);
+    while (read(fd, &c, 1) > 0) {
+    }
+    Setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    Close(fd);
+    cl->ops++;
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int nclients = argc > 1 ? atoi(argv[1]) : DEFAULT_CLIENTS;
+  int seconds = argc > 2 ? atoi(argv[2]) : DEFAULT_SECONDS;
+  struct __run runs[] = {{NULL, 0, 0}, {NULL, 1, 0}, {NULL, 1, 1},
+                         {NULL, 2, 0}};
+  static const char *names[] = {"legacy", "batched", "batched+log",
+                                "2x reuseport"};
+  char ports[4][16];
+  double base = 0;
+
+  devnull = Fopen("/dev/null", "w");
+  // the log thread prints to stdout: keep it out of the report
+  report = fdopen(dup(STDOUT_FILENO), "w");
+  setvbuf(report, NULL, _IOLBF, 0);
+  Dup2(fileno(devnull), STDOUT_FILENO);
+
+  fprintf(report, "%d clients, %d s per path\n", nclients, seconds);
+  fprintf(report, "%-13s %12s %10s\n", "path", "conns/s", "relative");
+  for (int r = 0; r < 4; r++) {
+    pthread_t tid, tids[nclients];
+    struct __client clients[nclients];
+    long total = 0;
+    double start, elapsed;
+
+    snprintf(ports[r], sizeof(ports[r]), "%d", BASE_PORT + r);
+    runs[r].port = ports[r];
+    if (!r) {
+      Pthread_create(&tid, NULL, legacy, ports[r]);
+    } else {
+      Pthread_create(&tid, NULL, acceptors, &runs[r]);
+    }
+    usleep(100000);
+
+    stop = 0;
+    start = now_ns() / 1e9;
+    for (int i = 0; i < nclients; i++) {
+      clients[i] = (struct __client){ports[r], 0};
+      Pthread_create(&tids[i], NULL, client, &clients[i]);
+    }
+    sleep(seconds);
+    stop = 1;
+    for (int i = 0; i < nclients; i++) {
+      Pthread_join(tids[i], NULL);
+      total += clients[i].ops;
+    }
+    elapsed = now_ns() / 1e9 - start;
+    if (!r) {
+      base = total / elapsed;
+    }
+    fprintf(report, "%-13s %12.0f %9.2fx\n", names[r], total / elapsed,
+            total / elapsed / base);
+  }
+  return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * bench_book.c - throughput and latency of the limit order book
+ *
+ * Each thread sends a random order flow to BENCH_ITEMS books: limit orders
+ * within BENCH_SPREAD ticks either side of the mid price, some market
+ * orders, and cancels of its own resting orders. Every call is timed, and
+ * the ones that matched anything are reported as the match latency.
+ */
+#include "book.h"
+#include "hist.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_ORDERS 1000000
+#define BENCH_ITEMS 16
+#define BENCH_MID 10000
+#define BENCH_SPREAD 50
+/* stock of every item, enough that sells are never short */
+#define BENCH_STOCK (1 << 30)
+/* resting orders each thread remembers, to cancel */
+#define BENCH_OPEN 1024
+
+struct __worker {
+  stock_item *items[BENCH_ITEMS];
+  long orders;
+  unsigned seed;
+  hist_t match;
+  long full;
+};
+
+static void *worker(void *vargp) {
+  struct __worker *w = (struct __worker *)vargp;
+  int open[BENCH_OPEN] = {0}, *slot, r, kind, qty, price;
+  stock_item *item;
+  book_fill fill;
+  uint64_t start;
+  book_side side;
+
+  for (long i = 0; i < w->orders; i++) {
+    r = rand_r(&w->seed);
+    item = w->items[r % BENCH_ITEMS];
+    side = (book_side)(r >> 8 & 1);
+    qty = (r >> 9 & 63) + 1;
+    slot = &open[r >> 20 & (BENCH_OPEN - 1)];
+    kind = r >> 16 & 15; // 1 in 16 market, 5 in 16 cancel, the rest limit
+    fill = (book_fill){0};
+    start = now_ns();
+    if (!kind) {
+      book_market(item, side, qty, &fill);
+    } else if (kind < 6) {
+      if (*slot) {
+        book_cancel(*slot, &qty);
+        *slot = 0;
+      }
+    } else {
+      price = BENCH_MID + rand_r(&w->seed) % (2 * BENCH_SPREAD + 1) -
+              BENCH_SPREAD;
+      if (book_limit(item, side, qty, price, &fill) == BOOK_FULL) {
+        w->full++;
+      }
+      if (fill.oid) {
+        *slot = fill.oid;
+      }
+    }
+    if (fill.filled) {
+      hist_record(&w->match, now_ns() - start);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Send @p orders orders from @p nthreads threads to books of the
+ * items from @p base on, and print the results.
+ */
+static void run(int nthreads, long orders, int base) {
+  struct __worker w[nthreads];
+  pthread_t tids[nthreads];
+  uint64_t start;
+  double secs;
+  long full = 0;
+  hist_t match;
+
+  hist_init(&match);
+  for (int t = 0; t < nthreads; t++) {
+    for (int i = 0; i < BENCH_ITEMS; i++) {
+      w[t].items[i] = search_stock(base + i);
+    }
+    w[t].orders = orders / nthreads;
+    w[t].seed = t + 1;
+    w[t].full = 0;
+    hist_init(&w[t].match);
+  }
+  start = now_ns();
+  for (int t = 0; t < nthreads; t++) {
+    Pthread_create(&tids[t], NULL, worker, &w[t]);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    Pthread_join(tids[t], NULL);
+    hist_merge(&match, &w[t].match);
+    full += w[t].full;
+  }
+  secs = (now_ns() - start) / 1e9;
+  printf("%-8d %12.0f %10llu %8.2f %8.2f %8.2f %8.2f%s\n", nthreads,
+         orders / nthreads * nthreads / secs, (unsigned long long)match.count,
+         hist_percentile(&match, 0.5) / 1e3,
+         hist_percentile(&match, 0.99) / 1e3,
+         hist_percentile(&match, 0.999) / 1e3, match.max / 1e3,
+         full ? " (book full)" : "");
+}
+
+int main(int argc, char **argv) {
+  int max_threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+  long orders = argc > 2 ? atol(argv[2]) : DEFAULT_ORDERS;
+  int base = 1;
+
+  printf("%ld orders per run over %d books, match latency in us\n", orders,
+         BENCH_ITEMS);
+  printf("%-8s %12s %10s %8s %8s %8s %8s\n", "threads", "orders/s", "matches",
+         "p50", "p99", "p99.9", "max");
+  for (int n = 1; n <= max_threads; n *= 2, base += BENCH_ITEMS) {
+    // fresh books for every run
+    for (int i = 0; i < BENCH_ITEMS; i++) {
+      insert(base + i, BENCH_STOCK, BENCH_MID);
+    }
+    run(n, orders, base);
+  }
+  return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * bench_handoff.c - acceptor to worker handoff, semaphore queue against sbuf
+ *
+ * One producer stands in for the accept loop and hands integers to a pool
+ * of workers, like stockserver hands off connections. A burst run pushes
+ * back to back to measure throughput under a connection storm; a paced run
+ * spaces the handoffs so workers are parked and measures how long one takes
+ * to be picked up. The semaphore queue is the sbuf of before the ring.
+ */
+#include "sbuf.h"
+
+#define DEFAULT_WORKERS 256
+#define BURST_ITEMS 1000000
+#define PACED_ITEMS 20000
+#define PACED_GAP_US 20
+
+/* semaphore-protected ring: four semaphore operations per handoff */
+typedef struct {
+  int *buf;
+  size_t len;
+  int front, rear;
+  sem_t mutex, slots, fds;
+} sem_sbuf_t;
+
+static void sem_sbuf_init(sem_sbuf_t *sp, size_t len) {
+  sp->buf = Calloc(len, sizeof(int));
+  sp->len = len;
+  sp->front = sp->rear = 0;
+  Sem_init(&sp->mutex, 0, 1);
+  Sem_init(&sp->slots, 0, len);
+  Sem_init(&sp->fds, 0, 0);
+}
+
+static void sem_sbuf_insert(sem_sbuf_t *sp, int fd) {
+  P(&sp->slots);
+  P(&sp->mutex);
+  sp->buf[++sp->rear % sp->len] = fd;
+  V(&sp->mutex);
+  V(&sp->fds);
+}
+
+static int sem_sbuf_remove(sem_sbuf_t *sp) {
+  int fd;
+  P(&sp->fds);
+  P(&sp->mutex);
+  fd = sp->buf[++sp->front % sp->len];
+  V(&sp->mutex);
+  V(&sp->slots);
+  return fd;
+}
+
+static int use_ring;
+static sem_sbuf_t sem_queue;
+static sbuf_t ring;
+static double *sent, *latency;
+
+static void put(int v) {
+  if (use_ring) {
+    sbuf_insert(&ring, v);
+  } else {
+    sem_sbuf_insert(&sem_queue, v);
+  }
+}
+
+static int get(void) {
+  return use_ring ? sbuf_remove(&ring) : sem_sbuf_remove(&sem_queue);
+}
+
+static void *worker(void *vargp) {
+  int v;
+
+  while ((v = get()) >= 0) {
+    if (latency) {
+      latency[v] = now_ns() / 1e9 - sent[v];
+    }
+  }
+  return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Hand @p n items to @p nworkers workers, @p gap_us apart.
+ *
+ * @return Elapsed seconds.
+ */
+static double run(int nworkers, int n, int gap_us) {
+  pthread_t tids[nworkers];
+  double start, next;
+
+  for (int i = 0; i < nworkers; i++) {
+    Pthread_create(&tids[i], NULL, worker, NULL);
+  }
+  usleep(100000); // let every worker block on the empty queue
+
+  start = next = now_ns() / 1e9;
+  for (int i = 0; i < n; i++) {
+    if (gap_us) {
+      next += gap_us / 1e6;
+      while (now_ns() / 1e9 < next) {
+      }
+      sent[i] = now_ns() / 1e9;
+    }
+    put(i);
+  }
+  for (int i = 0; i < nworkers; i++) {
+    put(-1);
+  }
+  for (int i = 0; i < nworkers; i++) {
+    Pthread_join(tids[i], NULL);
+  }
+  return now_ns() / 1e9 - start;
+}
+
+int main(int argc, char **argv) {
+  static const char *names[] = {"sem", "ring"};
+  int nworkers = argc > 1 ? atoi(argv[1]) : DEFAULT_WORKERS;
+  double elapsed;
+
+  sent = Calloc(PACED_ITEMS, sizeof(double));
+  printf("1 producer, %d workers, queue of %d\n", nworkers, SBUF_SIZE);
+  printf("%-5s %14s %10s %10s %10s\n", "queue", "burst_items/s", "p50_us",
+         "p99_us", "max_us");
+  for (use_ring = 0; use_ring < 2; use_ring++) {
+    sem_sbuf_init(&sem_queue, SBUF_SIZE);
+    sbuf_init(&ring, SBUF_SIZE);
+
+    latency = NULL;
+    elapsed = run(nworkers, BURST_ITEMS, 0);
+
+    latency = Calloc(PACED_ITEMS, sizeof(double));
+    run(nworkers, PACED_ITEMS, PACED_GAP_US);
+    qsort(latency, PACED_ITEMS, sizeof(double), cmp_double);
+
+    printf("%-5s %14.0f %10.1f %10.1f %10.1f\n", names[use_ring],
+           BURST_ITEMS / elapsed, latency[PACED_ITEMS / 2] * 1e6,
+           latency[PACED_ITEMS * 99 / 100] * 1e6,
+           latency[PACED_ITEMS - 1] * 1e6);
+    Free(latency);
+    sbuf_free(&ring);
+    free(sem_queue.buf);
+  }
+  return 0;
+}
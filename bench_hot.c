@@ -0,0 +1,120 @@
+/*
+ * bench_hot.c - trades on Zipf-skewed ids with and without hot mode
+ *
+ * Each thread buys and sells one stock at a time on ids drawn from a Zipf
+ * distribution over BENCH_ITEMS items, where id 1 is the hottest. Keys are
+ * drawn ahead of the timed loop. Every thread count is run once on the
+ * shared counts and once with the BENCH_HOT hottest ids in hot mode.
+ */
+#include "stock.h"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_OPS 2000000
+#define DEFAULT_THETA 0.99
+#define BENCH_ITEMS 1000
+#define BENCH_HOT 8
+#define BENCH_KEYS 65536
+
+static stock_item *items[BENCH_ITEMS + 1];
+static int keys[BENCH_KEYS];
+static long ops_per_thread;
+
+/* xorshift64* */
+static uint64_t rng_next(uint64_t *s) {
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 2685821657736338717ULL;
+}
+
+/**
+ * @brief Fill keys[] with ids in [1, BENCH_ITEMS] drawn from a Zipf
+ * distribution of exponent @p theta, by inverting its cumulative sum.
+ */
+static void zipf_keys(double theta) {
+  static double cdf[BENCH_ITEMS + 1];
+  uint64_t rng = 88172645463325252ULL;
+  double u;
+  int lo, hi, mid;
+
+  for (int i = 1; i <= BENCH_ITEMS; i++) {
+    cdf[i] = cdf[i - 1] + 1 / pow(i, theta);
+  }
+  for (int k = 0; k < BENCH_KEYS; k++) {
+    u = (rng_next(&rng) >> 11) * (1.0 / 9007199254740992.0) *
+        cdf[BENCH_ITEMS];
+    for (lo = 1, hi = BENCH_ITEMS; lo < hi;) {
+      mid = (lo + hi) / 2;
+      if (cdf[mid] < u) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    keys[k] = lo;
+  }
+}
+
+static void *worker(void *vargp) {
+  long k = (long)vargp * 7919;
+  stock_item *item;
+
+  for (long i = 0; i < ops_per_thread; i++) {
+    item = items[keys[k++ % BENCH_KEYS]];
+    stock_add(item, (i & 1) ? 1 : -1);
+  }
+  return NULL;
+}
+
+static double run(int nthreads) {
+  pthread_t tids[nthreads];
+  double start = now_ns() / 1e9;
+
+  for (long i = 0; i < nthreads; i++) {
+    Pthread_create(&tids[i], NULL, worker, (void *)i);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    Pthread_join(tids[i], NULL);
+  }
+  return (double)nthreads * ops_per_thread / (now_ns() / 1e9 - start);
+}
+
+/**
+ * @brief Turn hot mode of the BENCH_HOT hottest ids @p on or off.
+ */
+static void set_hot(int on) {
+  for (int id = 1; id <= BENCH_HOT; id++) {
+    if (stock_hot(id, on) != STOCK_SUCCESS) {
+      app_error("stock_hot failed");
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int max_threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+  double theta = argc > 3 ? atof(argv[3]) : DEFAULT_THETA;
+  double shared, hot, hot_share = 0;
+
+  ops_per_thread = argc > 2 ? atol(argv[2]) : DEFAULT_OPS;
+  for (int id = 1; id <= BENCH_ITEMS; id++) {
+    insert(id, 1000000, 100);
+    items[id] = search_stock(id);
+  }
+  zipf_keys(theta);
+  for (int k = 0; k < BENCH_KEYS; k++) {
+    hot_share += keys[k] <= BENCH_HOT;
+  }
+
+  printf("zipf %.2f over %d ids, %d hottest take %.0f%% of trades\n", theta,
+         BENCH_ITEMS, BENCH_HOT, 100 * hot_share / BENCH_KEYS);
+  printf("%-8s %14s %14s %8s\n", "threads", "shared ops/s", "hot ops/s",
+         "speedup");
+  for (int n = 1; n <= max_threads; n *= 2) {
+    shared = run(n);
+    set_hot(1);
+    hot = run(n);
+    set_hot(0);
+    printf("%-8d %14.0f %14.0f %7.2fx\n", n, shared, hot, hot / shared);
+  }
+  return 0;
+}
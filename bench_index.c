@@ -0,0 +1,98 @@
+/*
+ * bench_index.c - point lookups, B+-tree against the hash index
+ *
+ * Both indexes map the same IDs to the same items. Lookups go to random
+ * existing IDs, so once the items outgrow the caches every lookup pays for
+ * the misses of its index: one per level of the tree, about one for the
+ * hash. Reader threads share the indexes like trading threads do.
+ */
+#include "btree.h"
+#include "hash.h"
+
+#define DEFAULT_THREADS 1
+#define LOOKUPS 4000000
+#define ID_STRIDE 3 /* IDs are 1, 4, 7, ... so misses cannot be guessed */
+
+static const long sizes[] = {1000, 1000000, 10000000};
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static btree_t tree;
+static hash_t hash_index;
+static int *ids;   /* ID of every item, the items themselves */
+static int *probe; /* IDs to look up, in random order */
+static int use_hash;
+
+static void *reader(void *vargp) {
+  long sum = 0;
+  int *item;
+
+  for (long i = 0; i < LOOKUPS; i++) {
+    item = use_hash ? hash_search(&hash_index, probe[i])
+                    : btree_search(&tree, probe[i]);
+    sum += *item;
+  }
+  return (void *)sum;
+}
+
+/**
+ * @brief Run @p nthreads readers over the current index.
+ *
+ * @return Lookups per second over all readers.
+ */
+static double run(int nthreads) {
+  pthread_t tids[nthreads];
+  double start = now_ns() / 1e9;
+  void *sum;
+
+  for (int i = 0; i < nthreads; i++) {
+    Pthread_create(&tids[i], NULL, reader, NULL);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    Pthread_join(tids[i], &sum);
+    if (!sum) {
+      app_error("lookups found nothing");
+    }
+  }
+  return (double)LOOKUPS * nthreads / (now_ns() / 1e9 - start);
+}
+
+int main(int argc, char **argv) {
+  int nthreads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+  unsigned seed = 7;
+  double rate[2];
+
+  probe = (int *)Malloc(LOOKUPS * sizeof(int));
+  printf("%d reader threads, %d random lookups each\n", nthreads, LOOKUPS);
+  printf("%10s %14s %14s %8s %8s %9s\n", "items", "tree_lookups/s",
+         "hash_lookups/s", "tree_ns", "hash_ns", "speedup");
+  for (size_t s = 0; s < NSIZES; s++) {
+    long n = sizes[s];
+
+    ids = (int *)Malloc(n * sizeof(int));
+    for (long i = 0; i < n; i++) {
+      ids[i] = i * ID_STRIDE + 1;
+    }
+    btree_init(&tree);
+    btree_bulk_load(&tree, ids, n, sizeof(int), 0);
+    hash_init(&hash_index);
+    for (long i = 0; i < n; i++) {
+      hash_insert(&hash_index, ids[i], &ids[i]);
+    }
+    for (long i = 0; i < LOOKUPS; i++) {
+      probe[i] = ids[rand_r(&seed) % n];
+    }
+
+    for (use_hash = 0; use_hash < 2; use_hash++) {
+      rate[use_hash] = run(nthreads);
+    }
+    printf("%10ld %14.0f %14.0f %8.1f %8.1f %8.2fx\n", n, rate[0], rate[1],
+           1e9 * nthreads / rate[0], 1e9 * nthreads / rate[1],
+           rate[1] / rate[0]);
+
+    hash_free(&hash_index);
+    btree_free(&tree);
+    Free(ids);
+  }
+  Free(probe);
+  return 0;
+}
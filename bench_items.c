@@ -0,0 +1,110 @@
+/*
+ * bench_items.c - memory and lookup cost of the stock item layout
+ *
+ * Builds the same catalog three ways: items as they used to be, with two
+ * semaphores and a reader count each, items malloc()ed one by one, and items
+ * packed in a slab. Each build runs in a fresh process so resident memory
+ * can be compared.
+ */
+#include <sys/wait.h>
+
+#include "slab.h"
+#include "stock.h"
+
+#define DEFAULT_ITEMS 10000000
+#define SLAB_ITEMS 4096
+#define LOOKUPS 5000000
+
+/* item layout before the lock-free counters */
+struct legacy_item {
+  int id;
+  int count;
+  int price;
+  int read_cnt;
+  sem_t r_mutex;
+  sem_t w_mutex;
+};
+
+enum { LEGACY, MALLOC, SLAB, NMODES };
+static const char *names[] = {"legacy", "malloc", "slab"};
+
+struct result {
+  double rss;
+  double build_s;
+  double lookup_ns;
+};
+
+static double rss_bytes(void) {
+  long pages = 0, resident = 0;
+  FILE *fp = Fopen("/proc/self/statm", "r");
+  if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  Fclose(fp);
+  return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+static void run(int mode, long n, struct result *res) {
+  slab_t slab;
+  btree_t tree;
+  double start, base = rss_bytes();
+  unsigned seed = 42;
+  long sum = 0;
+  void *item;
+
+  slab_init(&slab, sizeof(stock_item), SLAB_ITEMS);
+  btree_init(&tree);
+  start = now_ns() / 1e9;
+  for (long i = 0; i < n; i++) {
+    if (mode == LEGACY) {
+      struct legacy_item *l = Malloc(sizeof(*l));
+      *l = (struct legacy_item){.id = i, .count = 1, .price = 1};
+      Sem_init(&l->r_mutex, 0, 1);
+      Sem_init(&l->w_mutex, 0, 1);
+      item = l;
+    } else {
+      stock_item *s = mode == MALLOC ? Malloc(sizeof(*s)) : slab_alloc(&slab);
+      *s = (stock_item){.id = i, .count = 1, .price = 1};
+      item = s;
+    }
+    btree_insert(&tree, i, item);
+  }
+  res->build_s = now_ns() / 1e9 - start;
+  res->rss = rss_bytes() - base;
+
+  start = now_ns() / 1e9;
+  for (long i = 0; i < LOOKUPS; i++) {
+    // id and count sit at the same offsets in both layouts
+    stock_item *s = btree_search(&tree, rand_r(&seed) % n);
+    sum += s->count;
+  }
+  res->lookup_ns = (now_ns() / 1e9 - start) * 1e9 / LOOKUPS;
+  if (sum != LOOKUPS) {
+    app_error("lookup returned the wrong item");
+  }
+}
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : DEFAULT_ITEMS;
+  struct result *res = Mmap(NULL, NMODES * sizeof(struct result),
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                            -1, 0);
+
+  for (int mode = 0; mode < NMODES; mode++) {
+    if (Fork() == 0) {
+      run(mode, n, &res[mode]);
+      exit(0);
+    }
+    Wait(NULL);
+  }
+
+  printf("%ld items, %d random lookups\n", n, LOOKUPS);
+  printf("%-7s %10s %10s %9s %10s\n", "layout", "rss_mb", "bytes/item",
+         "build_s", "lookup_ns");
+  for (int mode = 0; mode < NMODES; mode++) {
+    printf("%-7s %10.1f %10.1f %9.2f %10.1f\n", names[mode],
+           res[mode].rss / (1 << 20), res[mode].rss / n, res[mode].build_s,
+           res[mode].lookup_ns);
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * bench_latency.c - cost of recording per-request latency histograms
+ *
+ * Each request runs with recording off and on, in two settings:
+ * - "inline": handle_line() in a loop with no socket. This is the worst
+ *   case for the relative cost.
+ * - "socket": a client thread and a pool-style worker exchange one request
+ *   and one framed reply at a time over a socketpair, like a served
+ *   connection.
+ */
+#include "command.h"
+
+#define DEFAULT_ROUNDS 200000
+#define BENCH_ITEMS 64
+#define REPEATS 5
+
+static const char *lines[] = {"buy 7 1\n", "sell 7 1\n", "buy 63 2\n",
+                              "sell 63 2\n", "lowstock 10\n"};
+#define NLINES (sizeof(lines) / sizeof(lines[0]))
+
+static void run_inline(long rounds) {
+  cmd_session session = {.mode = PROTO_FRAMED};
+  cmd_response response;
+  char line[MAXLINE];
+
+  for (long i = 0; i < rounds; i++) {
+    for (size_t l = 0; l < NLINES; l++) {
+      strcpy(line, lines[l]);
+      response_init(&response);
+      handle_line(&session, line, &response);
+      response_release(&response);
+    }
+  }
+}
+
+static void *worker(void *vargp) {
+  int fd = *(int *)vargp;
+
+  handle_threaded_connection(fd);
+  Close(fd);
+  return NULL;
+}
+
+static void run_socket(long rounds) {
+  size_t cap = 0;
+  char *reply = NULL;
+  pthread_t tid;
+  int sv[2];
+  rio_t rio;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    unix_error("socketpair error");
+  }
+  Pthread_create(&tid, NULL, worker, &sv[1]);
+  Rio_readinitb(&rio, sv[0]);
+  Rio_writen(sv[0], PROTO_FRAMED_CMD, strlen(PROTO_FRAMED_CMD));
+  proto_read_reply(&rio, PROTO_FRAMED, &reply, &cap);
+
+  for (long i = 0; i < rounds; i++) {
+    for (size_t l = 0; l < NLINES; l++) {
+      Rio_writen(sv[0], (void *)lines[l], strlen(lines[l]));
+      if (proto_read_reply(&rio, PROTO_FRAMED, &reply, &cap) < 0) {
+        app_error("short reply");
+      }
+    }
+  }
+  Rio_writen(sv[0], "exit\n", 5);
+  proto_read_reply(&rio, PROTO_FRAMED, &reply, &cap);
+  Pthread_join(tid, NULL);
+  Close(sv[0]);
+  free(reply);
+}
+
+/**
+ * @brief Best time per request of @p run over REPEATS runs each with
+ * recording off and on, in ns. Runs alternate so drift hits both alike.
+ */
+static void best(void (*run)(long), long rounds, double ns[2]) {
+  double start, t;
+
+  ns[0] = ns[1] = 0;
+  for (int r = 0; r < 2 * REPEATS; r++) {
+    latency_enable(r & 1);
+    start = now_ns() / 1e9;
+    run(rounds);
+    t = (now_ns() / 1e9 - start) * 1e9 / (rounds * NLINES);
+    ns[r & 1] = !ns[r & 1] || t < ns[r & 1] ? t : ns[r & 1];
+  }
+}
+
+int main(int argc, char **argv) {
+  long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+  static void (*const runs[])(long) = {run_inline, run_socket};
+  static const char *names[] = {"inline", "socket"};
+  double ns[2];
+
+  for (int i = 0; i < BENCH_ITEMS; i++) {
+    insert(i + 1, 1000000, 100);
+  }
+
+  printf("1 in %d requests timed, best of %d runs\n", LATENCY_SAMPLE,
+         REPEATS);
+  printf("%-7s %10s %10s %10s\n", "setting", "off_ns", "on_ns", "overhead");
+  for (int r = 0; r < 2; r++) {
+    best(runs[r], r ? rounds / 10 : rounds * 5, ns);
+    printf("%-7s %10.1f %10.1f %9.1f%%\n", names[r], ns[0], ns[1],
+           100 * (ns[1] - ns[0]) / ns[0]);
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * bench_order.c - a rebalance as N separate trades against one order
+ *
+ * A client thread and a pool-style worker talk over a socketpair, like a
+ * served connection. Each rebalance buys one stock of half of N items and
+ * sells one of the other half, either as N buy/sell lines each waiting for
+ * its reply, as the same N lines pipelined in one write, or as a single
+ * `order` line with N legs.
+ */
+#include "command.h"
+
+#define DEFAULT_ROUNDS 20000
+#define BENCH_ITEMS ORDER_MAX_LEGS
+
+enum { SEPARATE, PIPELINED, ORDER, MODES };
+
+static void *worker(void *vargp) {
+  int fd = *(int *)vargp;
+
+  handle_threaded_connection(fd);
+  Close(fd);
+  return NULL;
+}
+
+/**
+ * @brief Run @p rounds rebalances of @p legs items in @p mode.
+ *
+ * @return Microseconds per rebalance.
+ */
+static double run(int mode, int legs, long rounds) {
+  char lines[ORDER_MAX_LEGS][32], batch[MAXLINE], *reply = NULL;
+  size_t cap = 0, len;
+  double start;
+  pthread_t tid;
+  int sv[2];
+  rio_t rio;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    unix_error("socketpair error");
+  }
+  Pthread_create(&tid, NULL, worker, &sv[1]);
+  Rio_readinitb(&rio, sv[0]);
+  Rio_writen(sv[0], PROTO_FRAMED_CMD, strlen(PROTO_FRAMED_CMD));
+  proto_read_reply(&rio, PROTO_FRAMED, &reply, &cap);
+
+  len = mode == ORDER ? sprintf(batch, "order") : 0;
+  for (int k = 0; k < legs; k++) {
+    sprintf(lines[k], "%s %d 1\n", k & 1 ? "sell" : "buy", k + 1);
+    len += sprintf(batch + len, mode == ORDER ? " %.*s" : "%.*s",
+                   (int)strlen(lines[k]) - (mode == ORDER), lines[k]);
+  }
+  if (mode == ORDER) {
+    len += sprintf(batch + len, "\n");
+  }
+
+  start = now_ns() / 1e9;
+  for (long i = 0; i < rounds; i++) {
+    if (mode == SEPARATE) {
+      for (int k = 0; k < legs; k++) {
+        Rio_writen(sv[0], lines[k], strlen(lines[k]));
+        proto_read_reply(&rio, PROTO_FRAMED, &reply, &cap);
+      }
+      continue;
+    }
+    Rio_writen(sv[0], batch, len);
+    for (int k = 0; k < (mode == ORDER ? 1 : legs); k++) {
+      if (proto_read_reply(&rio, PROTO_FRAMED, &reply, &cap) < 0) {
+        app_error("short reply");
+      }
+    }
+    if (mode == ORDER && strcmp(reply, "[order] success\n")) {
+      app_error("order failed");
+    }
+  }
+  start = (now_ns() / 1e9 - start) * 1e6 / rounds;
+
+  Rio_writen(sv[0], "exit\n", 5);
+  proto_read_reply(&rio, PROTO_FRAMED, &reply, &cap);
+  Pthread_join(tid, NULL);
+  Close(sv[0]);
+  free(reply);
+  return start;
+}
+
+int main(int argc, char **argv) {
+  long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+  double us[MODES];
+
+  for (int i = 0; i < BENCH_ITEMS; i++) {
+    insert(i + 1, 1000000, 100);
+  }
+
+  printf("%ld rebalances per run, us per rebalance\n", rounds);
+  printf("%-5s %10s %10s %10s %9s\n", "legs", "separate", "pipelined",
+         "order", "speedup");
+  for (int legs = 2; legs <= ORDER_MAX_LEGS; legs *= 2) {
+    for (int m = 0; m < MODES; m++) {
+      us[m] = run(m, legs, rounds);
+    }
+    printf("%-5d %10.2f %10.2f %10.2f %8.2fx\n", legs, us[SEPARATE],
+           us[PIPELINED], us[ORDER], us[SEPARATE] / us[ORDER]);
+  }
+  return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * bench_parse.c - request parsing cost, old strtok path against parse.c
+ *
+ * Both sides turn a request line into an operation and its arguments and
+ * render the fixed part of the reply, without touching the database. The
+ * legacy side is the handle_line() of before parse.c: copy, rtrim, strtok_r,
+ * strcmp chain, atoi and snprintf.
+ */
+#include "csapp.h"
+#include "misc.h"
+#include "parse.h"
+
+#define DEFAULT_ROUNDS 2000000
+#define REPLY_MAX 64
+
+static const char *lines[] = {
+    "buy 17 3\n", "sell 4096 25\n", "buy 123456 1\n", "sell 8 100\n",
+    "show 10 20\n", "lowstock 10\n", "stats\n", "buy x 1\n",
+};
+#define NLINES (sizeof(lines) / sizeof(lines[0]))
+
+static volatile long sink;
+
+static size_t legacy(const char *line, char *reply) {
+  char copy[MAXLINE], *args[MAX_COMMAND_ARGS], *next, *p;
+  size_t n = 0;
+
+  strcpy(copy, line);
+  for (p = strtok_r(rtrim(copy), DELIM_CHARS, &next); p;
+       p = strtok_r(NULL, DELIM_CHARS, &next)) {
+    if (n == MAX_COMMAND_ARGS) {
+      return snprintf(reply, REPLY_MAX, "invalid command\n");
+    }
+    args[n++] = p;
+  }
+  if (n == 1 && !strcmp(args[0], "stats")) {
+    return snprintf(reply, REPLY_MAX, "[stats] items %zu units %lld\n",
+                    (size_t)0, 0LL);
+  } else if (n == 2 && !strcmp(args[0], "lowstock")) {
+    sink += atoi(args[1]);
+    return snprintf(reply, REPLY_MAX, "[lowstock] %zu\n", (size_t)0);
+  } else if (n == 3 && !strcmp(args[0], "show")) {
+    sink += atoi(args[1]) + atoi(args[2]);
+    return 0;
+  } else if (n == 3) {
+    sink += atoi(args[1]) + atoi(args[2]);
+    return snprintf(reply, REPLY_MAX, "[%s] success\n", args[0]);
+  }
+  return snprintf(reply, REPLY_MAX, "invalid command\n");
+}
+
+static size_t current(const char *line, char *reply) {
+  static const char buy[] = "[buy] success\n", sell[] = "[sell] success\n",
+                    invalid[] = "invalid command\n";
+  cmd_request req;
+
+  switch (parse_request(line, &req)) {
+  case REQ_BUY:
+    sink += req.arg[0] + req.arg[1];
+    memcpy(reply, buy, sizeof(buy) - 1);
+    return sizeof(buy) - 1;
+  case REQ_SELL:
+    sink += req.arg[0] + req.arg[1];
+    memcpy(reply, sell, sizeof(sell) - 1);
+    return sizeof(sell) - 1;
+  case REQ_SHOW_RANGE:
+  case REQ_LOWSTOCK:
+  case REQ_STATS:
+    sink += req.arg[0];
+    return 0;
+  default:
+    memcpy(reply, invalid, sizeof(invalid) - 1);
+    return sizeof(invalid) - 1;
+  }
+}
+
+int main(int argc, char **argv) {
+  static size_t (*const impls[])(const char *, char *) = {legacy, current};
+  static const char *names[] = {"legacy", "parse"};
+  long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+  char reply[REPLY_MAX];
+  double ns[2];
+
+  printf("%ld lines per parser\n", rounds * (long)NLINES);
+  printf("%-7s %10s %10s\n", "parser", "ns/line", "relative");
+  for (int k = 0; k < 2; k++) {
+    double start = now_ns() / 1e9;
+    for (long r = 0; r < rounds; r++) {
+      for (size_t i = 0; i < NLINES; i++) {
+        sink += impls[k](lines[i], reply);
+      }
+    }
+    ns[k] = (now_ns() / 1e9 - start) * 1e9 / (rounds * NLINES);
+    printf("%-7s %10.1f %9.2fx\n", names[k], ns[k], ns[0] / ns[k]);
+  }
+  return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * bench_scan.c - aggregate scan throughput of each kernel
+ */
+#include "soa.h"
+
+#define DEFAULT_ITEMS 20000000
+#define ROUNDS 5
+#define THRESHOLD 100
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : DEFAULT_ITEMS;
+  soa_t soa = SOA_INITIALIZER;
+  int64_t units[3], value[3];
+  size_t below[3];
+  unsigned seed = 7;
+
+  soa_init(&soa, n);
+  for (long i = 0; i < n; i++) {
+    soa_append(&soa, i, rand_r(&seed) % 1000, rand_r(&seed) % 10000 + 1);
+  }
+
+  printf("%ld items, best of %d rounds\n", n, ROUNDS);
+  printf("%-7s %10s %10s %13s\n", "kernel", "units_ms", "value_ms",
+         "lowstock_ms");
+  for (int k = SOA_SCALAR; k <= SOA_AVX2; k++) {
+    double best[3] = {1e9, 1e9, 1e9}, start;
+
+    if ((int)soa_use_kernel((soa_kernel)k) != k) {
+      printf("%-7s not supported\n", soa_kernel_name((soa_kernel)k));
+      continue;
+    }
+    for (int r = 0; r < ROUNDS; r++) {
+      start = now_ns() / 1e9;
+      units[k] = soa_units(&soa);
+      best[0] = fmin(best[0], now_ns() / 1e9 - start);
+      start = now_ns() / 1e9;
+      value[k] = soa_value(&soa);
+      best[1] = fmin(best[1], now_ns() / 1e9 - start);
+      start = now_ns() / 1e9;
+      below[k] = soa_count_below(&soa, THRESHOLD);
+      best[2] = fmin(best[2], now_ns() / 1e9 - start);
+    }
+    printf("%-7s %10.2f %10.2f %13.2f\n", soa_kernel_name((soa_kernel)k),
+           best[0] * 1e3, best[1] * 1e3, best[2] * 1e3);
+    if (units[k] != units[0] || value[k] != value[0] || below[k] != below[0]) {
+      app_error("kernels disagree");
+    }
+  }
+  printf("units %lld, value %lld, below %d: %zu\n", (long long)units[0],
+         (long long)value[0], THRESHOLD, below[0]);
+  return 0;
+}
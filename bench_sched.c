@@ -0,0 +1,123 @@
+/*
+ * bench_sched.c - trade latency while clients keep asking for show
+ *
+ * Trader threads send buy and sell lines through handle_line() and time
+ * each one, while scanner threads send show lines back to back, like many
+ * clients refreshing a full listing. The same load runs first with scans
+ * executed on the threads that receive them, then with the scan pool
+ * started, and the per-class report of admin sched is printed at the end.
+ */
+#include "command.h"
+
+#define DEFAULT_TRADERS 2
+#define DEFAULT_SCANNERS 8
+#define DEFAULT_SECONDS 2
+#define BENCH_ITEMS 100000
+
+struct __trader {
+  unsigned seed;
+  long trades;
+  hist_t lat;
+};
+
+static volatile int stop;
+static long scans;
+
+static void *trader(void *vargp) {
+  struct __trader *t = (struct __trader *)vargp;
+  cmd_session session = {.mode = PROTO_FRAMED};
+  cmd_response response;
+  char line[64];
+  uint64_t start;
+  int r;
+
+  while (!stop) {
+    r = rand_r(&t->seed);
+    snprintf(line, sizeof(line), "%s %d 1\n", r & 1 ? "buy" : "sell",
+             (r >> 1) % BENCH_ITEMS + 1);
+    start = now_ns();
+    response_init(&response);
+    handle_line(&session, line, &response);
+    response_release(&response);
+    hist_record(&t->lat, now_ns() - start);
+    t->trades++;
+  }
+  return NULL;
+}
+
+static void *scanner(void *vargp) {
+  cmd_session session = {.mode = PROTO_FRAMED};
+  cmd_response response;
+  char line[] = "show\n";
+
+  while (!stop) {
+    response_init(&response);
+    handle_line(&session, line, &response);
+    response_release(&response);
+    __atomic_add_fetch(&scans, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Run @p ntraders traders against @p nscanners scanners for
+ * @p seconds, and print a line of results labelled @p name.
+ */
+static void run(const char *name, int ntraders, int nscanners, int seconds) {
+  struct __trader t[ntraders];
+  pthread_t tids[ntraders + nscanners];
+  long trades = 0;
+  hist_t lat;
+
+  stop = 0;
+  scans = 0;
+  hist_init(&lat);
+  for (int i = 0; i < ntraders; i++) {
+    t[i] = (struct __trader){.seed = i + 1};
+    hist_init(&t[i].lat);
+    Pthread_create(&tids[i], NULL, trader, &t[i]);
+  }
+  for (int i = 0; i < nscanners; i++) {
+    Pthread_create(&tids[ntraders + i], NULL, scanner, NULL);
+  }
+  sleep(seconds);
+  stop = 1;
+  for (int i = 0; i < ntraders + nscanners; i++) {
+    Pthread_join(tids[i], NULL);
+  }
+  for (int i = 0; i < ntraders; i++) {
+    hist_merge(&lat, &t[i].lat);
+    trades += t[i].trades;
+  }
+  printf("%-8s %10.0f %8.1f %8.1f %8.1f %8.1f %9.1f\n", name,
+         (double)trades / seconds, hist_percentile(&lat, 0.5) / 1e3,
+         hist_percentile(&lat, 0.99) / 1e3, hist_percentile(&lat, 0.999) / 1e3,
+         lat.max / 1e3, (double)scans / seconds);
+}
+
+int main(int argc, char **argv) {
+  int ntraders = argc > 1 ? atoi(argv[1]) : DEFAULT_TRADERS;
+  int nscanners = argc > 2 ? atoi(argv[2]) : DEFAULT_SCANNERS;
+  int seconds = argc > 3 ? atoi(argv[3]) : DEFAULT_SECONDS;
+  cmd_session session = {.mode = PROTO_LEGACY};
+  cmd_response response;
+  char line[] = "admin sched\n";
+
+  for (int id = 1; id <= BENCH_ITEMS; id++) {
+    insert(id, 1000000, 100);
+  }
+
+  printf("%d traders, %d clients looping show over %d items, latency in us\n",
+         ntraders, nscanners, BENCH_ITEMS);
+  printf("%-8s %10s %8s %8s %8s %8s %9s\n", "scans", "trades/s", "p50",
+         "p99", "p99.9", "max", "shows/s");
+  run("inline", ntraders, nscanners, seconds);
+  scan_start(SCAN_DEFAULT_THREADS);
+  run("pool", ntraders, nscanners, seconds);
+
+  response_init(&response);
+  handle_line(&session, line, &response);
+  printf("\n%.*s", (int)response.len, response.data);
+  response_release(&response);
+  return 0;
+}
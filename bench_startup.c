@@ -0,0 +1,73 @@
+/*
+ * bench_startup.c - time to load a large database in each format
+ *
+ * Writes a text database of the given number of items, converts it, then
+ * loads each file in a fresh process. The files stay in the page cache, so
+ * this measures parsing and index building rather than the disk.
+ */
+#include <sys/wait.h>
+
+#include "stock.h"
+
+#define DEFAULT_ITEMS 1000000
+
+/**
+ * @brief Load @p path in a child process, optionally saving it as @p out.
+ *
+ * @return Seconds spent in stock_load().
+ */
+static double load(const char *path, const char *out) {
+  double *elapsed = Mmap(NULL, sizeof(double), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  double start, result;
+
+  if (Fork() == 0) {
+    start = now_ns() / 1e9;
+    stock_load(path);
+    *elapsed = now_ns() / 1e9 - start;
+    if (out) {
+      stock_save(out, STOCK_FORMAT_BINARY, 0);
+    }
+    exit(0);
+  }
+  Wait(NULL);
+  result = *elapsed;
+  Munmap(elapsed, sizeof(double));
+  return result;
+}
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : DEFAULT_ITEMS;
+  const char *dir = argc > 2 ? argv[2] : ".";
+  char text[MAXLINE], bin[MAXLINE];
+  unsigned seed = 1;
+  double t_text, t_bin;
+  struct stat st_text, st_bin;
+  FILE *fp;
+
+  snprintf(text, sizeof(text), "%s/bench_startup.txt", dir);
+  snprintf(bin, sizeof(bin), "%s/bench_startup.bin", dir);
+  fp = Fopen(text, "w");
+  for (long i = 0; i < n; i++) {
+    fprintf(fp, "%ld %d %d\n", i * 3 + 1, rand_r(&seed) % 100000,
+            rand_r(&seed) % 10000);
+  }
+  Fclose(fp);
+
+  t_text = load(text, bin);
+  t_bin = load(bin, NULL);
+  Stat(text, &st_text);
+  Stat(bin, &st_bin);
+
+  printf("%ld items\n", n);
+  printf("%-7s %12s %10s %14s\n", "format", "bytes", "load_ms", "items/s");
+  printf("%-7s %12lld %10.1f %14.0f\n", "text", (long long)st_text.st_size,
+         t_text * 1e3, n / t_text);
+  printf("%-7s %12lld %10.1f %14.0f\n", "binary", (long long)st_bin.st_size,
+         t_bin * 1e3, n / t_bin);
+  printf("binary loads %.1fx faster\n", t_text / t_bin);
+
+  unlink(text);
+  unlink(bin);
+  return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * bench_trade.c - contention benchmark for buy/sell on a single hot item
+ *
+ * Compares the lock-free stock_add() path against the reader/writer sem_t
+ * path the server used before.
+ */
+#include "stock.h"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_OPS 200000
+
+/* item layout and locking of the previous sem_t based trade path */
+struct __legacy_item {
+  int id;
+  int count;
+  int price;
+  int read_cnt;
+  sem_t r_mutex;
+  sem_t w_mutex;
+};
+
+static struct __legacy_item legacy;
+static stock_item *hot; /* in the database, so trades update its columns */
+static int ops_per_thread = DEFAULT_OPS;
+static volatile int negative_seen;
+
+static int legacy_buy(struct __legacy_item *item, int n) {
+  int is_number_valid;
+
+  P(&item->r_mutex);
+  if (++item->read_cnt == 1) {
+    P(&item->w_mutex);
+  }
+  V(&item->r_mutex);
+
+  is_number_valid = item->count >= n;
+
+  P(&item->r_mutex);
+  if (--item->read_cnt == 0) {
+    V(&item->w_mutex);
+  }
+  V(&item->r_mutex);
+
+  if (is_number_valid) {
+    P(&item->w_mutex);
+    item->count -= n;
+    if (item->count < 0) {
+      negative_seen = 1;
+    }
+    V(&item->w_mutex);
+  }
+  return is_number_valid;
+}
+
+static void legacy_sell(struct __legacy_item *item, int n) {
+  P(&item->w_mutex);
+  item->count += n;
+  V(&item->w_mutex);
+}
+
+static void *legacy_worker(void *vargp) {
+  for (int i = 0; i < ops_per_thread; i++) {
+    if (i & 1) {
+      legacy_sell(&legacy, 1);
+    } else {
+      legacy_buy(&legacy, 1);
+    }
+  }
+  return NULL;
+}
+
+static void *atomic_worker(void *vargp) {
+  for (int i = 0; i < ops_per_thread; i++) {
+    stock_add(hot, (i & 1) ? 1 : -1);
+  }
+  return NULL;
+}
+
+static double run(void *(*worker)(void *), int nthreads) {
+  pthread_t tids[nthreads];
+  double start = now_ns() / 1e9;
+  for (int i = 0; i < nthreads; i++) {
+    Pthread_create(&tids[i], NULL, worker, NULL);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    Pthread_join(tids[i], NULL);
+  }
+  return (double)nthreads * ops_per_thread / (now_ns() / 1e9 - start);
+}
+
+int main(int argc, char **argv) {
+  int max_threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+  double sem_rate, cas_rate;
+
+  if (argc > 2) {
+    ops_per_thread = atoi(argv[2]);
+  }
+
+  printf("%-8s %14s %14s %8s\n", "threads", "sem_t ops/s", "cas ops/s",
+         "speedup");
+  for (int n = 1; n <= max_threads; n *= 2) {
+    // start near zero so buys regularly race with each other
+    legacy = (struct __legacy_item){.id = 1, .count = n / 2};
+    Sem_init(&legacy.r_mutex, 0, 1);
+    Sem_init(&legacy.w_mutex, 0, 1);
+    if (!hot) {
+      insert(1, n / 2, 0);
+      hot = search_stock(1);
+    }
+    stock_add(hot, n / 2 - hot->count);
+
+    sem_rate = run(legacy_worker, n);
+    cas_rate = run(atomic_worker, n);
+    printf("%-8d %14.0f %14.0f %7.2fx\n", n, sem_rate, cas_rate,
+           cas_rate / sem_rate);
+  }
+  printf("sem_t path went negative: %s\n", negative_seen ? "yes" : "no");
+  return 0;
+}
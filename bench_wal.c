@@ -0,0 +1,83 @@
+/*
+ * bench_wal.c - throughput cost of each trade log durability level
+ *
+ * Every thread trades in a loop and commits after each trade, like a client
+ * sending one order per round trip. Run it on the file system the server
+ * will log to: fsync cost differs wildly between tmpfs, SSDs and disks.
+ */
+#include "stock.h"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_SECONDS 2
+#define BENCH_ITEMS 64
+
+static volatile int stop;
+static stock_item *items[BENCH_ITEMS];
+
+static void *worker(void *vargp) {
+  long *ops = vargp;
+  unsigned seed = (unsigned)(uintptr_t)vargp;
+
+  while (!stop) {
+    stock_add(items[rand_r(&seed) % BENCH_ITEMS], (*ops & 1) ? 1 : -1);
+    wal_commit();
+    (*ops)++;
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  static const char *names[] = {"off", "async", "group", "sync"};
+  int nthreads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+  const char *dir = argc > 2 ? argv[2] : ".";
+  long budgets[] = {100, 1000, 5000};
+  char path[MAXLINE];
+  double base = 0;
+
+  snprintf(path, sizeof(path), "%s/bench_wal.log", dir);
+  for (int i = 0; i < BENCH_ITEMS; i++) {
+    insert(i + 1, 1000000, 100);
+    items[i] = search_stock(i + 1);
+  }
+
+  printf("%d threads, log at %s\n", nthreads, path);
+  printf("%-6s %10s %14s %10s\n", "level", "budget_us", "trades/s", "relative");
+  for (int level = WAL_OFF; level <= WAL_SYNC; level++) {
+    for (int b = 0; b < 3; b++) {
+      pthread_t tids[nthreads];
+      long ops[nthreads];
+      long total = 0;
+      double start, elapsed;
+
+      if ((level == WAL_OFF || level == WAL_SYNC) && b) {
+        continue; // budget does not apply
+      }
+      unlink(path);
+      wal_open(path, (wal_level)level, budgets[b]);
+
+      stop = 0;
+      start = now_ns() / 1e9;
+      for (int t = 0; t < nthreads; t++) {
+        ops[t] = t;
+        Pthread_create(&tids[t], NULL, worker, &ops[t]);
+      }
+      usleep(DEFAULT_SECONDS * 1000000);
+      stop = 1;
+      for (int t = 0; t < nthreads; t++) {
+        Pthread_join(tids[t], NULL);
+        total += ops[t] - t;
+      }
+      elapsed = now_ns() / 1e9 - start;
+      wal_close();
+
+      if (level == WAL_OFF) {
+        base = total / elapsed;
+      }
+      printf("%-6s %10ld %14.0f %9.2f%%\n", names[level],
+             (level == WAL_OFF || level == WAL_SYNC) ? 0 : budgets[b],
+             total / elapsed, 100 * total / elapsed / base);
+    }
+  }
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,437 @@
+#include "book.h"
+
+/* every order node, indexed by the low bits of an order id. only address
+ * space is reserved, and node 0 is never handed out so that no id is 0 */
+static book_order *orders;
+static int orders_next = 1;     /* nodes from here on were never used */
+static book_order *orders_free; /* given back by books, linked by next */
+static pthread_mutex_t orders_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* books by item id, created on the first limit order for the item */
+static hash_t books = HASH_INITIALIZER;
+static pthread_mutex_t books_mutex = PTHREAD_MUTEX_INITIALIZER;
+static slab_t book_slab = SLAB_INITIALIZER(sizeof(book_t), BOOK_SLAB_BOOKS);
+static slab_t level_slab =
+    SLAB_INITIALIZER(sizeof(book_level), BOOK_SLAB_LEVELS);
+
+static void __init_orders(void) {
+  orders = (book_order *)Mmap(NULL, BOOK_MAX_ORDERS * sizeof(book_order),
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                              0);
+}
+
+/**
+ * @brief Reserve the order nodes on first use.
+ */
+static void __reserve_orders(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  Pthread_once(&once, __init_orders);
+}
+
+/**
+ * @brief Book of @p item, created if @p create is set and it has none yet.
+ *
+ * @return The book, NULL if there is none.
+ */
+static book_t *__book_of(const stock_item *item, int create) {
+  book_t *book = hash_search(&books, item->id);
+
+  if (book || !create) {
+    return book;
+  }
+  __reserve_orders();
+  pthread_mutex_lock(&books_mutex);
+  if (!(book = hash_search(&books, item->id))) {
+    book = (book_t *)slab_alloc(&book_slab);
+    pthread_mutex_init(&book->mutex, NULL);
+    book->id = item->id;
+    hash_insert(&books, item->id, book);
+  }
+  pthread_mutex_unlock(&books_mutex);
+  return book;
+}
+
+/**
+ * @brief Heap order of the level with @p key, a bit mix of the key so that
+ * the treap stays balanced however prices arrive.
+ */
+static inline uint32_t __prio(int key) {
+  uint32_t h = (uint32_t)key;
+
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  return h ^ h >> 16;
+}
+
+/**
+ * @brief Link @p level into the treap below @p link, rotating it up past
+ * every ancestor of lower priority.
+ */
+static void __treap_insert(book_level **link, book_level *level) {
+  book_level *t = *link, *c;
+  int dir;
+
+  if (!t) {
+    *link = level;
+    return;
+  }
+  dir = level->key > t->key;
+  __treap_insert(&t->child[dir], level);
+  if ((c = t->child[dir])->prio > t->prio) {
+    t->child[dir] = c->child[!dir];
+    c->child[!dir] = t;
+    *link = c;
+  }
+}
+
+/**
+ * @brief Unlink the level with @p key from the treap below @p link by
+ * rotating it down until it is a leaf.
+ */
+static void __treap_remove(book_level **link, int key) {
+  book_level *t, *c;
+  int dir;
+
+  while ((t = *link)->key != key) {
+    link = &t->child[key > t->key];
+  }
+  while (t->child[0] || t->child[1]) {
+    dir = !t->child[0] ||
+          (t->child[1] && t->child[1]->prio > t->child[0]->prio);
+    c = t->child[dir];
+    t->child[dir] = c->child[!dir];
+    c->child[!dir] = t;
+    *link = c;
+    link = &c->child[!dir];
+  }
+  *link = NULL;
+}
+
+/**
+ * @brief Level at @p price on @p side of @p book, added if there is none.
+ */
+static book_level *__level_get(book_t *book, book_side side, int price) {
+  struct __book_tree *tree = &book->sides[side];
+  int key = side == BOOK_BUY ? -price : price;
+  book_level *level = tree->root;
+
+  while (level && level->key != key) {
+    level = level->child[key > level->key];
+  }
+  if (level) {
+    return level;
+  }
+  if ((level = book->spare_levels)) {
+    book->spare_levels = level->child[0];
+    memset(level, 0, sizeof(*level));
+  } else {
+    level = (book_level *)slab_alloc(&level_slab);
+  }
+  level->key = key;
+  level->price = price;
+  level->prio = __prio(key);
+  level->side = side;
+  __treap_insert(&tree->root, level);
+  if (!tree->best || key < tree->best->key) {
+    tree->best = level;
+  }
+  tree->nlevels++;
+  return level;
+}
+
+/**
+ * @brief Remove emptied @p level from @p book and keep it for reuse.
+ */
+static void __level_put(book_t *book, book_level *level) {
+  struct __book_tree *tree = &book->sides[level->side];
+  book_level *best;
+
+  __treap_remove(&tree->root, level->key);
+  if (tree->best == level) {
+    for (best = tree->root; best && best->child[0]; best = best->child[0]) {
+    }
+    tree->best = best;
+  }
+  tree->nlevels--;
+  level->child[0] = book->spare_levels;
+  book->spare_levels = level;
+}
+
+/**
+ * @brief Take an order node for @p book, from its spares if it has any.
+ * Call with the book locked.
+ *
+ * @return The node with a fresh order id, NULL if every node is in use.
+ */
+static book_order *__order_get(book_t *book) {
+  book_order *o;
+
+  if ((o = book->spare_orders)) {
+    book->spare_orders = o->next;
+    book->nspare--;
+  } else {
+    pthread_mutex_lock(&orders_mutex);
+    if ((o = orders_free)) {
+      orders_free = o->next;
+    } else if (orders_next < BOOK_MAX_ORDERS) {
+      o = &orders[orders_next];
+      __atomic_store_n(&orders_next, orders_next + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&orders_mutex);
+    if (!o) {
+      return NULL;
+    }
+  }
+  // a new generation, so ids of earlier orders on the node no longer match
+  o->gen = o->gen == BOOK_GEN_MAX ? 1 : o->gen + 1;
+  o->oid = o->gen << BOOK_ORDER_BITS | (int)(o - orders);
+  o->prev = o->next = NULL;
+  __atomic_store_n(&o->book, book, __ATOMIC_RELEASE);
+  return o;
+}
+
+/**
+ * @brief Give order node @p o back to @p book. Once it keeps more than
+ * BOOK_SPARE_ORDERS spares, half of them go back to the shared list in one
+ * locked step. Call with the book locked.
+ */
+static void __order_put(book_t *book, book_order *o) {
+  book_order *first, *last;
+
+  __atomic_store_n(&o->book, NULL, __ATOMIC_RELAXED);
+  o->oid = 0;
+  o->next = book->spare_orders;
+  book->spare_orders = o;
+  if (++book->nspare <= BOOK_SPARE_ORDERS) {
+    return;
+  }
+  first = last = book->spare_orders;
+  for (int i = 1; i < BOOK_SPARE_ORDERS / 2; i++) {
+    last = last->next;
+  }
+  book->spare_orders = last->next;
+  book->nspare -= BOOK_SPARE_ORDERS / 2;
+  pthread_mutex_lock(&orders_mutex);
+  last->next = orders_free;
+  orders_free = first;
+  pthread_mutex_unlock(&orders_mutex);
+}
+
+/**
+ * @brief Take order @p o out of its level, dropping the level once it is
+ * empty, and free the node. Call with the book locked.
+ */
+static void __order_remove(book_t *book, book_order *o) {
+  book_level *level = o->level;
+
+  level->qty -= o->qty;
+  book->sides[level->side].qty -= o->qty;
+  if (o->prev) {
+    o->prev->next = o->next;
+  } else {
+    level->head = o->next;
+  }
+  if (o->next) {
+    o->next->prev = o->prev;
+  } else {
+    level->tail = o->prev;
+  }
+  if (!level->head) {
+    __level_put(book, level);
+  }
+  __order_put(book, o);
+}
+
+/**
+ * @brief Whether the count of @p item covers selling @p qty on top of every
+ * ask resting in @p book, which may be NULL. Call with the book locked.
+ */
+static inline int __covered(const book_t *book, const stock_item *item,
+                            int qty) {
+  int64_t asks = book ? book->sides[BOOK_SELL].qty : 0;
+
+  return qty + asks <= stock_count(item);
+}
+
+/**
+ * @brief Match up to @p qty against the opposite side of @p side in
+ * price-time priority, at the price of each resting order. Call with the
+ * book locked.
+ * @note Each match is a sale out of the count of @p item, settled with
+ * stock_add() so that it is logged like a buy. Plain buys may have taken
+ * the stock since the sell was placed: an ask left uncovered is dropped,
+ * and an incoming sell stops.
+ *
+ * @param[in,out] qty Quantity to match, left unmatched on return
+ * @param limit Worst key of the opposite side to trade at, INT_MAX for any
+ * @return BOOK_OK, or BOOK_SHORT if the incoming sell ran out of stock.
+ */
+static book_status __match(book_t *book, stock_item *item, book_side side,
+                           int *qty, int limit, book_fill *fill) {
+  struct __book_tree *tree = &book->sides[!side];
+  book_level *level;
+  book_order *o;
+  int n;
+
+  while (*qty && (level = tree->best) && level->key <= limit) {
+    o = level->head;
+    n = *qty < o->qty ? *qty : o->qty;
+    if (stock_add(item, -n) != STOCK_SUCCESS) {
+      if (side == BOOK_SELL) {
+        return BOOK_SHORT;
+      }
+      __order_remove(book, o);
+      continue;
+    }
+    o->qty -= n;
+    level->qty -= n;
+    tree->qty -= n;
+    *qty -= n;
+    fill->filled += n;
+    fill->value += (int64_t)n * level->price;
+    if (!o->qty) {
+      __order_remove(book, o);
+    }
+  }
+  return BOOK_OK;
+}
+
+/**
+ * @brief Place a limit order for @p qty of @p item at @p price.
+ * @note It first trades with the best prices of the other side that are at
+ * least as good as @p price, oldest order first within a price, and the
+ * rest waits in the book. Finding the best price and the level to rest at
+ * are O(log n) in the number of prices on a side; each resting order hit
+ * is O(1). A sell is only taken if the count of @p item covers it together
+ * with the asks already resting.
+ *
+ * @param qty Quantity, positive
+ * @param price Worst price to trade at, positive
+ * @param[out] fill What was matched, and the id of the order left resting
+ * @return BOOK_OK, BOOK_SHORT if the count does not cover the sell, or
+ * BOOK_FULL if the rest could not be placed. Whatever matched stays matched
+ * either way, and nothing rests unless BOOK_OK is returned.
+ */
+book_status book_limit(stock_item *item, book_side side, int qty, int price,
+                       book_fill *fill) {
+  book_t *book = __book_of(item, 1);
+  book_status status = BOOK_SHORT;
+  book_level *level;
+  book_order *o;
+
+  *fill = (book_fill){0};
+  pthread_mutex_lock(&book->mutex);
+  if (side == BOOK_BUY || __covered(book, item, qty)) {
+    status = __match(book, item, side, &qty,
+                     side == BOOK_BUY ? price : -price, fill);
+  }
+  if (status == BOOK_OK && qty > 0) {
+    if ((o = __order_get(book))) {
+      level = __level_get(book, side, price);
+      o->qty = qty;
+      o->level = level;
+      o->prev = level->tail;
+      if (level->tail) {
+        level->tail->next = o;
+      } else {
+        level->head = o;
+      }
+      level->tail = o;
+      level->qty += qty;
+      book->sides[side].qty += qty;
+      fill->oid = o->oid;
+    } else {
+      status = BOOK_FULL;
+    }
+  }
+  pthread_mutex_unlock(&book->mutex);
+  debug_print("limit %s id=%d filled %d, order %d", side ? "sell" : "buy",
+              item->id, fill->filled, fill->oid);
+  return status;
+}
+
+/**
+ * @brief Trade up to @p qty of @p item at the best prices on offer. Nothing
+ * is left in the book.
+ *
+ * @param[out] fill What was matched
+ * @return BOOK_OK, or BOOK_SHORT if the count of @p item does not cover a
+ * sell together with the asks already resting.
+ */
+book_status book_market(stock_item *item, book_side side, int qty,
+                        book_fill *fill) {
+  book_t *book = __book_of(item, 0);
+  book_status status = BOOK_SHORT;
+
+  *fill = (book_fill){0};
+  if (!book) {
+    return side == BOOK_BUY || __covered(NULL, item, qty) ? BOOK_OK
+                                                           : BOOK_SHORT;
+  }
+  pthread_mutex_lock(&book->mutex);
+  if (side == BOOK_BUY || __covered(book, item, qty)) {
+    status = __match(book, item, side, &qty, INT_MAX, fill);
+  }
+  pthread_mutex_unlock(&book->mutex);
+  return status;
+}
+
+/**
+ * @brief Cancel resting order @p oid.
+ * @note The node of an order id is found directly, and its generation tells
+ * a live order from an earlier one that used the node.
+ *
+ * @param[out] qty Quantity that was still open
+ * @return BOOK_OK, or BOOK_NO_ORDER if @p oid is not resting.
+ */
+book_status book_cancel(int oid, int *qty) {
+  int idx = oid & (BOOK_MAX_ORDERS - 1);
+  book_order *o;
+  book_t *book;
+
+  if (oid <= 0 || !idx ||
+      idx >= __atomic_load_n(&orders_next, __ATOMIC_ACQUIRE)) {
+    return BOOK_NO_ORDER;
+  }
+  o = &orders[idx];
+  if (!(book = __atomic_load_n(&o->book, __ATOMIC_ACQUIRE))) {
+    return BOOK_NO_ORDER;
+  }
+  pthread_mutex_lock(&book->mutex);
+  // the node may have been filled or moved to another book meanwhile
+  if (__atomic_load_n(&o->book, __ATOMIC_RELAXED) != book || o->oid != oid) {
+    pthread_mutex_unlock(&book->mutex);
+    return BOOK_NO_ORDER;
+  }
+  *qty = o->qty;
+  __order_remove(book, o);
+  pthread_mutex_unlock(&book->mutex);
+  return BOOK_OK;
+}
+
+/**
+ * @brief Best price on @p side of the book of @p item.
+ *
+ * @param[out] price Best price, untouched if the side is empty
+ * @param[out] qty Quantity resting at that price
+ * @return 1 if the side has any order, 0 otherwise.
+ */
+int book_top(const stock_item *item, book_side side, int *price,
+             int64_t *qty) {
+  book_t *book = __book_of(item, 0);
+  book_level *best;
+
+  if (!book) {
+    return 0;
+  }
+  pthread_mutex_lock(&book->mutex);
+  if ((best = book->sides[side].best)) {
+    *price = best->price;
+    *qty = best->qty;
+  }
+  pthread_mutex_unlock(&book->mutex);
+  return best != NULL;
+}
@@ -0,0 +1,94 @@
+#ifndef __BOOK_H__
+#define __BOOK_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+#include "misc.h"
+#include "slab.h"
+#include "stock.h"
+
+/* order ids are a reuse generation above the index of the order's node */
+#define BOOK_ORDER_BITS 20
+/* most orders resting at once, over every book */
+#define BOOK_MAX_ORDERS (1 << BOOK_ORDER_BITS)
+#define BOOK_GEN_MAX ((1 << (31 - BOOK_ORDER_BITS)) - 1)
+/* freed order nodes a book keeps for itself before giving them back */
+#define BOOK_SPARE_ORDERS 64
+/* levels and books per slab chunk */
+#define BOOK_SLAB_LEVELS 1024
+#define BOOK_SLAB_BOOKS 256
+
+enum __book_side {
+  BOOK_BUY = 0, /* bids */
+  BOOK_SELL,    /* asks */
+};
+
+enum __book_status {
+  BOOK_OK = 0,
+  BOOK_FULL,     /* no order node left to rest the order on */
+  BOOK_NO_ORDER, /* cancelled, filled or never placed */
+  BOOK_SHORT,    /* the item count does not cover the sell */
+};
+
+/* an order resting in a book */
+struct __book_order {
+  int oid;  /* 0 while free */
+  int gen;  /* reuse generation of this node */
+  int qty;  /* left to fill */
+  struct __book_order *prev, *next; /* in its level, next links spares */
+  struct __book_level *level;
+  struct __book *book; /* NULL while free */
+};
+
+/* every order at one price of one side, oldest first */
+struct __book_level {
+  int key;  /* price, negated for bids so the best level has the least key */
+  int price;
+  uint32_t prio; /* treap heap order, a hash of the key */
+  int side;
+  int64_t qty;   /* resting in all of its orders */
+  struct __book_level *child[2];
+  struct __book_order *head, *tail;
+};
+
+struct __book_tree {
+  struct __book_level *root; /* treap ordered by key */
+  struct __book_level *best; /* leftmost */
+  size_t nlevels;
+  int64_t qty; /* resting in all of its levels */
+};
+
+/* bid and ask side of one item */
+struct __book {
+  pthread_mutex_t mutex;
+  int id;
+  struct __book_tree sides[2];
+  struct __book_level *spare_levels; /* emptied levels, linked by child[0] */
+  struct __book_order *spare_orders;
+  int nspare;
+};
+
+/* outcome of a limit or market order */
+struct __book_fill {
+  int oid;       /* id of the resting remainder, 0 if nothing rests */
+  int filled;    /* quantity matched */
+  int64_t value; /* sum of quantity times price over every match */
+};
+
+typedef enum __book_side book_side;
+typedef enum __book_status book_status;
+typedef struct __book_order book_order;
+typedef struct __book_level book_level;
+typedef struct __book book_t;
+typedef struct __book_fill book_fill;
+
+book_status book_limit(stock_item *item, book_side side, int qty, int price,
+                       book_fill *fill);
+book_status book_market(stock_item *item, book_side side, int qty,
+                        book_fill *fill);
+book_status book_cancel(int oid, int *qty);
+int book_top(const stock_item *item, book_side side, int *price,
+             int64_t *qty);
+
+#endif /* __BOOK_H__ */
@@ -0,0 +1,335 @@
+#include "btree.h"
+
+#include "csapp.h"
+#include "misc.h"
+
+/**
+ * @brief Allocate an empty, cache line aligned node from the slab of @p tree.
+ *
+ * @param leaf Non-zero when the node is a leaf.
+ * @return Pointer to the new node.
+ */
+static btree_node *__node_new(btree_t *tree, int leaf) {
+  btree_node *node = (btree_node *)slab_alloc(&tree->nodes);
+  node->leaf = leaf;
+  return node;
+}
+
+/**
+ * @brief Number of keys in @p node that are less than @p key.
+ * @note Scans the whole key line without early exit. The keys share a single
+ * cache line, so this is cheaper than a branchy binary search.
+ */
+static inline int __lower_bound(const btree_node *node, int key) {
+  int pos = 0;
+  for (int i = 0; i < node->nkeys; i++) {
+    pos += node->keys[i] < key;
+  }
+  return pos;
+}
+
+/**
+ * @brief Number of keys in @p node that are less than or equal to @p key.
+ */
+static inline int __upper_bound(const btree_node *node, int key) {
+  int pos = 0;
+  for (int i = 0; i < node->nkeys; i++) {
+    pos += node->keys[i] <= key;
+  }
+  return pos;
+}
+
+/**
+ * @brief Descend from the root to the leaf that may hold @p key.
+ */
+static btree_node *__find_leaf(const btree_t *tree, int key) {
+  btree_node *node = tree->root;
+  while (node && !node->leaf) {
+    node = node->child[__upper_bound(node, key)];
+  }
+  return node;
+}
+
+/**
+ * @brief Insert @p key into leaf @p node, splitting it when full.
+ *
+ * @param rightmost Non-zero when @p node is the last leaf. Appending to the
+ * last leaf leaves it full instead of halving it, so loading keys in sorted
+ * order packs every leaf.
+ * @param[out] up_key First key of the new right sibling, if one was created.
+ * @param[out] found Existing value for @p key, left untouched on insertion.
+ * @return Newly created right sibling, or NULL if no split happened.
+ */
+static btree_node *__insert_leaf(btree_t *tree, btree_node *node, int key,
+                                 void *val, int rightmost, int *up_key,
+                                 void **found) {
+  int keys[BTREE_KEYS + 1];
+  void *vals[BTREE_KEYS + 1];
+  int pos = __lower_bound(node, key);
+  int n = node->nkeys, lsz;
+  btree_node *right;
+
+  if (pos < n && node->keys[pos] == key) {
+    *found = node->val[pos];
+    return NULL;
+  }
+
+  if (n < BTREE_KEYS) {
+    memmove(&node->keys[pos + 1], &node->keys[pos], (n - pos) * sizeof(int));
+    memmove(&node->val[pos + 1], &node->val[pos], (n - pos) * sizeof(void *));
+    node->keys[pos] = key;
+    node->val[pos] = val;
+    node->nkeys++;
+    return NULL;
+  }
+
+  // full leaf: merge the new entry in order, then distribute
+  memcpy(keys, node->keys, pos * sizeof(int));
+  memcpy(vals, node->val, pos * sizeof(void *));
+  keys[pos] = key;
+  vals[pos] = val;
+  memcpy(&keys[pos + 1], &node->keys[pos], (n - pos) * sizeof(int));
+  memcpy(&vals[pos + 1], &node->val[pos], (n - pos) * sizeof(void *));
+
+  lsz = (rightmost && pos == n) ? n : (n + 1) / 2;
+  right = __node_new(tree, 1);
+  node->nkeys = lsz;
+  memcpy(node->keys, keys, lsz * sizeof(int));
+  memcpy(node->val, vals, lsz * sizeof(void *));
+  right->nkeys = n + 1 - lsz;
+  memcpy(right->keys, &keys[lsz], right->nkeys * sizeof(int));
+  memcpy(right->val, &vals[lsz], right->nkeys * sizeof(void *));
+
+  right->next = node->next;
+  node->next = right;
+  *up_key = right->keys[0];
+  debug_print("split leaf at key=%d (%d/%d)", *up_key, node->nkeys,
+              right->nkeys);
+  return right;
+}
+
+/**
+ * @brief Recursively insert @p key below @p node.
+ * @see __insert_leaf() for parameters and return value.
+ */
+static btree_node *__insert(btree_t *tree, btree_node *node, int key,
+                            void *val, int rightmost, int *up_key,
+                            void **found) {
+  int keys[BTREE_KEYS + 1];
+  btree_node *child[BTREE_KEYS + 2];
+  btree_node *split, *right;
+  int idx, n, lsz, sep;
+
+  if (node->leaf) {
+    return __insert_leaf(tree, node, key, val, rightmost, up_key, found);
+  }
+
+  n = node->nkeys;
+  idx = __upper_bound(node, key);
+  split = __insert(tree, node->child[idx], key, val, rightmost && idx == n,
+                   &sep, found);
+  if (!split) {
+    return NULL;
+  }
+
+  if (n < BTREE_KEYS) {
+    memmove(&node->keys[idx + 1], &node->keys[idx], (n - idx) * sizeof(int));
+    memmove(&node->child[idx + 2], &node->child[idx + 1],
+            (n - idx) * sizeof(btree_node *));
+    node->keys[idx] = sep;
+    node->child[idx + 1] = split;
+    node->nkeys++;
+    return NULL;
+  }
+
+  // full inner node: merge, push the middle key up
+  memcpy(keys, node->keys, idx * sizeof(int));
+  keys[idx] = sep;
+  memcpy(&keys[idx + 1], &node->keys[idx], (n - idx) * sizeof(int));
+  memcpy(child, node->child, (idx + 1) * sizeof(btree_node *));
+  child[idx + 1] = split;
+  memcpy(&child[idx + 2], &node->child[idx + 1],
+         (n - idx) * sizeof(btree_node *));
+
+  lsz = (rightmost && idx == n) ? n : n / 2;
+  right = __node_new(tree, 0);
+  node->nkeys = lsz;
+  memcpy(node->keys, keys, lsz * sizeof(int));
+  memcpy(node->child, child, (lsz + 1) * sizeof(btree_node *));
+  *up_key = keys[lsz];
+  right->nkeys = n - lsz;
+  memcpy(right->keys, &keys[lsz + 1], right->nkeys * sizeof(int));
+  memcpy(right->child, &child[lsz + 1],
+         (right->nkeys + 1) * sizeof(btree_node *));
+  return right;
+}
+
+/**
+ * @brief Initialise an empty tree.
+ */
+void btree_init(btree_t *tree) { *tree = (btree_t)BTREE_INITIALIZER; }
+
+/**
+ * @brief Release every node of @p tree. Stored values are not freed.
+ */
+void btree_free(btree_t *tree) {
+  slab_free(&tree->nodes);
+  btree_init(tree);
+}
+
+/**
+ * @brief Look up @p key in @p tree.
+ *
+ * @return Value stored for @p key, NULL if no such key exists.
+ */
+void *btree_search(const btree_t *tree, int key) {
+  btree_node *leaf = __find_leaf(tree, key);
+  if (!leaf) {
+    return NULL;
+  }
+  for (int i = 0; i < leaf->nkeys; i++) {
+    if (leaf->keys[i] == key) {
+      return leaf->val[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Insert @p val under @p key unless the key is already present.
+ *
+ * @return Value already stored for @p key, or NULL if @p val was inserted.
+ */
+void *btree_insert(btree_t *tree, int key, void *val) {
+  void *found = NULL;
+  btree_node *split, *root;
+  int up_key;
+
+  if (!tree->root) {
+    tree->root = tree->head = __node_new(tree, 1);
+    tree->height = 1;
+  }
+
+  split = __insert(tree, tree->root, key, val, 1, &up_key, &found);
+  if (split) {
+    // root was split. grow the tree by one level
+    root = __node_new(tree, 0);
+    root->nkeys = 1;
+    root->keys[0] = up_key;
+    root->child[0] = tree->root;
+    root->child[1] = split;
+    tree->root = root;
+    tree->height++;
+    debug_print("tree grew to height %d", tree->height);
+  }
+  if (!found) {
+    tree->size++;
+  }
+  return found;
+}
+
+/**
+ * @brief Build @p tree from @p n values sorted by key, in a single pass.
+ * @note Nodes are filled level by level from the left, with entries spread
+ * evenly so that no node but a lone root is less than half full.
+ *
+ * @param tree Empty tree to build
+ * @param base First value. Values are stored as pointers into this array
+ * @param stride Distance in bytes between consecutive values
+ * @param key_offset Offset of the int key inside each value. Keys must be
+ * strictly ascending
+ */
+void btree_bulk_load(btree_t *tree, void *base, size_t n, size_t stride,
+                     size_t key_offset) {
+  btree_node **level, *node, *prev = NULL;
+  size_t nodes, parents, cnt, i = 0, c;
+  int *low; // smallest key below each node of the current level
+
+  if (tree->root) {
+    app_error("btree_bulk_load() needs an empty tree");
+  }
+  if (!n) {
+    return;
+  }
+
+  nodes = (n + BTREE_KEYS - 1) / BTREE_KEYS;
+  level = (btree_node **)Malloc(nodes * sizeof(btree_node *));
+  low = (int *)Malloc(nodes * sizeof(int));
+  for (size_t j = 0; j < nodes; j++) {
+    cnt = n / nodes + (j < n % nodes);
+    node = __node_new(tree, 1);
+    for (size_t k = 0; k < cnt; k++, i++) {
+      char *val = (char *)base + i * stride;
+      node->keys[k] = *(int *)(val + key_offset);
+      node->val[k] = val;
+    }
+    node->nkeys = cnt;
+    if (prev) {
+      prev->next = node;
+    } else {
+      tree->head = node;
+    }
+    prev = level[j] = node;
+    low[j] = node->keys[0];
+  }
+
+  tree->height = 1;
+  while (nodes > 1) {
+    // parents overwrite the front of the level they are built from
+    parents = (nodes + BTREE_KEYS) / (BTREE_KEYS + 1);
+    c = 0;
+    for (size_t p = 0; p < parents; p++) {
+      cnt = nodes / parents + (p < nodes % parents);
+      node = __node_new(tree, 0);
+      node->child[0] = level[c];
+      for (size_t k = 1; k < cnt; k++) {
+        node->keys[k - 1] = low[c + k];
+        node->child[k] = level[c + k];
+      }
+      node->nkeys = cnt - 1;
+      low[p] = low[c];
+      level[p] = node;
+      c += cnt;
+    }
+    nodes = parents;
+    tree->height++;
+  }
+
+  tree->root = level[0];
+  tree->size = n;
+  Free(level);
+  Free(low);
+  debug_print("bulk loaded %zu keys, height %d", n, tree->height);
+}
+
+/**
+ * @brief Position @p it on the smallest key of @p tree.
+ */
+void btree_first(const btree_t *tree, btree_iter *it) {
+  it->node = tree->head;
+  it->pos = 0;
+}
+
+/**
+ * @brief Position @p it on the smallest key greater than or equal to @p key.
+ */
+void btree_seek(const btree_t *tree, int key, btree_iter *it) {
+  it->node = __find_leaf(tree, key);
+  it->pos = it->node ? __lower_bound(it->node, key) : 0;
+}
+
+/**
+ * @brief Return the value under @p it and advance it in key order.
+ *
+ * @return Next value, NULL once the walk is past the last key.
+ */
+void *btree_next(btree_iter *it) {
+  while (it->node && it->pos >= it->node->nkeys) {
+    it->node = it->node->next;
+    it->pos = 0;
+  }
+  if (!it->node) {
+    return NULL;
+  }
+  return it->node->val[it->pos++];
+}
@@ -0,0 +1,64 @@
+#ifndef __BTREE_H__
+#define __BTREE_H__
+
+#include <stddef.h>
+
+#include "slab.h"
+
+#define BTREE_CACHELINE 64
+/* header + keys of a node fill exactly one cache line */
+#define BTREE_KEYS ((BTREE_CACHELINE - 2 * sizeof(unsigned short)) / sizeof(int))
+/* nodes per slab chunk, 128 KiB */
+#define BTREE_SLAB_NODES 1024
+
+struct __btree_node {
+  /* first cache line: everything a lookup needs to pick the next slot */
+  unsigned short nkeys;
+  unsigned short leaf;
+  int keys[BTREE_KEYS];
+  /* remaining lines: children for inner nodes, values for leaves */
+  union {
+    struct __btree_node *child[BTREE_KEYS + 1];
+    struct {
+      void *val[BTREE_KEYS];
+      struct __btree_node *next; /* right sibling leaf */
+    };
+  };
+} __attribute__((aligned(BTREE_CACHELINE)));
+
+struct __btree {
+  struct __btree_node *root;
+  struct __btree_node *head; /* leftmost leaf */
+  size_t size;
+  int height;
+  slab_t nodes; /* every node, freed at once */
+};
+
+struct __btree_iter {
+  struct __btree_node *node;
+  int pos;
+};
+
+typedef struct __btree_node btree_node;
+typedef struct __btree btree_t;
+typedef struct __btree_iter btree_iter;
+
+#define BTREE_INITIALIZER                                                      \
+  {                                                                            \
+    .root = NULL, .head = NULL, .size = 0, .height = 0,                        \
+    .nodes = SLAB_INITIALIZER(sizeof(btree_node), BTREE_SLAB_NODES),           \
+  }
+
+void btree_init(btree_t *tree);
+void btree_free(btree_t *tree);
+
+void *btree_search(const btree_t *tree, int key);
+void *btree_insert(btree_t *tree, int key, void *val);
+void btree_bulk_load(btree_t *tree, void *base, size_t n, size_t stride,
+                     size_t key_offset);
+
+void btree_first(const btree_t *tree, btree_iter *it);
+void btree_seek(const btree_t *tree, int key, btree_iter *it);
+void *btree_next(btree_iter *it);
+
+#endif /* __BTREE_H__ */
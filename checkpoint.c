@@ -0,0 +1,137 @@
+#include "checkpoint.h"
+
+#include <time.h>
+
+#include "stock.h"
+
+static struct {
+  long interval_ms;
+  unsigned long dirty_max;
+  unsigned long version; /* database version of the last snapshot */
+  int triggered;         /* dirty count reached since that snapshot */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int requested;
+  int running;
+  pthread_t tid;
+} ckpt = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * @brief Snapshot loop. Writes the database whenever it changed since the
+ * last snapshot and the interval passed or a snapshot was requested.
+ */
+static void *__checkpointer(void *vargp) {
+  struct timespec deadline;
+  unsigned long version;
+
+  pthread_mutex_lock(&ckpt.mutex);
+  while (ckpt.running) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (ckpt.interval_ms % 1000) * 1000000;
+    deadline.tv_sec += ckpt.interval_ms / 1000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (ckpt.running && !ckpt.requested) {
+      if (!ckpt.interval_ms) {
+        pthread_cond_wait(&ckpt.cond, &ckpt.mutex);
+      } else if (pthread_cond_timedwait(&ckpt.cond, &ckpt.mutex, &deadline) ==
+                 ETIMEDOUT) {
+        break;
+      }
+    }
+    ckpt.requested = 0;
+    pthread_mutex_unlock(&ckpt.mutex);
+
+    version = stock_version();
+    if (version != ckpt.version) {
+      // later modifications are either in the snapshot or found next round
+      __atomic_store_n(&ckpt.version, version, __ATOMIC_RELAXED);
+      __atomic_store_n(&ckpt.triggered, 0, __ATOMIC_RELEASE);
+      stock_write();
+    }
+    pthread_mutex_lock(&ckpt.mutex);
+  }
+  pthread_mutex_unlock(&ckpt.mutex);
+  return NULL;
+}
+
+/**
+ * @brief Start writing the database in the background.
+ * @note Snapshots are written by a single thread, so trades and
+ * disconnecting clients never wait for disk I/O.
+ *
+ * @param interval_ms Longest time between snapshots of a modified database,
+ * 0 to only write on request or dirty count
+ * @param dirty_max Number of modifications that triggers a snapshot early, 0
+ * to disable
+ */
+void checkpoint_start(long interval_ms, unsigned long dirty_max) {
+  pthread_condattr_t attr;
+
+  ckpt.interval_ms = interval_ms;
+  ckpt.version = 0; // the first round folds a replayed log into the file
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ckpt.cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  ckpt.running = 1;
+  Pthread_create(&ckpt.tid, NULL, __checkpointer, NULL);
+  __atomic_store_n(&ckpt.dirty_max, dirty_max, __ATOMIC_RELEASE);
+  debug_print("checkpointer started, interval=%ldms, dirty=%lu", interval_ms,
+              dirty_max);
+}
+
+/**
+ * @brief Stop the background writer, then write out the final state.
+ */
+void checkpoint_stop(void) {
+  if (!ckpt.running) {
+    return;
+  }
+  __atomic_store_n(&ckpt.dirty_max, 0, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&ckpt.mutex);
+  ckpt.running = 0;
+  pthread_cond_signal(&ckpt.cond);
+  pthread_mutex_unlock(&ckpt.mutex);
+  Pthread_join(ckpt.tid, NULL);
+  pthread_cond_destroy(&ckpt.cond);
+
+  if (stock_version() != ckpt.version) {
+    stock_write();
+  }
+}
+
+/**
+ * @brief Ask for a snapshot as soon as possible. Does not wait for it.
+ */
+void checkpoint_request(void) {
+  if (!ckpt.running) {
+    return;
+  }
+  pthread_mutex_lock(&ckpt.mutex);
+  ckpt.requested = 1;
+  pthread_cond_signal(&ckpt.cond);
+  pthread_mutex_unlock(&ckpt.mutex);
+}
+
+/**
+ * @brief Note that the database reached stock_version() @p version,
+ * requesting a snapshot once the dirty count is reached.
+ * @note Called on a sample of the modifications, so the count may be passed
+ * between two calls. The first caller past it claims the request, the
+ * others return right away.
+ */
+void checkpoint_dirty(unsigned long version) {
+  unsigned long dirty_max = __atomic_load_n(&ckpt.dirty_max, __ATOMIC_ACQUIRE);
+  int idle = 0;
+
+  if (dirty_max &&
+      version - __atomic_load_n(&ckpt.version, __ATOMIC_RELAXED) >= dirty_max &&
+      !__atomic_load_n(&ckpt.triggered, __ATOMIC_RELAXED) &&
+      __atomic_compare_exchange_n(&ckpt.triggered, &idle, 1, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    checkpoint_request();
+  }
+}
@@ -0,0 +1,15 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include "csapp.h"
+#include "misc.h"
+
+#define CHECKPOINT_DEFAULT_INTERVAL_MS 1000
+#define CHECKPOINT_DEFAULT_DIRTY 100000
+
+void checkpoint_start(long interval_ms, unsigned long dirty_max);
+void checkpoint_stop(void);
+void checkpoint_request(void);
+void checkpoint_dirty(unsigned long version);
+
+#endif /* __CHECKPOINT_H__ */
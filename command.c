@@ -1,87 +1,134 @@
 #include "command.h"
 
-static sem_t mutex;
-static int byte_len;
-
-static void __init_threaded_connection(void) {
-  byte_len = 0;
-  Sem_init(&mutex, 0, 1);
-}
+/* fixed replies, sent straight from read-only memory */
+struct __template {
+  const char *s;
+  size_t len;
+};
+
+#define __TEMPLATE(lit) {lit, sizeof(lit) - 1}
+
+static const struct __template T_EXIT = __TEMPLATE("\n");
+static const struct __template T_INVALID = __TEMPLATE("invalid command\n");
+static const struct __template T_BUY = __TEMPLATE("[buy] success\n");
+static const struct __template T_SELL = __TEMPLATE("[sell] success\n");
+static const struct __template T_ORDER = __TEMPLATE("[order] success\n");
+static const struct __template T_NOT_ENOUGH =
+    __TEMPLATE("Not enough left stocks\n");
+static const struct __template T_NO_ITEM = __TEMPLATE("No such stock\n");
+static const struct __template T_NO_ORDER =
+    __TEMPLATE("[cancel] no such order\n");
+static const struct __template T_PROTO[] = {
+    [PROTO_LEGACY] = __TEMPLATE("[proto] legacy\n"),
+    [PROTO_FRAMED] = __TEMPLATE("[proto] framed\n"),
+};
+
+_Static_assert(REQ_OPS <= LATENCY_MAX_OPS, "latency histograms per op");
+
+static long byte_len; /* bytes received by pool workers, for debugging */
 
 /**
  * @brief Handle connection for @p connfd
+ * @note Replies in legacy fixed-size mode, since no state is kept between
+ * calls.
  *
  * @param connfd File descriptor for connection
  * @return Command execution's resulting status code
  */
 cmd_status handle_connection(int connfd) {
-  int n, plen;
+  int n;
   char buf[MAXLINE];
-  char response[MAXLINE];
+  cmd_response response;
+  cmd_session session = {.mode = PROTO_LEGACY};
   cmd_status status = COMMAND_ERROR;
+  uint64_t start;
   rio_t rio;
 
-  memset(response, 0, sizeof(response));
-
   Rio_readinitb(&rio, connfd);
   if (!(n = Rio_readlineb(&rio, buf, MAXLINE))) {
     // handle client termination via ctrl-c
     debug_print("client terminated the connection");
     return COMMAND_EXIT;
   } else {
-    char *pbuf[MAX_COMMAND_ARGS];
     debug_print("server received %d bytes", n);
 
-    plen = __parse(rtrim(buf), pbuf);
-    for (int i = 0; i < plen; i++) {
-      debug_print("pbuf[%d] = \"%s\"", i, pbuf[i]);
+    response_init(&response);
+    status = handle_line(&session, buf, &response);
+    wal_commit();
+    start = latency_now();
+    if (__write_response(connfd, &session, &response) < 0) {
+      status = COMMAND_EXIT;
     }
-
-    status = __handle_command(pbuf, plen, response);
-    // write size must be equal to client Rio_readnb() read size
-    Rio_writen(connfd, response, MAXLINE);
-    debug_print("response to client: \"%s\"", response);
+    latency_since(LATENCY_WRITE, start);
+    debug_print("response to client: %zu bytes", response.len);
+    response_release(&response);
   }
   debug_print("handler returned with status %d", status);
 
   return status;
 }
 
+/**
+ * @brief Whether @p rio already buffers a complete line.
+ */
+static int __rio_has_line(const rio_t *rio) {
+  return rio->rio_cnt > 0 && memchr(rio->rio_bufptr, '\n', rio->rio_cnt);
+}
+
+/**
+ * @brief Serve requests on @p connfd until the client leaves.
+ * @note Requests are pipelined: every complete line already sitting in the
+ * read buffer is executed in order before any reply is sent, and the whole
+ * batch of replies goes out in a single writev().
+ *
+ * @param connfd File descriptor for connection
+ */
 void handle_threaded_connection(int connfd) {
-  int n, plen;
+  int n, batch;
   char buf[MAXLINE];
-  char response[MAXLINE];
+  char hdrs[PIPELINE_MAX][PROTO_HEADER_LEN];
+  struct iovec iov[PIPELINE_MAX * 2];
+  cmd_response responses[PIPELINE_MAX];
+  cmd_session session = {.mode = PROTO_LEGACY};
   cmd_status status = COMMAND_ERROR;
+  uint64_t start;
   rio_t rio;
-
-  static pthread_once_t once = PTHREAD_ONCE_INIT;
-
-  Pthread_once(&once, __init_threaded_connection);
+  int iovcnt;
 
   Rio_readinitb(&rio, connfd);
   while ((n = Rio_readlineb(&rio, buf, MAXLINE))) {
-    char *pbuf[MAX_COMMAND_ARGS];
-
-    memset(response, 0, sizeof(response));
-    debug_print("server received %d bytes", n);
-
-    plen = __parse(rtrim(buf), pbuf);
-    for (int i = 0; i < plen; i++) {
-      debug_print("pbuf[%d] = \"%s\"", i, pbuf[i]);
+    batch = iovcnt = 0;
+    do {
+      if (batch) {
+        n = Rio_readlineb(&rio, buf, MAXLINE); // buffered, won't block
+      }
+      debug_print("server received %d bytes", n);
+
+      response_init(&responses[batch]);
+      status = handle_line(&session, buf, &responses[batch]);
+      // encode now: a protocol switch applies from its own reply onwards
+      iovcnt += __response_iov(&session, &responses[batch], hdrs[batch],
+                               &iov[iovcnt]);
+      batch++;
+
+      debug_print(
+          "server received %d (%ld total) bytes on thread 0x%02lx with fd=%d",
+          n, __atomic_add_fetch(&byte_len, n, __ATOMIC_RELAXED),
+          (unsigned long)pthread_self(), connfd);
+    } while (status != COMMAND_EXIT && batch < PIPELINE_MAX &&
+             __rio_has_line(&rio));
+
+    debug_print("writing %d replies to fd=%d", batch, connfd);
+    wal_commit(); // acknowledge trades only once they are durable
+    start = latency_now(); // counted against the batch's last request
+    if (proto_writev(connfd, iov, iovcnt) < 0) {
+      debug_print("failed to write response to fd=%d", connfd);
+      status = COMMAND_EXIT;
+    }
+    latency_since(LATENCY_WRITE, start);
+    for (int i = 0; i < batch; i++) {
+      response_release(&responses[i]);
     }
-
-    status = __handle_command(pbuf, plen, response);
-
-    P(&mutex);
-    byte_len += n;
-    debug_print(
-        "server received %d (%d total) bytes on thread 0x%02x with fd=%d", n,
-        byte_len, (unsigned long)pthread_self(), connfd);
-    V(&mutex);
-
-    // write size must be equal to client Rio_readnb() read size
-    Rio_writen(connfd, response, MAXLINE);
-    debug_print("response to client: \"%s\"", response);
     debug_print("handler returned with status %d", status);
     if (status == COMMAND_EXIT) {
       break;
@@ -90,73 +137,653 @@ void handle_threaded_connection(int connfd) {
 }
 
 /**
- * @brief Parse given command string into blocks.
- * @warning Execution is destructive for argument @p cmd.
+ * @brief Scheduling class of requests of kind @p op.
+ * @note Admin reports stay in the trade class, so they still answer while
+ * the scan pool is backed up.
+ */
+cmd_class command_class(req_op op) {
+  switch (op) {
+  case REQ_SHOW:
+  case REQ_SHOW_RANGE:
+  case REQ_SHOW_PAGE:
+  case REQ_STATS:
+  case REQ_VALUE:
+  case REQ_LOWSTOCK:
+    return CMD_CLASS_SCAN;
+  default:
+    return CMD_CLASS_TRADE;
+  }
+}
+
+/**
+ * @brief Parse @p line into @p req, counting and timing it.
  *
- * @param cmd Null-terminated command string
- * @param buf Buffer to store pointers for each argument
- * @return Number of parsed command arguments
+ * @return latency_now() once parsed, 0 if the request is not timed.
  */
-size_t __parse(char *cmd, char **buf) {
-  int argc = 0;
-  char *__next;
-  debug_print("parsing command \"%s\"", cmd);
+static uint64_t __parse_line(char *line, cmd_request *req) {
+  uint64_t start = latency_start(), parsed;
+
+  parse_request(line, req);
+  latency_set_op(req->op);
+  if ((parsed = latency_now())) {
+    latency_record(LATENCY_PARSE, parsed - start);
+  }
+  return parsed;
+}
 
-  for (char *ptr = strtok_r(cmd, DELIM_CHARS, &__next); ptr != NULL;
-       ptr = strtok_r(NULL, " ", &__next)) {
-    debug_print("parsing on \"%s\"", ptr);
-    buf[argc++] = ptr;
+/**
+ * @brief Execute a queued request on a scan thread. Its execute phase
+ * includes the time it waited for the thread.
+ */
+static void __run_job(scan_job *base) {
+  cmd_job *job = (cmd_job *)base;
+
+  latency_resume(job->req.op, job->parsed != 0);
+  job->status = __handle_request(job->session, &job->req, job->response);
+  latency_since(LATENCY_EXECUTE, job->parsed);
+  if (job->on_done) {
+    job->on_done(job);
+  } else {
+    V(job->done); // the waiting caller owns the job again
   }
-  return argc;
 }
 
 /**
- * @brief Execute by reading from command string list.
+ * @brief Parse and execute a single request line.
+ * @note A request of the scan class runs on the scan pool while the caller
+ * waits, so at most the pool's threads scan at once however many clients
+ * ask, and replies keep their order.
  *
- * @param args Argument list for command string.
- * @param length Length for @p args.
- * @param response Reference to variable for storing response string.
- * @return Resulting status code
+ * @param session State of the connection the line arrived on.
+ * @param line Null-terminated request line, trailing newline included or not.
+ * @param response Initialised reply to fill in.
+ * @return Command execution's resulting status code
  */
-cmd_status __handle_command(char *args[], int length, char response[]) {
-  debug_print("handling command \"%s\"...", args[0]);
-  cmd_status ret = COMMAND_SUCCESS;
+cmd_status handle_line(cmd_session *session, char *line,
+                       cmd_response *response) {
+  cmd_status status;
+  sem_t done;
+  cmd_job job;
+
+  job.parsed = __parse_line(line, &job.req);
+  if (command_class(job.req.op) != CMD_CLASS_SCAN || !scan_running()) {
+    status = __handle_request(session, &job.req, response);
+    latency_since(LATENCY_EXECUTE, job.parsed);
+    return status;
+  }
+
+  job.base.run = __run_job;
+  job.session = session;
+  job.response = response;
+  job.done = &done;
+  job.on_done = NULL;
+  Sem_init(&done, 0, 0);
+  scan_submit(&job.base);
+  P(&done);
+  sem_destroy(&done);
+  return job.status;
+}
 
-  if (length == 1) {
-    if (!strcmp(args[0], "exit")) {
-      // client requested termination
-      strcpy(response, "\n");
-      return COMMAND_EXIT;
-    } else if (!strcmp(args[0], "show")) {
-      // current stock status
-      stock_write_to_buf(response);
-    } else {
-      debug_print("invalid command \"%s\"", args[0]);
-      strcpy(response, "invalid command\n");
-      return COMMAND_INVALID;
+/**
+ * @brief Like handle_line(), but a request of the scan class is handed to
+ * the scan pool without waiting for it.
+ *
+ * @param status Resulting status code of a request executed at once.
+ * @param on_done Called on a scan thread once the job's reply is ready.
+ * @param arg Stored in the job for @p on_done.
+ * @return The job, whose reply is job->reply and whose status is
+ * job->status, or NULL if the request was executed into @p response.
+ */
+cmd_job *handle_line_async(cmd_session *session, char *line,
+                           cmd_response *response, cmd_status *status,
+                           void (*on_done)(cmd_job *job), void *arg) {
+  cmd_request req;
+  uint64_t parsed = __parse_line(line, &req);
+  cmd_job *job;
+
+  if (command_class(req.op) != CMD_CLASS_SCAN || !scan_running()) {
+    *status = __handle_request(session, &req, response);
+    latency_since(LATENCY_EXECUTE, parsed);
+    return NULL;
+  }
+
+  job = (cmd_job *)Malloc(sizeof(cmd_job));
+  job->req = req;
+  job->parsed = parsed;
+  job->base.run = __run_job;
+  job->session = session;
+  response_init(&job->reply);
+  job->response = &job->reply;
+  job->on_done = on_done;
+  job->arg = arg;
+  scan_submit(&job->base);
+  return job;
+}
+
+/**
+ * @brief Release the reply of @p job, from handle_line_async(), and free it.
+ */
+void command_job_free(cmd_job *job) {
+  response_release(&job->reply);
+  Free(job);
+}
+
+/**
+ * @brief Prepare @p response to hold a reply.
+ */
+void response_init(cmd_response *response) {
+  response->data = response->buf;
+  response->len = 0;
+  response->heap = NULL;
+  response->snap = NULL;
+  response->buf[0] = '\0';
+}
+
+/**
+ * @brief Format reply text into @p response.
+ * @note Replies longer than RESPONSE_INLINE go to an owned heap buffer.
+ */
+void response_printf(cmd_response *response, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(response->buf, sizeof(response->buf), fmt, ap);
+  va_end(ap);
+
+  response->data = response->buf;
+  if (n >= (int)sizeof(response->buf)) {
+    response->heap = (char *)Malloc(n + 1);
+    va_start(ap, fmt);
+    vsnprintf(response->heap, n + 1, fmt, ap);
+    va_end(ap);
+    response->data = response->heap;
+  }
+  response->len = n;
+}
+
+/**
+ * @brief Point @p response at fixed reply @p t.
+ */
+static void __response_template(cmd_response *response,
+                                const struct __template *t) {
+  response->data = t->s;
+  response->len = t->len;
+}
+
+/**
+ * @brief Write @p v in decimal at @p p.
+ *
+ * @return Pointer past the last digit.
+ */
+static char *__put_int(char *p, int64_t v) {
+  char digits[20];
+  uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+  int n = 0;
+
+  if (v < 0) {
+    *p++ = '-';
+  }
+  do {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  while (n) {
+    *p++ = digits[--n];
+  }
+  return p;
+}
+
+/**
+ * @brief Append fixed text @p t at @p p.
+ *
+ * @return Pointer past the copied text.
+ */
+static char *__put_template(char *p, const struct __template *t) {
+  memcpy(p, t->s, t->len);
+  return p + t->len;
+}
+
+/**
+ * @brief Terminate the reply built in the inline buffer of @p response at
+ * @p end with a newline.
+ * @note Numeric replies are short, so they always fit the inline buffer.
+ */
+static void __response_finish(cmd_response *response, char *end) {
+  *end++ = '\n';
+  *end = '\0';
+  response->data = response->buf;
+  response->len = end - response->buf;
+}
+
+/**
+ * @brief Point @p response at heap buffer @p buf, taking over ownership.
+ */
+static void __response_heap(cmd_response *response, char *buf, size_t len) {
+  response->heap = buf;
+  response->data = buf;
+  response->len = len;
+}
+
+/**
+ * @brief Point @p response at the payload of @p snap, taking over the
+ * caller's reference.
+ */
+static void __response_snapshot(cmd_response *response,
+                                stock_snapshot *snap) {
+  response->snap = snap;
+  response->data = snap->buf;
+  response->len = snap->len;
+}
+
+/**
+ * @brief Release resources held by @p response.
+ */
+void response_release(cmd_response *response) {
+  if (response->snap) {
+    stock_snapshot_put(response->snap);
+  }
+  free(response->heap);
+  response_init(response);
+}
+
+/**
+ * @brief Describe the wire bytes of @p response in the protocol of @p session.
+ * @note Framed replies carry a length header and only the reply bytes. Legacy
+ * replies are truncated or zero padded to exactly MAXLINE bytes, which is
+ * what old clients pass to Rio_readnb().
+ *
+ * @param hdr Storage for the frame header, PROTO_HEADER_LEN bytes
+ * @param[out] iov Two entries to fill in
+ * @return Number of entries used in @p iov
+ */
+int __response_iov(const cmd_session *session, const cmd_response *response,
+                   char *hdr, struct iovec *iov) {
+  static const char padding[MAXLINE];
+  size_t len = response->len;
+
+  if (session->mode == PROTO_FRAMED) {
+    proto_header(len, hdr);
+    iov[0] = (struct iovec){.iov_base = hdr, .iov_len = PROTO_HEADER_LEN};
+    iov[1] = (struct iovec){.iov_base = (void *)response->data,
+                            .iov_len = len};
+  } else {
+    // keep the last byte zero so the reply stays null-terminated
+    len = len < MAXLINE - 1 ? len : MAXLINE - 1;
+    iov[0] = (struct iovec){.iov_base = (void *)response->data,
+                            .iov_len = len};
+    iov[1] = (struct iovec){.iov_base = (void *)padding,
+                            .iov_len = MAXLINE - len};
+  }
+  return 2;
+}
+
+/**
+ * @brief Send @p response to @p connfd in the protocol of @p session.
+ *
+ * @return Number of bytes written, -1 on error.
+ */
+int __write_response(int connfd, const cmd_session *session,
+                     const cmd_response *response) {
+  char hdr[PROTO_HEADER_LEN];
+  struct iovec iov[2];
+  int cnt = __response_iov(session, response, hdr, iov);
+
+  return proto_writev(connfd, iov, cnt);
+}
+
+/**
+ * @brief Reply with the worker pool counters. The longest queue wait covers
+ * the time since the previous report.
+ */
+static void __response_pool(cmd_response *response) {
+  pool_stats st;
+
+  pool_get_stats(&st, 1);
+  response_printf(response,
+                  "[pool] threads %d idle %d min %d max %d peak %d queued %zu "
+                  "served %lu spawned %lu retired %lu wait_avg_us %.1f "
+                  "wait_max_us %.1f\n",
+                  st.threads, st.idle, st.min, st.max, st.peak, st.queued,
+                  st.served, st.spawned, st.retired,
+                  st.served ? st.wait_total_ns / 1e3 / st.served : 0.0,
+                  st.wait_max_ns / 1e3);
+}
+
+/**
+ * @brief Reply with the semaphore contention report, or say it is not built
+ * in.
+ */
+static void __response_locks(cmd_response *response) {
+#ifdef SEM_PROFILE
+  char buf[MAXBUF];
+
+  sem_profile_report(buf, sizeof(buf));
+  response_printf(response, "[admin locks]\n%s", buf);
+#else
+  response_printf(response, "[admin locks] not profiled, build with "
+                            "make profile\n");
+#endif
+}
+
+/**
+ * @brief Reply with a line per request kind and phase recorded so far: the
+ * number of requests, their rate since the previous report, and the number
+ * of timed ones with their p50, p99 and max in us.
+ */
+static void __response_latency(cmd_response *response) {
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static uint64_t last_count[LATENCY_MAX_OPS], last_ns;
+  size_t cap = 128 + (size_t)REQ_OPS * LATENCY_PHASES * 112, len;
+  char *buf = (char *)Malloc(cap);
+  uint64_t now, count;
+  double secs, rate;
+  hist_t h;
+  int rows;
+
+  now = now_ns();
+  pthread_mutex_lock(&mutex);
+  secs = last_ns ? (now - last_ns) / 1e9 : 0;
+  last_ns = now;
+  len = snprintf(buf, cap,
+                 "[admin stats] %s, 1 in %d requests timed\n"
+                 "op count ops_s phase samples p50_us p99_us max_us\n",
+                 latency_enabled ? "on" : "off", LATENCY_SAMPLE);
+  // a line that does not fit cuts the report there, like sem_profile_report()
+  for (int op = 0; op < REQ_OPS && len < cap; op++) {
+    if (!(count = latency_count(op))) {
+      continue;
     }
-  } else if (length == 3) {
-    int id = atoi(args[1]);
-    int count = atoi(args[2]);
-    debug_print("handling 3-arg command: %s %d %d", args[0], id, count);
-
-    if (!strcmp(args[0], "buy")) {
-      // remove item from stock
-      ret = buy(id, count);
-    } else if (!strcmp(args[0], "sell")) {
-      // add item to stock
-      // TODO: handle trying to sell non-existing stock id
-      ret = sell(id, count);
+    rate = secs ? (count - last_count[op]) / secs : 0;
+    last_count[op] = count;
+    rows = 0;
+    for (int ph = 0; ph < LATENCY_PHASES && len < cap; ph++) {
+      hist_init(&h);
+      latency_collect(op, (latency_phase)ph, &h);
+      if (!h.count) {
+        continue;
+      }
+      len += snprintf(buf + len, cap - len,
+                      "%s %llu %.0f %s %llu %.1f %.1f %.1f\n",
+                      parse_op_name((req_op)op), (unsigned long long)count,
+                      rate, latency_phase_name((latency_phase)ph),
+                      (unsigned long long)h.count,
+                      hist_percentile(&h, 0.5) / 1e3,
+                      hist_percentile(&h, 0.99) / 1e3, h.max / 1e3);
+      rows++;
     }
-
-    if (ret == COMMAND_SUCCESS) {
-      sprintf(response, "[%s] success\n", args[0]);
-    } else {
-      strcpy(response, "Not enough left stocks\n");
+    if (!rows && len < cap) {
+      len += snprintf(buf + len, cap - len, "%s %llu %.0f - 0 0 0 0\n",
+                      parse_op_name((req_op)op), (unsigned long long)count,
+                      rate);
     }
+  }
+  pthread_mutex_unlock(&mutex);
+  __response_heap(response, buf, len < cap ? len : cap - 1);
+}
+
+/**
+ * @brief Reply with a line per scheduling class: requests served, queue
+ * depth now and at its deepest since the previous report, queue wait, and
+ * the execute phase of timed requests, all latencies in us.
+ * @note Trades only queue as connections waiting for a pool worker. Scan
+ * waits are those of the scan pool, and are part of their execute phase.
+ */
+static void __response_sched(cmd_response *response) {
+  static const char *names[] = {[CMD_CLASS_TRADE] = "trade",
+                                [CMD_CLASS_SCAN] = "scan"};
+  uint64_t count[CMD_CLASSES] = {0};
+  hist_t exec[CMD_CLASSES];
+  pool_stats pool;
+  scan_stats scan;
+  cmd_class cls;
+
+  for (int c = 0; c < CMD_CLASSES; c++) {
+    hist_init(&exec[c]);
+  }
+  for (int op = 0; op < REQ_OPS; op++) {
+    cls = command_class((req_op)op);
+    count[cls] += latency_count(op);
+    latency_collect(op, LATENCY_EXECUTE, &exec[cls]);
+  }
+  pool_get_stats(&pool, 0);
+  scan_get_stats(&scan, 1);
+
+  response_printf(
+      response,
+      "[admin sched] scan threads %d busy %d\n"
+      "class count queued peak wait_p50_us wait_p99_us wait_max_us "
+      "p50_us p99_us max_us\n"
+      "%s %llu %zu - - - - %.1f %.1f %.1f\n"
+      "%s %llu %zu %zu %.1f %.1f %.1f %.1f %.1f %.1f\n",
+      scan.threads, scan.busy, names[CMD_CLASS_TRADE],
+      (unsigned long long)count[CMD_CLASS_TRADE], pool.queued,
+      hist_percentile(&exec[CMD_CLASS_TRADE], 0.5) / 1e3,
+      hist_percentile(&exec[CMD_CLASS_TRADE], 0.99) / 1e3,
+      exec[CMD_CLASS_TRADE].max / 1e3, names[CMD_CLASS_SCAN],
+      (unsigned long long)count[CMD_CLASS_SCAN], scan.queued, scan.peak,
+      hist_percentile(&scan.wait, 0.5) / 1e3,
+      hist_percentile(&scan.wait, 0.99) / 1e3, scan.wait.max / 1e3,
+      hist_percentile(&exec[CMD_CLASS_SCAN], 0.5) / 1e3,
+      hist_percentile(&exec[CMD_CLASS_SCAN], 0.99) / 1e3,
+      exec[CMD_CLASS_SCAN].max / 1e3);
+}
+
+/**
+ * @brief Find item @p id, timing the lookup.
+ */
+static stock_item *__lookup(int id) {
+  uint64_t start = latency_now();
+  stock_item *item = search_stock(id);
+
+  latency_since(LATENCY_LOOKUP, start);
+  return item;
+}
+
+/**
+ * @brief Run a limit or market order of @p req and reply with what it
+ * matched, plus the id of the order left resting for a limit order.
+ */
+static cmd_status __book_order(const cmd_request *req,
+                               cmd_response *response) {
+  static const struct __template limit = __TEMPLATE("[limit] order "),
+                                 full = __TEMPLATE("[limit] book full"),
+                                 limit_short =
+                                     __TEMPLATE("[limit] not enough stock"),
+                                 market = __TEMPLATE("[market]"),
+                                 market_short =
+                                     __TEMPLATE("[market] not enough stock"),
+                                 filled = __TEMPLATE(" filled "),
+                                 value = __TEMPLATE(" value ");
+  book_side side = req->op == REQ_LIMIT_SELL || req->op == REQ_MARKET_SELL
+                       ? BOOK_SELL
+                       : BOOK_BUY;
+  book_status status;
+  stock_item *item;
+  book_fill fill;
+  char *p;
+
+  if (!(item = __lookup(req->arg[0]))) {
+    __response_template(response, &T_NO_ITEM);
+    return COMMAND_INVALID;
+  }
+  if (req->op == REQ_MARKET_BUY || req->op == REQ_MARKET_SELL) {
+    status = book_market(item, side, req->arg[1], &fill);
+    p = __put_template(response->buf,
+                       status == BOOK_OK ? &market : &market_short);
+  } else if ((status = book_limit(item, side, req->arg[1], req->arg[2],
+                                  &fill)) == BOOK_OK) {
+    p = __put_int(__put_template(response->buf, &limit), fill.oid);
   } else {
-    debug_print("invalid command \"%s\"", args[0]);
-    strcpy(response, "invalid command\n");
+    p = __put_template(response->buf,
+                       status == BOOK_FULL ? &full : &limit_short);
+  }
+  p = __put_int(__put_template(p, &filled), fill.filled);
+  __response_finish(response,
+                    __put_int(__put_template(p, &value), fill.value));
+  return status == BOOK_OK ? COMMAND_SUCCESS : COMMAND_INVALID;
+}
+
+/**
+ * @brief Reply with the best bid and ask of item @p id and the quantity at
+ * each, 0 0 for an empty side.
+ */
+static cmd_status __book_top(int id, cmd_response *response) {
+  static const struct __template bid = __TEMPLATE("[book] bid "),
+                                 ask = __TEMPLATE(" ask "),
+                                 space = __TEMPLATE(" ");
+  const struct __template *side[2] = {&bid, &ask};
+  stock_item *item;
+  int64_t qty;
+  int price;
+  char *p = response->buf;
+
+  if (!(item = __lookup(id))) {
+    __response_template(response, &T_NO_ITEM);
+    return COMMAND_INVALID;
+  }
+  for (int s = BOOK_BUY; s <= BOOK_SELL; s++) {
+    if (!book_top(item, (book_side)s, &price, &qty)) {
+      price = qty = 0;
+    }
+    p = __put_int(__put_template(p, side[s]), price);
+    p = __put_int(__put_template(p, &space), qty);
+  }
+  __response_finish(response, p);
+  return COMMAND_SUCCESS;
+}
+
+/**
+ * @brief Execute parsed request @p req.
+ *
+ * @param session State of the connection the request arrived on.
+ * @param req Request as returned by parse_request().
+ * @param response Initialised reply to fill in.
+ * @return Resulting status code
+ */
+cmd_status __handle_request(cmd_session *session, const cmd_request *req,
+                            cmd_response *response) {
+  static const struct __template stats = __TEMPLATE("[stats] items "),
+                                 units = __TEMPLATE(" units "),
+                                 value = __TEMPLATE("[value] "),
+                                 lowstock = __TEMPLATE("[lowstock] "),
+                                 cancel = __TEMPLATE("[cancel] order "),
+                                 open = __TEMPLATE(" open ");
+  cmd_status ret = COMMAND_SUCCESS;
+  size_t len;
+  int qty;
+  char *buf, *p;
+
+  debug_print("handling request op=%d", req->op);
+  switch (req->op) {
+  case REQ_BUY:
+    // remove item from stock
+    ret = buy(req->arg[0], req->arg[1]);
+    __response_template(response,
+                        ret == COMMAND_SUCCESS ? &T_BUY : &T_NOT_ENOUGH);
+    break;
+  case REQ_SELL:
+    // add item to stock
+    // TODO: handle trying to sell non-existing stock id
+    ret = sell(req->arg[0], req->arg[1]);
+    __response_template(response,
+                        ret == COMMAND_SUCCESS ? &T_SELL : &T_NOT_ENOUGH);
+    break;
+  case REQ_ORDER:
+    // every leg or none
+    ret = order(req->legs, req->nlegs);
+    __response_template(response,
+                        ret == COMMAND_SUCCESS ? &T_ORDER : &T_NOT_ENOUGH);
+    break;
+  case REQ_LIMIT_BUY:
+  case REQ_LIMIT_SELL:
+  case REQ_MARKET_BUY:
+  case REQ_MARKET_SELL:
+    ret = __book_order(req, response);
+    break;
+  case REQ_CANCEL:
+    if (book_cancel(req->arg[0], &qty) != BOOK_OK) {
+      __response_template(response, &T_NO_ORDER);
+      ret = COMMAND_INVALID;
+      break;
+    }
+    p = __put_int(__put_template(response->buf, &cancel), req->arg[0]);
+    __response_finish(response, __put_int(__put_template(p, &open), qty));
+    break;
+  case REQ_BOOK:
+    ret = __book_top(req->arg[0], response);
+    break;
+  case REQ_SHOW:
+    // current stock status
+    __response_snapshot(response, stock_snapshot_get());
+    break;
+  case REQ_SHOW_RANGE:
+    // items with IDs in [from, to]
+    buf = stock_print_range(req->arg[0], req->arg[1], &len);
+    __response_heap(response, buf, len);
+    break;
+  case REQ_SHOW_PAGE:
+    // up to limit items from start on. continue after the last ID returned
+    buf = stock_print_page(req->arg[0], req->arg[1], &len);
+    __response_heap(response, buf, len);
+    break;
+  case REQ_STATS:
+    // portfolio totals, scanned from the column store
+    p = __put_template(response->buf, &stats);
+    p = __put_int(p, stock_db.size);
+    p = __put_template(p, &units);
+    __response_finish(response, __put_int(p, stock_total_units()));
+    break;
+  case REQ_VALUE:
+    p = __put_template(response->buf, &value);
+    __response_finish(response, __put_int(p, stock_total_value()));
+    break;
+  case REQ_LOWSTOCK:
+    // number of items to restock
+    p = __put_template(response->buf, &lowstock);
+    __response_finish(response,
+                      __put_int(p, stock_count_below(req->arg[0])));
+    break;
+  case REQ_ADMIN_POOL:
+    __response_pool(response);
+    break;
+  case REQ_ADMIN_STATS:
+    __response_latency(response);
+    break;
+  case REQ_ADMIN_STATS_ON:
+  case REQ_ADMIN_STATS_OFF:
+    latency_enable(req->op == REQ_ADMIN_STATS_ON);
+    response_printf(response, "[admin] stats %s\n",
+                    req->op == REQ_ADMIN_STATS_ON ? "on" : "off");
+    break;
+  case REQ_ADMIN_LOCKS:
+    __response_locks(response);
+    break;
+  case REQ_ADMIN_SCHED:
+    __response_sched(response);
+    break;
+  case REQ_ADMIN_HOT:
+  case REQ_ADMIN_COLD:
+    // per-core slices of the count of one item
+    if (stock_hot(req->arg[0], req->op == REQ_ADMIN_HOT) != STOCK_SUCCESS) {
+      response_printf(response, "[admin] hot %d failed\n", req->arg[0]);
+      ret = COMMAND_INVALID;
+      break;
+    }
+    response_printf(response, "[admin] hot %d %s\n", req->arg[0],
+                    req->op == REQ_ADMIN_HOT ? "on" : "off");
+    break;
+  case REQ_PROTO:
+    // switch reply format. the reply itself already uses the new format
+    session->mode = (proto_mode)req->arg[0];
+    __response_template(response, &T_PROTO[session->mode]);
+    break;
+  case REQ_EXIT:
+    // client requested termination
+    __response_template(response, &T_EXIT);
+    return COMMAND_EXIT;
+  default:
+    __response_template(response, &T_INVALID);
     return COMMAND_INVALID;
   }
   return ret;
@@ -164,6 +791,8 @@ cmd_status __handle_command(char *args[], int length, char response[]) {
 
 /**
  * @brief Remove item from stack db.
+ * @note Lock-free. The count check and update happen in one compare-and-swap
+ * in stock_add().
  *
  * @param id id of the stock item to buy.
  * @param n number of stock items to buy.
@@ -174,45 +803,23 @@ cmd_status __handle_command(char *args[], int length, char response[]) {
  */
 cmd_status buy(int id, int n) {
   // remove item from stock db
-  int is_number_valid;
   stock_item *item;
-  cmd_status result = COMMAND_INVALID;
-  if ((item = search_stock(id))) {
-    debug_print("item found with id=%d, count=%d, price=%d", id, item->count,
-                item->price);
-
-    P(&item->r_mutex);
-    if (++item->read_cnt == 1) {
-      P(&item->w_mutex); // first in - lock write
-    }
-    V(&item->r_mutex);
-
-    is_number_valid = item->count >= n;
-
-    P(&item->r_mutex);
-    if (--item->read_cnt == 0) {
-      V(&item->w_mutex); // last out - unlock write
-    }
-    V(&item->r_mutex);
-
-    if (is_number_valid) {
-      P(&item->w_mutex);
-      item->count -= n;
-      V(&item->w_mutex);
-      result = COMMAND_SUCCESS;
-      debug_print("successfully inserted item");
-    } else {
-      debug_print("failed to insert item");
-    }
-
+  if (n < 0 || !(item = __lookup(id))) {
     debug_print("no item found with id=%d", id);
+    return COMMAND_INVALID;
   }
 
-  return result;
+  if (stock_add(item, -n) != STOCK_SUCCESS) {
+    debug_print("failed to remove %d items from id=%d", n, id);
+    return COMMAND_INVALID;
+  }
+  debug_print("successfully removed %d items from id=%d", n, id);
+  return COMMAND_SUCCESS;
 }
 
 /**
  * @brief Add item to stack db.
+ * @note Lock-free, see buy().
  *
  * @param id id of the stock item to sell.
  * @param n number of stock items to sell.
@@ -223,19 +830,34 @@ cmd_status buy(int id, int n) {
 cmd_status sell(int id, int n) {
   // add item to stock db
   stock_item *item;
-  cmd_status result = COMMAND_INVALID;
-  if ((item = search_stock(id))) {
-    debug_print("item found with id=%d, count=%d, price=%d", id, item->count,
-                item->price);
+  if (n < 0 || !(item = __lookup(id))) {
+    debug_print("no item found with id=%d", id);
+    return COMMAND_INVALID;
+  }
 
-    P(&item->w_mutex); //  lock write
-    item->count += n;
-    V(&item->w_mutex); // unlock write
+  if (stock_add(item, n) != STOCK_SUCCESS) {
+    debug_print("failed to add %d items to id=%d", n, id);
+    return COMMAND_INVALID;
+  }
+  debug_print("successfully added %d items to id=%d", n, id);
+  return COMMAND_SUCCESS;
+}
 
-    debug_print("successfully inserted item");
-    result = COMMAND_SUCCESS;
-  } else {
-    debug_print("failed to insert item");
+/**
+ * @brief Apply a multi-item order atomically, see stock_order().
+ *
+ * @param legs id and change to its count of each leg, buys negative.
+ * @param n number of legs.
+ * @return cmd_status typed enum:
+ *  - #COMMAND_SUCCESS if every leg was applied
+ *  - #COMMAND_INVALID if none was, because an id does not exist or a count
+ * was not enough
+ */
+cmd_status order(const int (*legs)[2], int n) {
+  if (stock_order(legs, n) != STOCK_SUCCESS) {
+    debug_print("order of %d legs failed", n);
+    return COMMAND_INVALID;
   }
-  return result;
-}
\ No newline at end of file
+  debug_print("order of %d legs applied", n);
+  return COMMAND_SUCCESS;
+}
@@ -1,10 +1,21 @@
 #ifndef __COMMAND_H__
 #define __COMMAND_H__
 
+#include "book.h"
 #include "csapp.h"
+#include "latency.h"
 #include "misc.h"
+#include "parse.h"
+#include "pool.h"
+#include "proto.h"
+#include "scan.h"
 #include "stock.h"
 
+/* replies up to this size are built without touching the heap */
+#define RESPONSE_INLINE 256
+/* most pipelined requests executed before their replies are flushed */
+#define PIPELINE_MAX 64
+
 typedef enum {
   COMMAND_ERROR = 0,
   COMMAND_SUCCESS,
@@ -12,12 +23,66 @@ typedef enum {
   COMMAND_INVALID,
 } cmd_status;
 
+/* scheduling classes. scans run on the scan pool, trades where they arrive */
+typedef enum {
+  CMD_CLASS_TRADE = 0, /* short requests, executed inline */
+  CMD_CLASS_SCAN,      /* expensive read-only requests, e.g. show */
+  CMD_CLASSES,
+} cmd_class;
+
+/* per-connection state kept across commands */
+typedef struct {
+  proto_mode mode;
+} cmd_session;
+
+/* reply to a single command */
+typedef struct {
+  const char *data; /* reply bytes, not necessarily null-terminated */
+  size_t len;
+  char *heap;            /* owned buffer for replies over RESPONSE_INLINE */
+  stock_snapshot *snap;  /* held while data points into it */
+  char buf[RESPONSE_INLINE];
+} cmd_response;
+
+/* a request handed to the scan pool */
+struct __cmd_job {
+  scan_job base;
+  cmd_session *session;
+  cmd_request req;
+  cmd_response *response; /* where the reply is built */
+  cmd_status status;
+  uint64_t parsed; /* latency_now() after parsing, 0 if not timed */
+  sem_t *done;     /* posted once finished, for a waiting caller */
+  void (*on_done)(struct __cmd_job *job); /* or called instead, on the pool */
+  void *arg;
+  struct __cmd_job *next; /* free for on_done to queue the job */
+  cmd_response reply;     /* reply of a job from handle_line_async() */
+};
+
+typedef struct __cmd_job cmd_job;
+
 cmd_status handle_connection(int connfd);
 void handle_threaded_connection(int connfd);
+cmd_status handle_line(cmd_session *session, char *line,
+                       cmd_response *response);
+cmd_job *handle_line_async(cmd_session *session, char *line,
+                           cmd_response *response, cmd_status *status,
+                           void (*on_done)(cmd_job *job), void *arg);
+void command_job_free(cmd_job *job);
+cmd_class command_class(req_op op);
 cmd_status buy(int id, int n);
 cmd_status sell(int id, int n);
+cmd_status order(const int (*legs)[2], int n);
+
+void response_init(cmd_response *response);
+void response_printf(cmd_response *response, const char *fmt, ...);
+void response_release(cmd_response *response);
 
-size_t __parse(char *cmd, char **buf);
-cmd_status __handle_command(char *args[], int length, char response[]);
+cmd_status __handle_request(cmd_session *session, const cmd_request *req,
+                            cmd_response *response);
+int __response_iov(const cmd_session *session, const cmd_response *response,
+                   char *hdr, struct iovec *iov);
+int __write_response(int connfd, const cmd_session *session,
+                     const cmd_response *response);
 
-#endif /* __COMMAND_H__ */
\ No newline at end of file
+#endif /* __COMMAND_H__ */
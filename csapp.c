@@ -17,6 +17,7 @@
  */
 /* $begin csapp.c */
 #include "csapp.h"
+#include "misc.h"
 
 /**************************
  * Error-handling functions
@@ -629,6 +630,7 @@ void Pthread_once(pthread_once_t *once_control, void (*init_function)()) {
  * Wrappers for Posix semaphores
  *******************************/
 
+#ifndef SEM_PROFILE
 void Sem_init(sem_t *sem, int pshared, unsigned int value) {
   if (sem_init(sem, pshared, value) < 0)
     unix_error("Sem_init error");
@@ -643,6 +645,210 @@ void V(sem_t *sem) {
   if (sem_post(sem) < 0)
     unix_error("V error");
 }
+#else
+/*
+ * Contention profiler, built with -DSEM_PROFILE. Semaphores initialised at
+ * the same place share a name, e.g. every queue's "&sp->mutex", and are
+ * counted together. Hold times are only kept for semaphores initialised to
+ * 1, i.e. used as mutexes. A ranked report goes to stderr on SIGUSR1.
+ */
+
+/* distinct names, and semaphores tracked by address */
+#define SEM_PROFILE_NAMES 64
+#define SEM_PROFILE_SLOTS (1 << 16)
+
+struct __sem_stats {
+  const char *name;
+  unsigned long acquires;
+  unsigned long contended; /* acquires that had to wait */
+  unsigned long long wait_ns, wait_max_ns;
+  unsigned long long hold_ns, hold_max_ns;
+  unsigned long holds;
+};
+
+struct __sem_slot {
+  sem_t *sem;
+  struct __sem_stats *stats;
+  int mutex;                      /* initialised to 1 */
+  unsigned long long acquired_ns; /* when the current holder got it */
+};
+
+static struct {
+  pthread_mutex_t lock; /* guards registration */
+  struct __sem_stats names[SEM_PROFILE_NAMES];
+  int nnames;
+  struct __sem_slot slots[SEM_PROFILE_SLOTS];
+} semprof = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void __sem_max(unsigned long long *max, unsigned long long v) {
+  unsigned long long old = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (v > old && !__atomic_compare_exchange_n(max, &old, v, 1,
+                                                 __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED))
+    ;
+}
+
+/*
+ * __sem_slot - find the slot of sem, registering it under name on first
+ * sight. Lookups are lock-free; slots are never freed.
+ */
+static struct __sem_slot *__sem_slot(sem_t *sem, const char *name,
+                                     unsigned int value) {
+  size_t h = ((size_t)sem >> 3) * 0x9e3779b97f4a7c15ull;
+  struct __sem_slot *slot;
+  sem_t *seen;
+  int i;
+
+  for (size_t n = 0; n < SEM_PROFILE_SLOTS; n++) {
+    slot = &semprof.slots[(h + n) & (SEM_PROFILE_SLOTS - 1)];
+    if ((seen = __atomic_load_n(&slot->sem, __ATOMIC_ACQUIRE)) == sem)
+      return slot;
+    if (seen)
+      continue;
+
+    pthread_mutex_lock(&semprof.lock);
+    if (slot->sem) { /* taken meanwhile, look again */
+      pthread_mutex_unlock(&semprof.lock);
+      n--;
+      continue;
+    }
+    name = name ? name : "(unnamed)";
+    name += *name == '&';
+    for (i = 0; i < semprof.nnames; i++)
+      if (!strcmp(semprof.names[i].name, name))
+        break;
+    if (i == semprof.nnames && i < SEM_PROFILE_NAMES - 1)
+      semprof.names[semprof.nnames++].name = name;
+    else if (i == semprof.nnames)
+      i = SEM_PROFILE_NAMES - 1; /* out of names: lump the rest together */
+    semprof.names[SEM_PROFILE_NAMES - 1].name = "(other)";
+    slot->stats = &semprof.names[i];
+    slot->mutex = value == 1;
+    __atomic_store_n(&slot->sem, sem, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&semprof.lock);
+    return slot;
+  }
+  app_error("sem profiler: too many semaphores");
+  return NULL;
+}
+
+void Sem_init_named(sem_t *sem, int pshared, unsigned int value,
+                    const char *name) {
+  if (sem_init(sem, pshared, value) < 0)
+    unix_error("Sem_init error");
+  __sem_slot(sem, name, value);
+}
+
+void P(sem_t *sem) {
+  struct __sem_slot *slot = __sem_slot(sem, NULL, 0);
+  struct __sem_stats *st = slot->stats;
+  unsigned long long start = 0, now = 0;
+
+  if (sem_trywait(sem) < 0) {
+    if (errno != EAGAIN)
+      unix_error("P error");
+    start = now_ns();
+    if (sem_wait(sem) < 0)
+      unix_error("P error");
+    now = now_ns();
+    __atomic_fetch_add(&st->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->wait_ns, now - start, __ATOMIC_RELAXED);
+    __sem_max(&st->wait_max_ns, now - start);
+  }
+  __atomic_fetch_add(&st->acquires, 1, __ATOMIC_RELAXED);
+  if (slot->mutex)
+    slot->acquired_ns = now ? now : now_ns();
+}
+
+void V(sem_t *sem) {
+  struct __sem_slot *slot = __sem_slot(sem, NULL, 0);
+  struct __sem_stats *st = slot->stats;
+  unsigned long long hold;
+
+  if (slot->mutex && slot->acquired_ns) {
+    hold = now_ns() - slot->acquired_ns;
+    __atomic_fetch_add(&st->holds, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->hold_ns, hold, __ATOMIC_RELAXED);
+    __sem_max(&st->hold_max_ns, hold);
+  }
+  if (sem_post(sem) < 0)
+    unix_error("V error");
+}
+
+static int __sem_by_wait(const void *a, const void *b) {
+  const struct __sem_stats *x = a, *y = b;
+  return (x->wait_ns < y->wait_ns) - (x->wait_ns > y->wait_ns);
+}
+
+/*
+ * sem_profile_report - print every named semaphore into buf, most total
+ * wait first. Returns the length of the report, which is cut at cap.
+ */
+size_t sem_profile_report(char *buf, size_t cap) {
+  struct __sem_stats copy[SEM_PROFILE_NAMES], *st;
+  size_t len = 0;
+  int n = 0;
+
+  for (int i = 0; i < SEM_PROFILE_NAMES; i++) {
+    st = &semprof.names[i];
+    if (!__atomic_load_n(&st->acquires, __ATOMIC_RELAXED))
+      continue;
+    copy[n].name = st->name;
+    copy[n].acquires = __atomic_load_n(&st->acquires, __ATOMIC_RELAXED);
+    copy[n].contended = __atomic_load_n(&st->contended, __ATOMIC_RELAXED);
+    copy[n].wait_ns = __atomic_load_n(&st->wait_ns, __ATOMIC_RELAXED);
+    copy[n].wait_max_ns = __atomic_load_n(&st->wait_max_ns, __ATOMIC_RELAXED);
+    copy[n].holds = __atomic_load_n(&st->holds, __ATOMIC_RELAXED);
+    copy[n].hold_ns = __atomic_load_n(&st->hold_ns, __ATOMIC_RELAXED);
+    copy[n].hold_max_ns = __atomic_load_n(&st->hold_max_ns, __ATOMIC_RELAXED);
+    n++;
+  }
+  qsort(copy, n, sizeof(copy[0]), __sem_by_wait);
+
+  len += snprintf(buf, cap,
+                  "semaphore acquires contended_pct wait_total_ms "
+                  "wait_max_us hold_avg_us hold_max_us\n");
+  for (int i = 0; i < n && len < cap; i++) {
+    st = &copy[i];
+    len += snprintf(buf + len, cap - len, "%s %lu %.1f %.3f %.1f %.2f %.1f\n",
+                    st->name, st->acquires,
+                    100.0 * st->contended / st->acquires, st->wait_ns / 1e6,
+                    st->wait_max_ns / 1e3,
+                    st->holds ? st->hold_ns / 1e3 / st->holds : 0.0,
+                    st->hold_max_ns / 1e3);
+  }
+  return len < cap ? len : cap - 1;
+}
+
+static void *__sem_reporter(void *vargp) {
+  sigset_t *set = (sigset_t *)vargp;
+  char buf[MAXBUF];
+  int sig;
+
+  while (1) {
+    if (!sigwait(set, &sig)) {
+      sem_profile_report(buf, sizeof(buf));
+      fputs(buf, stderr);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Runs before main(), so every thread the program starts inherits the
+ * blocked SIGUSR1 and only the reporter thread receives it.
+ */
+__attribute__((constructor)) static void __sem_profile_start(void) {
+  static sigset_t set;
+  pthread_t tid;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  Pthread_create(&tid, NULL, __sem_reporter, &set);
+  Pthread_detach(tid);
+}
+#endif
 
 /****************************************
  * The Rio package - Robust I/O functions
@@ -61,10 +61,12 @@ extern char **environ; /* Defined by libc */
 #define LISTENQ 1024 /* Second argument to listen() */
 
 /* Our own error-handling functions */
-void unix_error(char *msg);
+void unix_error(char *msg) __attribute__((noreturn));
 void posix_error(int code, char *msg);
 void dns_error(char *msg);
+#ifndef _GNU_SOURCE /* clashes with the glibc extension of the same name */
 void gai_error(int code, char *msg);
+#endif
 void app_error(char *msg);
 
 /* Process control wrappers */
@@ -168,7 +170,16 @@ pthread_t Pthread_self(void);
 void Pthread_once(pthread_once_t *once_control, void (*init_function)());
 
 /* POSIX semaphore wrappers */
+#ifdef SEM_PROFILE
+/* every semaphore is named after the expression it was initialised with */
+#define Sem_init(sem, pshared, value)                                          \
+  Sem_init_named(sem, pshared, value, #sem)
+void Sem_init_named(sem_t *sem, int pshared, unsigned int value,
+                    const char *name);
+size_t sem_profile_report(char *buf, size_t cap);
+#else
 void Sem_init(sem_t *sem, int pshared, unsigned int value);
+#endif
 void P(sem_t *sem);
 void V(sem_t *sem);
 
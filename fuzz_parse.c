@@ -0,0 +1,224 @@
+/*
+ * fuzz_parse.c - fuzz target for the request parser
+ *
+ * Every input must parse without reading past its end, and a request that
+ * parses must parse to the same thing again once printed back in canonical
+ * form. Build with clang -fsanitize=fuzzer,address,undefined -DLIBFUZZER to
+ * run under libFuzzer; `make fuzz` builds a standalone driver that mutates
+ * the seed lines below at random under the address and undefined behavior
+ * sanitizers.
+ */
+#include <assert.h>
+#include <stdint.h>
+
+#include "csapp.h"
+#include "parse.h"
+#include "proto.h"
+
+#define DEFAULT_RUNS 2000000
+
+/**
+ * @brief Print @p req back as the canonical request line.
+ */
+static void __render(const cmd_request *req, char *buf, size_t size) {
+  static const char *words[] = {
+      [REQ_EXIT] = "exit",   [REQ_SHOW] = "show",   [REQ_SHOW_RANGE] = "show",
+      [REQ_STATS] = "stats", [REQ_VALUE] = "value", [REQ_LOWSTOCK] = "lowstock",
+      [REQ_BUY] = "buy",     [REQ_SELL] = "sell",
+  };
+
+  size_t len;
+
+  switch (req->op) {
+  case REQ_ORDER:
+    len = snprintf(buf, size, "order");
+    for (int i = 0; i < req->nlegs; i++) {
+      len += snprintf(buf + len, size - len, " %s %d %d",
+                      req->legs[i][1] < 0 ? "buy" : "sell", req->legs[i][0],
+                      abs(req->legs[i][1]));
+    }
+    snprintf(buf + len, size - len, "\n");
+    break;
+  case REQ_SHOW_PAGE:
+    snprintf(buf, size, "show page %d %d\n", req->arg[0], req->arg[1]);
+    break;
+  case REQ_LIMIT_BUY:
+  case REQ_LIMIT_SELL:
+    snprintf(buf, size, "limit %s %d %d %d\n",
+             req->op == REQ_LIMIT_BUY ? "buy" : "sell", req->arg[0],
+             req->arg[1], req->arg[2]);
+    break;
+  case REQ_MARKET_BUY:
+  case REQ_MARKET_SELL:
+    snprintf(buf, size, "market %s %d %d\n",
+             req->op == REQ_MARKET_BUY ? "buy" : "sell", req->arg[0],
+             req->arg[1]);
+    break;
+  case REQ_ADMIN_HOT:
+  case REQ_ADMIN_COLD:
+    snprintf(buf, size, "admin %s %d\n",
+             req->op == REQ_ADMIN_HOT ? "hot" : "cold", req->arg[0]);
+    break;
+  case REQ_CANCEL:
+  case REQ_BOOK:
+    snprintf(buf, size, "%s %d\n", req->op == REQ_CANCEL ? "cancel" : "book",
+             req->arg[0]);
+    break;
+  case REQ_ADMIN_POOL:
+    snprintf(buf, size, "admin pool\n");
+    break;
+  case REQ_ADMIN_LOCKS:
+    snprintf(buf, size, "admin locks\n");
+    break;
+  case REQ_ADMIN_SCHED:
+    snprintf(buf, size, "admin sched\n");
+    break;
+  case REQ_ADMIN_STATS:
+  case REQ_ADMIN_STATS_ON:
+  case REQ_ADMIN_STATS_OFF:
+    snprintf(buf, size, "admin stats%s\n",
+             req->op == REQ_ADMIN_STATS ? ""
+             : req->op == REQ_ADMIN_STATS_ON ? " on"
+                                             : " off");
+    break;
+  case REQ_PROTO:
+    snprintf(buf, size, "proto %s\n",
+             req->arg[0] == PROTO_FRAMED ? "framed" : "legacy");
+    break;
+  case REQ_LOWSTOCK:
+    snprintf(buf, size, "%s %d\n", words[req->op], req->arg[0]);
+    break;
+  case REQ_SHOW_RANGE:
+  case REQ_BUY:
+  case REQ_SELL:
+    snprintf(buf, size, "%s %d %d\n", words[req->op], req->arg[0],
+             req->arg[1]);
+    break;
+  default:
+    snprintf(buf, size, "%s\n", words[req->op]);
+  }
+}
+
+/**
+ * @brief Number of arguments a request of @p op carries.
+ */
+static int __nargs(req_op op) {
+  switch (op) {
+  case REQ_LOWSTOCK:
+  case REQ_PROTO:
+  case REQ_CANCEL:
+  case REQ_BOOK:
+  case REQ_ADMIN_HOT:
+  case REQ_ADMIN_COLD:
+    return 1;
+  case REQ_SHOW_RANGE:
+  case REQ_SHOW_PAGE:
+  case REQ_BUY:
+  case REQ_SELL:
+  case REQ_MARKET_BUY:
+  case REQ_MARKET_SELL:
+    return 2;
+  case REQ_LIMIT_BUY:
+  case REQ_LIMIT_SELL:
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char *line = (char *)Malloc(size + 1), canon[MAXLINE];
+  cmd_request req, again;
+
+  // the server hands over lines cut at the newline and null-terminated
+  memcpy(line, data, size);
+  line[size] = '\0';
+  if (parse_request(line, &req) != REQ_INVALID) {
+    __render(&req, canon, sizeof(canon));
+    assert(parse_request(canon, &again) == req.op);
+    for (int i = 0; i < __nargs(req.op); i++) {
+      assert(again.arg[i] == req.arg[i]);
+    }
+    if (req.op == REQ_ORDER) {
+      assert(again.nlegs == req.nlegs &&
+             !memcmp(again.legs, req.legs, req.nlegs * sizeof(req.legs[0])));
+    }
+  }
+  Free(line);
+  return 0;
+}
+
+#ifndef LIBFUZZER
+static const char *seeds[] = {
+    "buy 1 2",        "sell -3 +4\r",       "show",
+    "show 1 99",      "show page 0 10",     "lowstock 10",
+    "proto framed",   "stats",              "exit\n",
+    "buy 2147483647 -2147483648",           "value  \t",
+    "order buy 1 2 sell 3 4",               "order sell 7 0",
+    "limit buy 1 5 100",                    "market sell 2 3",
+    "cancel 1048577",                       "book 4",
+    "admin hot 3",                          "admin cold 3",
+    "admin sched",
+};
+#define NSEEDS (sizeof(seeds) / sizeof(seeds[0]))
+
+/**
+ * @brief Apply a few random byte edits to @p buf of @p len bytes.
+ *
+ * @return New length.
+ */
+static size_t __mutate(uint8_t *buf, size_t len, size_t cap, unsigned *seed) {
+  static const char dict[] = " \t\r\n-+09page";
+
+  for (int edits = rand_r(seed) % 4 + 1; edits; edits--) {
+    size_t at = len ? rand_r(seed) % (len + 1) : 0;
+    switch (rand_r(seed) % 4) {
+    case 0: // overwrite
+      if (at < len) {
+        buf[at] = rand_r(seed);
+      }
+      break;
+    case 1: // insert from the dictionary
+      if (len < cap) {
+        memmove(buf + at + 1, buf + at, len - at);
+        buf[at] = dict[rand_r(seed) % (sizeof(dict) - 1)];
+        len++;
+      }
+      break;
+    case 2: // delete
+      if (at < len) {
+        memmove(buf + at, buf + at + 1, len - at - 1);
+        len--;
+      }
+      break;
+    default: // swap in a digit run to probe overflow checks
+      if (at < len) {
+        buf[at] = '0' + rand_r(seed) % 10;
+      }
+    }
+  }
+  return len;
+}
+
+int main(int argc, char **argv) {
+  long runs = argc > 1 ? atol(argv[1]) : DEFAULT_RUNS;
+  unsigned seed = argc > 2 ? atoi(argv[2]) : 1;
+  long valid = 0;
+  uint8_t buf[64];
+  size_t len;
+  cmd_request req;
+
+  for (long i = 0; i < runs; i++) {
+    const char *s = seeds[rand_r(&seed) % NSEEDS];
+    len = strlen(s);
+    memcpy(buf, s, len);
+    len = __mutate(buf, len, sizeof(buf) - 1, &seed);
+    LLVMFuzzerTestOneInput(buf, len);
+
+    buf[len] = '\0';
+    valid += parse_request((char *)buf, &req) != REQ_INVALID;
+  }
+  printf("%ld inputs, %ld parsed as requests\n", runs, valid);
+  return 0;
+}
+#endif
@@ -0,0 +1,215 @@
+#include "hash.h"
+
+/**
+ * @brief Slot tag of @p key. Never 0, which marks an empty slot.
+ */
+static inline uint64_t __tag(int key) {
+  return (uint64_t)(uint32_t)key | 1ull << 32;
+}
+
+/**
+ * @brief Home slot of @p key in @p table.
+ * @note Fibonacci hashing: consecutive IDs land far apart, and the top bits
+ * of the product depend on every bit of the key.
+ */
+static inline size_t __home(const struct __hash_table *table, int key) {
+  return ((uint32_t)key * 0x9e3779b97f4a7c15ull) >> table->shift;
+}
+
+static struct __hash_table *__table_new(size_t slots) {
+  struct __hash_table *table = (struct __hash_table *)Calloc(
+      1, sizeof(struct __hash_table) + slots * sizeof(struct __hash_slot));
+  table->mask = slots - 1;
+  table->shift = 64 - __builtin_ctzll(slots);
+  return table;
+}
+
+/**
+ * @brief Replace the table of @p hash with one of at least @p slots slots,
+ * unless it already has that many.
+ * @note Waits for inserts in progress and blocks new ones, never lookups.
+ * The old table stays allocated until hash_free(), since lookups that
+ * started on it may still be reading it.
+ */
+static void __grow(hash_t *hash, size_t slots) {
+  struct __hash_table *old, *table;
+  struct __hash_slot *slot;
+  size_t i;
+
+  pthread_rwlock_wrlock(&hash->resize);
+  old = hash->table;
+  if (old && old->mask + 1 >= slots) {
+    pthread_rwlock_unlock(&hash->resize);
+    return;
+  }
+  table = __table_new(slots);
+  for (size_t j = 0; old && j <= old->mask; j++) {
+    if (!old->slots[j].tag) {
+      continue;
+    }
+    i = __home(table, (int)old->slots[j].tag);
+    while ((slot = &table->slots[i])->tag) {
+      i = (i + 1) & table->mask;
+    }
+    *slot = old->slots[j];
+  }
+  table->prev = old;
+  __atomic_store_n(&hash->table, table, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&hash->resize);
+  debug_print("hash grew to %zu slots for %zu keys", slots, hash->size);
+}
+
+/**
+ * @brief Smallest table size that holds @p n keys without growing.
+ */
+static size_t __slots_for(size_t n) {
+  size_t slots = HASH_MIN_SLOTS;
+  while (n > slots / HASH_LOAD_DEN * HASH_LOAD_NUM) {
+    slots *= 2;
+  }
+  return slots;
+}
+
+/**
+ * @brief Initialise an empty hash. The first table is allocated on the first
+ * insertion.
+ */
+void hash_init(hash_t *hash) { *hash = (hash_t)HASH_INITIALIZER; }
+
+/**
+ * @brief Release every table of @p hash. Stored values are not freed.
+ * @note No other thread may use @p hash meanwhile.
+ */
+void hash_free(hash_t *hash) {
+  struct __hash_table *table, *prev;
+
+  for (table = hash->table; table; table = prev) {
+    prev = table->prev;
+    Free(table);
+  }
+  pthread_rwlock_destroy(&hash->resize);
+  hash_init(hash);
+}
+
+/**
+ * @brief Grow @p hash so that it holds @p n keys without growing again.
+ */
+void hash_reserve(hash_t *hash, size_t n) { __grow(hash, __slots_for(n)); }
+
+/**
+ * @brief Build @p hash from @p n values in a single pass.
+ * @note No other thread may use @p hash meanwhile. Home slots are fetched
+ * HASH_PREFETCH keys ahead, so the cache misses of a large table overlap
+ * instead of adding up.
+ *
+ * @param hash Empty hash to build
+ * @param base First value. Values are stored as pointers into this array
+ * @param stride Distance in bytes between consecutive values
+ * @param key_offset Offset of the int key inside each value. Keys must be
+ * distinct
+ */
+void hash_bulk_load(hash_t *hash, void *base, size_t n, size_t stride,
+                    size_t key_offset) {
+  struct __hash_table *table;
+  char *val;
+  size_t i;
+  int key;
+
+  if (hash->size) {
+    app_error("hash_bulk_load() needs an empty hash");
+  }
+  hash_reserve(hash, n);
+  table = hash->table;
+  for (size_t j = 0; j < n; j++) {
+    if (j + HASH_PREFETCH < n) {
+      key = *(int *)((char *)base + (j + HASH_PREFETCH) * stride + key_offset);
+      __builtin_prefetch(&table->slots[__home(table, key)], 1);
+    }
+    val = (char *)base + j * stride;
+    key = *(int *)(val + key_offset);
+    for (i = __home(table, key); table->slots[i].tag;
+         i = (i + 1) & table->mask) {
+    }
+    table->slots[i] = (struct __hash_slot){__tag(key), val};
+  }
+  hash->size = n;
+  debug_print("bulk loaded %zu keys into %zu slots", n, table->mask + 1);
+}
+
+/**
+ * @brief Look up @p key in @p hash.
+ * @note Lock-free. Runs concurrently with insertions and growth, and misses
+ * keys whose insertion has not completed.
+ *
+ * @return Value stored for @p key, NULL if no such key exists.
+ */
+void *hash_search(const hash_t *hash, int key) {
+  struct __hash_table *table = __atomic_load_n(&hash->table, __ATOMIC_ACQUIRE);
+  uint64_t tag = __tag(key), seen;
+  size_t i;
+
+  if (!table) {
+    return NULL;
+  }
+  for (i = __home(table, key);; i = (i + 1) & table->mask) {
+    seen = __atomic_load_n(&table->slots[i].tag, __ATOMIC_ACQUIRE);
+    if (seen == tag) {
+      return __atomic_load_n(&table->slots[i].val, __ATOMIC_ACQUIRE);
+    } else if (!seen) {
+      return NULL;
+    }
+  }
+}
+
+/**
+ * @brief Insert @p val under @p key unless the key is already present.
+ * @note Lock-free against other insertions: a key claims its slot with a
+ * single compare-and-swap, and @p val is published after it. Only waits
+ * while the table grows, which the insertion that would push it past its
+ * load factor does first.
+ *
+ * @param val Value to store, not NULL
+ * @return Value already stored for @p key, or NULL if @p val was inserted.
+ */
+void *hash_insert(hash_t *hash, int key, void *val) {
+  struct __hash_table *table;
+  struct __hash_slot *slot;
+  uint64_t tag = __tag(key), seen;
+  void *found;
+  size_t i, size;
+
+  while (1) {
+    pthread_rwlock_rdlock(&hash->resize);
+    table = hash->table;
+    // count the key before probing, so the table never fills up
+    size = __atomic_add_fetch(&hash->size, 1, __ATOMIC_RELAXED);
+    if (table && size <= (table->mask + 1) / HASH_LOAD_DEN * HASH_LOAD_NUM) {
+      break;
+    }
+    __atomic_sub_fetch(&hash->size, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&hash->resize);
+    __grow(hash, __slots_for(size));
+  }
+
+  for (i = __home(table, key);; i = (i + 1) & table->mask) {
+    slot = &table->slots[i];
+    seen = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+    if (!seen && __atomic_compare_exchange_n(&slot->tag, &seen, tag, 0,
+                                             __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    if (seen == tag) {
+      // an insertion of the same key may still be publishing its value
+      while (!(found = __atomic_load_n(&slot->val, __ATOMIC_ACQUIRE))) {
+        sched_yield();
+      }
+      __atomic_sub_fetch(&hash->size, 1, __ATOMIC_RELAXED);
+      pthread_rwlock_unlock(&hash->resize);
+      return found;
+    }
+  }
+  __atomic_store_n(&slot->val, val, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&hash->resize);
+  return NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "csapp.h"
+#include "misc.h"
+
+/* keys whose home slots are prefetched ahead of a bulk load */
+#define HASH_PREFETCH 16
+/* slots of the first table */
+#define HASH_MIN_SLOTS 64
+/* the table doubles once more than 3/4 of its slots are taken */
+#define HASH_LOAD_NUM 3
+#define HASH_LOAD_DEN 4
+
+/* a key, tagged so that an empty slot reads 0, and its value */
+struct __hash_slot {
+  uint64_t tag;
+  void *val; /* NULL until the insertion completes */
+};
+
+struct __hash_table {
+  size_t mask;                /* slots - 1 */
+  int shift;                  /* 64 - log2(slots) */
+  struct __hash_table *prev;  /* outgrown table, readers may still be on it */
+  struct __hash_slot slots[]; /* linear probing */
+};
+
+struct __hash {
+  struct __hash_table *table;
+  size_t size;             /* keys inserted */
+  pthread_rwlock_t resize; /* inserts hold it shared, growth exclusively */
+};
+
+typedef struct __hash hash_t;
+
+#define HASH_INITIALIZER                                                       \
+  { .table = NULL, .size = 0, .resize = PTHREAD_RWLOCK_INITIALIZER, }
+
+void hash_init(hash_t *hash);
+void hash_free(hash_t *hash);
+void hash_reserve(hash_t *hash, size_t n);
+void hash_bulk_load(hash_t *hash, void *base, size_t n, size_t stride,
+                    size_t key_offset);
+
+void *hash_search(const hash_t *hash, int key);
+void *hash_insert(hash_t *hash, int key, void *val);
+
+#endif /* __HASH_H__ */
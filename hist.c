@@ -0,0 +1,106 @@
+#include "hist.h"
+
+#include <string.h>
+
+static inline int __bucket(uint64_t value) {
+  int e;
+  if (value < HIST_SUB) {
+    return value;
+  }
+  e = 63 - __builtin_clzll(value);
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+         ((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * @brief Largest value that falls into bucket @p idx.
+ */
+static inline uint64_t __bucket_max(int idx) {
+  int shift;
+  if (idx < HIST_SUB) {
+    return idx;
+  }
+  shift = idx / HIST_SUB - 1;
+  return (((uint64_t)(HIST_SUB + idx % HIST_SUB) + 1) << shift) - 1;
+}
+
+/**
+ * @brief Reset @p h to hold no values.
+ */
+void hist_init(hist_t *h) {
+  memset(h, 0, sizeof(hist_t));
+  h->min = UINT64_MAX;
+}
+
+/**
+ * @brief Record @p value into @p h.
+ * @note Each histogram must have a single writer. Fields are stored with
+ * relaxed atomics, so other threads may merge it at any time without locks
+ * and see a slightly stale but never torn count.
+ */
+void hist_record(hist_t *h, uint64_t value) {
+  uint64_t *bucket = &h->buckets[__bucket(value)];
+
+  __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+  if (value < h->min) {
+    __atomic_store_n(&h->min, value, __ATOMIC_RELAXED);
+  }
+  if (value > h->max) {
+    __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Add every value recorded in @p src to @p dst.
+ */
+void hist_merge(hist_t *dst, const hist_t *src) {
+  uint64_t v;
+
+  if (!__atomic_load_n(&src->count, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    v = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    dst->buckets[i] += v;
+    dst->count += v; // consistent with the buckets actually merged
+  }
+  dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+  if ((v = __atomic_load_n(&src->min, __ATOMIC_RELAXED)) < dst->min) {
+    dst->min = v;
+  }
+  if ((v = __atomic_load_n(&src->max, __ATOMIC_RELAXED)) > dst->max) {
+    dst->max = v;
+  }
+}
+
+/**
+ * @brief Value below which a fraction @p p of the recorded values fall.
+ *
+ * @param p Fraction in [0, 1], e.g. 0.999 for the 99.9th percentile
+ * @return Upper bound of the bucket holding the percentile, capped to the
+ * largest recorded value. 0 if @p h is empty.
+ */
+uint64_t hist_percentile(const hist_t *h, double p) {
+  uint64_t rank, seen = 0;
+
+  if (!h->count) {
+    return 0;
+  }
+  rank = (uint64_t)(p * h->count + 0.5);
+  rank = rank ? rank : 1;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    if ((seen += h->buckets[i]) >= rank) {
+      return __bucket_max(i) < h->max ? __bucket_max(i) : h->max;
+    }
+  }
+  return h->max;
+}
+
+/**
+ * @brief Arithmetic mean of the recorded values, 0 if @p h is empty.
+ */
+double hist_mean(const hist_t *h) {
+  return h->count ? (double)h->sum / h->count : 0;
+}
@@ -0,0 +1,29 @@
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdint.h>
+
+/* each power of two range is split into 1 << HIST_SUB_BITS buckets,
+ * which bounds the relative error of a reported value to ~6% */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* log-linear histogram of non-negative values, e.g. latencies in ns */
+struct __hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[HIST_BUCKETS];
+};
+
+typedef struct __hist hist_t;
+
+void hist_init(hist_t *h);
+void hist_record(hist_t *h, uint64_t value);
+void hist_merge(hist_t *dst, const hist_t *src);
+uint64_t hist_percentile(const hist_t *h, double p);
+double hist_mean(const hist_t *h);
+
+#endif /* __HIST_H__ */
@@ -0,0 +1,224 @@
+#include "latency.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "csapp.h"
+
+/* histograms of one thread. only that thread records into them */
+struct __latency_thread {
+  uint64_t count[LATENCY_MAX_OPS]; /* requests served, timed or not */
+  hist_t *hist[LATENCY_MAX_OPS][LATENCY_PHASES];
+  struct __latency_thread *prev, *next;
+};
+
+int latency_enabled = 1;
+__thread int latency_sampled; /* the current request is being timed */
+
+static struct {
+  pthread_mutex_t mutex; /* guards the thread list and retired */
+  pthread_key_t key;
+  pthread_once_t once;
+  struct __latency_thread *threads;
+  struct __latency_thread retired; /* what exited threads recorded */
+} lat = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+static __thread struct __latency_thread *self;
+static __thread int current_op;
+static __thread int countdown; /* requests until the next timed one */
+static __thread uint32_t rng;  /* xorshift state for the sampling gaps */
+
+static const char *phase_names[] = {
+    [LATENCY_PARSE] = "parse",     [LATENCY_LOOKUP] = "lookup",
+    [LATENCY_LOCK] = "lock",       [LATENCY_EXECUTE] = "execute",
+    [LATENCY_WRITE] = "write",
+};
+
+/**
+ * @brief Fold what an exiting thread recorded into the retired totals.
+ */
+static void __retire(void *vargp) {
+  struct __latency_thread *t = (struct __latency_thread *)vargp;
+
+  pthread_mutex_lock(&lat.mutex);
+  if (t->prev) {
+    t->prev->next = t->next;
+  } else {
+    lat.threads = t->next;
+  }
+  if (t->next) {
+    t->next->prev = t->prev;
+  }
+  for (int op = 0; op < LATENCY_MAX_OPS; op++) {
+    lat.retired.count[op] += t->count[op];
+    for (int ph = 0; ph < LATENCY_PHASES; ph++) {
+      if (!t->hist[op][ph]) {
+        continue;
+      }
+      if (!lat.retired.hist[op][ph]) {
+        lat.retired.hist[op][ph] = (hist_t *)Malloc(sizeof(hist_t));
+        hist_init(lat.retired.hist[op][ph]);
+      }
+      hist_merge(lat.retired.hist[op][ph], t->hist[op][ph]);
+      Free(t->hist[op][ph]);
+    }
+  }
+  pthread_mutex_unlock(&lat.mutex);
+  Free(t);
+}
+
+static void __init(void) { pthread_key_create(&lat.key, __retire); }
+
+/**
+ * @brief Histograms of the calling thread, registered on first use.
+ */
+static struct __latency_thread *__self(void) {
+  if (!self) {
+    Pthread_once(&lat.once, __init);
+    self = (struct __latency_thread *)Calloc(1,
+                                             sizeof(struct __latency_thread));
+    pthread_setspecific(lat.key, self);
+    pthread_mutex_lock(&lat.mutex);
+    self->next = lat.threads;
+    if (lat.threads) {
+      lat.threads->prev = self;
+    }
+    lat.threads = self;
+    pthread_mutex_unlock(&lat.mutex);
+  }
+  return self;
+}
+
+/**
+ * @brief Turn recording on or off for every thread.
+ */
+void latency_enable(int on) {
+  __atomic_store_n(&latency_enabled, on, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Begin a request on the calling thread and decide whether to time
+ * it.
+ *
+ * @return Start time in ns if the request is timed, 0 otherwise.
+ */
+uint64_t latency_start(void) {
+  if (--countdown > 0 ||
+      !__atomic_load_n(&latency_enabled, __ATOMIC_RELAXED)) {
+    latency_sampled = 0;
+    return 0;
+  }
+  // random gaps averaging LATENCY_SAMPLE, so a repeating request pattern
+  // cannot keep some request kind from ever being timed
+  if (!rng) {
+    rng = (uint32_t)(uintptr_t)&rng | 1;
+  }
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  countdown = 1 + rng % (2 * LATENCY_SAMPLE - 1);
+  latency_sampled = 1;
+  return latency_now();
+}
+
+/**
+ * @brief Count the current request as kind @p op, and attribute the phases
+ * recorded next to it.
+ */
+void latency_set_op(int op) {
+  struct __latency_thread *t;
+
+  if (!__atomic_load_n(&latency_enabled, __ATOMIC_RELAXED)) {
+    return;
+  }
+  t = __self();
+  current_op = op >= 0 && op < LATENCY_MAX_OPS ? op : 0;
+  __atomic_store_n(&t->count[current_op], t->count[current_op] + 1,
+                   __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Carry on with a request of kind @p op that another thread began
+ * and already counted, timing its remaining phases if @p sampled.
+ */
+void latency_resume(int op, int sampled) {
+  current_op = op >= 0 && op < LATENCY_MAX_OPS ? op : 0;
+  latency_sampled =
+      sampled && __atomic_load_n(&latency_enabled, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Record that @p phase of the current request took @p ns, if the
+ * request is timed.
+ * @note Lock-free: each thread writes its own histograms, which are only
+ * allocated the first time a thread records an op and phase.
+ */
+void latency_record(latency_phase phase, uint64_t ns) {
+  struct __latency_thread *t;
+  hist_t *h;
+
+  if (!latency_sampled) {
+    return;
+  }
+  t = __self();
+  if (!(h = t->hist[current_op][phase])) {
+    h = (hist_t *)Malloc(sizeof(hist_t));
+    hist_init(h);
+    __atomic_store_n(&t->hist[current_op][phase], h, __ATOMIC_RELEASE);
+  }
+  hist_record(h, ns);
+}
+
+/**
+ * @brief Record that @p phase took from @p start, a latency_now() reading,
+ * until now. A 0 start means recording was off when the phase began.
+ */
+void latency_since(latency_phase phase, uint64_t start) {
+  uint64_t end;
+
+  if (start && (end = latency_now())) {
+    latency_record(phase, end - start);
+  }
+}
+
+/**
+ * @brief Merge every thread's histogram of @p op and @p phase into @p out.
+ * @note Threads keep recording meanwhile, so the result is a slightly
+ * stale but consistent view.
+ */
+void latency_collect(int op, latency_phase phase, hist_t *out) {
+  hist_t *h;
+
+  pthread_mutex_lock(&lat.mutex);
+  for (struct __latency_thread *t = lat.threads; t; t = t->next) {
+    if ((h = __atomic_load_n(&t->hist[op][phase], __ATOMIC_ACQUIRE))) {
+      hist_merge(out, h);
+    }
+  }
+  if (lat.retired.hist[op][phase]) {
+    hist_merge(out, lat.retired.hist[op][phase]);
+  }
+  pthread_mutex_unlock(&lat.mutex);
+}
+
+/**
+ * @brief Number of requests of kind @p op served so far, timed or not.
+ */
+uint64_t latency_count(int op) {
+  uint64_t n;
+
+  pthread_mutex_lock(&lat.mutex);
+  n = lat.retired.count[op];
+  for (struct __latency_thread *t = lat.threads; t; t = t->next) {
+    n += __atomic_load_n(&t->count[op], __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&lat.mutex);
+  return n;
+}
+
+const char *latency_phase_name(latency_phase phase) {
+  return phase_names[phase];
+}
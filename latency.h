@@ -0,0 +1,45 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+
+#include "hist.h"
+#include "misc.h"
+
+/* request kinds that can be told apart, i.e. the number of req_op values */
+#define LATENCY_MAX_OPS 32
+/* every thread times one request in this many. all of them are counted */
+#define LATENCY_SAMPLE 16
+
+/* steps of a request, each timed separately */
+typedef enum {
+  LATENCY_PARSE = 0, /* tokenizing and decoding the line */
+  LATENCY_LOOKUP,    /* finding the item by id */
+  LATENCY_LOCK,      /* waiting for the database gate */
+  LATENCY_EXECUTE,   /* running the request, lookup and lock included */
+  LATENCY_WRITE,     /* sending replies, per write to the socket */
+  LATENCY_PHASES,
+} latency_phase;
+
+extern int latency_enabled;
+extern __thread int latency_sampled;
+
+/**
+ * @brief Current time in ns, or 0 when the request being served is not
+ * timed, so callers skip the clock read as well.
+ */
+static inline uint64_t latency_now(void) {
+  return latency_sampled ? now_ns() : 0;
+}
+
+void latency_enable(int on);
+uint64_t latency_start(void);
+void latency_set_op(int op);
+void latency_resume(int op, int sampled);
+void latency_record(latency_phase phase, uint64_t ns);
+void latency_since(latency_phase phase, uint64_t start);
+void latency_collect(int op, latency_phase phase, hist_t *out);
+uint64_t latency_count(int op);
+const char *latency_phase_name(latency_phase phase);
+
+#endif /* __LATENCY_H__ */
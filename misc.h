@@ -2,8 +2,10 @@
 #define __MISC_H__
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef DEBUG
 #define DEBUG_TEST 1
@@ -12,7 +14,10 @@
 #endif
 
 #define DELIM_CHARS " "
-#define MAX_COMMAND_ARGS 3
+#define MAX_COMMAND_ARGS 4
+/* most legs of one `order`, each an op, an id and a quantity */
+#define ORDER_MAX_LEGS 16
+#define MAX_REQUEST_WORDS (1 + 3 * ORDER_MAX_LEGS)
 
 #define debug_print(fmt, ...)                                                  \
   do {                                                                         \
@@ -21,6 +26,15 @@
               ##__VA_ARGS__);                                                  \
   } while (0)
 
+/**
+ * @brief Monotonic clock in nanoseconds, for timestamps and durations.
+ */
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 char *ltrim(char *s);
 char *rtrim(char *s);
 char *trim(char *s);
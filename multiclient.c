@@ -1,112 +1,543 @@
+/*
+ * multiclient.c - load generator for the stock server
+ *
+ * Worker threads each drive a share of the connections from their own epoll
+ * loop. In closed-loop mode every connection keeps one request in flight. In
+ * open-loop mode (-r) requests are sent on a fixed schedule whether or not
+ * replies have arrived, and latency is measured from the scheduled send time
+ * so server stalls are not hidden by the client backing off.
+ *
+ * A JSON report goes to stdout and a human readable summary to stderr.
+ */
+#include <math.h>
+#include <sys/epoll.h>
+
 #include "csapp.h"
-#include <time.h>
+#include "hist.h"
+#include "misc.h"
+#include "proto.h"
 
-#define MAX_CLIENT 160
-#define ORDER_PER_CLIENT 10
-#define STOCK_NUM 10
+#define DEFAULT_CONNS 16
+#define DEFAULT_DURATION 10
+#define DEFAULT_ITEMS 10
+#define DEFAULT_ZIPF_THETA 0.99
 #define BUY_SELL_MAX 10
+#define MAX_EVENTS 256
+#define MAX_BURST 1024  /* open-loop sends per loop iteration */
+#define DRAIN_NS 2000000000ULL /* wait for replies after the run ends */
 
-int main(int argc, char **argv) {
-  pid_t pids[MAX_CLIENT];
-  int runprocess = 0, status, i;
-
-  int clientfd, num_client;
-  char *host, *port, buf[MAXLINE], tmp[3];
-  rio_t rio;
-
-  if (argc != 4) {
-    fprintf(stderr, "usage: %s <host> <port> <client#>\n", argv[0]);
-    exit(0);
-  }
-
-  host = argv[1];
-  port = argv[2];
-  num_client = atoi(argv[3]);
-
-  /*	fork for each client process	*/
-  while (runprocess < num_client) {
-    // wait(&state);
-    pids[runprocess] = fork();
-
-    if (pids[runprocess] < 0)
-      return -1;
-    /*	child process		*/
-    else if (pids[runprocess] == 0) {
-      printf("child %ld\n", (long)getpid());
-
-      clientfd = Open_clientfd(host, port);
-      Rio_readinitb(&rio, clientfd);
-      srand((unsigned int)getpid());
-
-      for (i = 0; i < ORDER_PER_CLIENT; i++) {
-        // int option = rand() % 2 ? 2 : 0; // test 4. show + sell
-        // int option = rand() % 2; // test 5. show + buy
-        int option = rand() % 3; // test 6. show + sell + buy
-
-        if (option == 0) { // show
-          strcpy(buf, "show\n");
-        } else if (option == 1) { // buy
-          int list_num = rand() % STOCK_NUM + 1;
-          int num_to_buy = rand() % BUY_SELL_MAX + 1; // 1~10
-
-          strcpy(buf, "buy ");
-          sprintf(tmp, "%d", list_num);
-          strcat(buf, tmp);
-
-          strcat(buf, " ");
-          sprintf(tmp, "%d", num_to_buy);
-          strcat(buf, tmp);
-          strcat(buf, "\n");
-        } else if (option == 2) { // sell
-          int list_num = rand() % STOCK_NUM + 1;
-          int num_to_sell = rand() % BUY_SELL_MAX + 1; // 1~10
-
-          strcpy(buf, "sell ");
-          sprintf(tmp, "%d", list_num);
-          strcat(buf, tmp);
-          strcat(buf, " ");
-          sprintf(tmp, "%d", num_to_sell);
-          strcat(buf, tmp);
-          strcat(buf, "\n");
-        }
-        // strcpy(buf, "show 1 1\n"); // test 1
-        // strcpy(buf, "sell 1 1\n"); // test 2
-        // strcpy(buf, "buy 1 1\n"); // test 3
+enum op { OP_SHOW = 0, OP_BUY, OP_SELL, OP_NUM, OP_PROTO = OP_NUM };
+static const char *op_names[OP_NUM] = {"show", "buy", "sell"};
+
+struct pending {
+  uint64_t sched_ns; /* when the request was due to be sent */
+  int op;
+};
+
+struct conn {
+  int fd;
+  char *in;
+  size_t in_len, in_cap;
+  char *out;
+  size_t out_off, out_len, out_cap;
+  struct pending *q; /* ring of requests awaiting a reply */
+  size_t q_head, q_len, q_cap;
+};
+
+struct worker {
+  int id;
+  int epfd;
+  int nconns;
+  struct conn *conns;
+  uint64_t rng;
+  uint64_t interval_ns; /* open-loop send interval, 0 for closed loop */
+  hist_t hist[OP_NUM];
+  uint64_t rejected[OP_NUM]; /* trades refused for lack of stock */
+  uint64_t errors;
+  pthread_t tid;
+};
+
+static struct {
+  char *host, *port;
+  proto_mode mode;
+  int nconns, nthreads, duration, nitems;
+  int mix[OP_NUM]; /* relative weight of each op */
+  int zipf;
+  double theta, rate;
+} cfg = {
+    .mode = PROTO_FRAMED,
+    .nconns = DEFAULT_CONNS,
+    .duration = DEFAULT_DURATION,
+    .nitems = DEFAULT_ITEMS,
+    .mix = {1, 1, 1},
+    .theta = DEFAULT_ZIPF_THETA,
+};
+
+/* zipfian generator constants, see Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases", SIGMOD 1994 */
+static double zipf_alpha, zipf_zetan, zipf_eta;
+static uint64_t start_ns, end_ns;
+
+/* xorshift64* */
+static uint64_t rng_next(uint64_t *s) {
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 2685821657736338717ULL;
+}
+
+static double rng_double(uint64_t *s) {
+  return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(int n, double theta) {
+  double zeta2 = 0;
+  zipf_zetan = 0;
+  for (int i = 1; i <= n; i++) {
+    zipf_zetan += 1 / pow(i, theta);
+    if (i == 2) {
+      zeta2 = zipf_zetan;
+    }
+  }
+  zipf_alpha = 1 / (1 - theta);
+  zipf_eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf_zetan);
+}
+
+/**
+ * @brief Pick a stock ID in [1, nitems]. Under zipf, ID 1 is the hottest.
+ */
+static int next_key(struct worker *w) {
+  double u, uz;
+  int k;
+
+  if (!cfg.zipf || cfg.nitems < 2) {
+    return rng_next(&w->rng) % cfg.nitems + 1;
+  }
+  u = rng_double(&w->rng);
+  uz = u * zipf_zetan;
+  if (uz < 1) {
+    return 1;
+  }
+  if (uz < 1 + pow(0.5, cfg.theta)) {
+    return 2;
+  }
+  k = 1 + (int)(cfg.nitems * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha));
+  return k > cfg.nitems ? cfg.nitems : k;
+}
 
-        Rio_writen(clientfd, buf, strlen(buf));
-        // Rio_readlineb(&rio, buf, MAXLINE);
-        Rio_readnb(&rio, buf, MAXLINE);
-        Fputs(buf, stdout);
+static int next_op(struct worker *w) {
+  int total = cfg.mix[OP_SHOW] + cfg.mix[OP_BUY] + cfg.mix[OP_SELL];
+  int r = rng_next(&w->rng) % total;
+  for (int op = 0; op < OP_NUM; op++) {
+    if (r < cfg.mix[op]) {
+      return op;
+    }
+    r -= cfg.mix[op];
+  }
+  return OP_SHOW;
+}
+
+static void reserve(char **buf, size_t *cap, size_t len, size_t need) {
+  size_t new_cap = *cap ? *cap : 4096;
+  while (new_cap - len < need) {
+    new_cap *= 2;
+  }
+  if (new_cap != *cap) {
+    *buf = Realloc(*buf, new_cap);
+    *cap = new_cap;
+  }
+}
 
-        usleep(1000000);
+/**
+ * @brief Write queued output of @p c until done or the socket is full.
+ */
+static void conn_flush(struct conn *c) {
+  ssize_t n;
+  while (c->out_off < c->out_len) {
+    if ((n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        unix_error("write error");
       }
+      return;
+    }
+    c->out_off += n;
+  }
+  c->out_off = c->out_len = 0;
+}
+
+/**
+ * @brief Queue request @p op on @p c, due at @p sched_ns.
+ */
+static void conn_send(struct worker *w, struct conn *c, int op,
+                      uint64_t sched_ns) {
+  char line[64];
+  int len;
+
+  if (op == OP_PROTO) {
+    len = snprintf(line, sizeof(line), "%s", PROTO_FRAMED_CMD);
+  } else if (op == OP_SHOW) {
+    len = snprintf(line, sizeof(line), "show\n");
+  } else {
+    len = snprintf(line, sizeof(line), "%s %d %d\n", op_names[op],
+                   next_key(w), (int)(rng_next(&w->rng) % BUY_SELL_MAX) + 1);
+  }
+
+  reserve(&c->out, &c->out_cap, c->out_len, len);
+  memcpy(c->out + c->out_len, line, len);
+  c->out_len += len;
+
+  if (c->q_len == c->q_cap) {
+    // grow the ring, unwrapping it into the new buffer
+    size_t cap = c->q_cap ? c->q_cap * 2 : 8;
+    struct pending *q = Malloc(cap * sizeof(struct pending));
+    for (size_t i = 0; i < c->q_len; i++) {
+      q[i] = c->q[(c->q_head + i) % c->q_cap];
+    }
+    free(c->q);
+    c->q = q;
+    c->q_cap = cap;
+    c->q_head = 0;
+  }
+  c->q[(c->q_head + c->q_len++) % c->q_cap] = (struct pending){sched_ns, op};
+  conn_flush(c);
+}
+
+/**
+ * @brief Size of the reply at the start of @p buf.
+ *
+ * @param avail Bytes available in @p buf
+ * @param[out] payload Offset of the reply text
+ * @param[out] len Length of the reply text
+ * @return Bytes the reply occupies in @p buf, 0 if it is incomplete.
+ */
+static size_t reply_size(const char *buf, size_t avail, proto_mode mode,
+                         size_t *payload, size_t *len) {
+  uint32_t nlen;
 
-      Close(clientfd);
-      exit(0);
+  if (mode == PROTO_LEGACY) {
+    *payload = 0;
+    *len = MAXLINE;
+    return avail >= MAXLINE ? MAXLINE : 0;
+  }
+  if (avail < PROTO_HEADER_LEN) {
+    return 0;
+  }
+  memcpy(&nlen, buf, PROTO_HEADER_LEN);
+  *payload = PROTO_HEADER_LEN;
+  *len = ntohl(nlen);
+  return avail >= *payload + *len ? *payload + *len : 0;
+}
+
+/**
+ * @brief Read and account for every reply available on @p c.
+ *
+ * @param[in,out] mode Protocol the connection is in
+ * @return Number of replies received.
+ */
+static int conn_receive(struct worker *w, struct conn *c, proto_mode *mode) {
+  size_t size, off, len, consumed = 0;
+  struct pending *p;
+  uint64_t now;
+  ssize_t n;
+  int replies = 0;
+
+  while (1) {
+    reserve(&c->in, &c->in_cap, c->in_len, MAXLINE);
+    n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      app_error("server closed the connection");
     }
-    /*	parten process		*/
-    /*else{
-            for(i=0;i<num_client;i++){
-                    waitpid(pids[i], &status, 0);
-            }
-    }*/
-    runprocess++;
+    c->in_len += n;
   }
-  for (i = 0; i < num_client; i++) {
-    waitpid(pids[i], &status, 0);
+
+  now = now_ns();
+  while (c->q_len) {
+    char *reply = c->in + consumed;
+    p = &c->q[c->q_head];
+    // the reply to the protocol switch already comes framed
+    size = reply_size(reply, c->in_len - consumed,
+                      p->op == OP_PROTO ? cfg.mode : *mode, &off, &len);
+    if (!size) {
+      break;
+    }
+    consumed += size;
+    c->q_head = (c->q_head + 1) % c->q_cap;
+    c->q_len--;
+
+    if (p->op == OP_PROTO) {
+      *mode = cfg.mode;
+      continue;
+    }
+    hist_record(&w->hist[p->op], now - p->sched_ns);
+    if (len >= 10 && !strncmp(reply + off, "Not enough", 10)) {
+      w->rejected[p->op]++;
+    } else if (len >= 7 && !strncmp(reply + off, "invalid", 7)) {
+      w->errors++;
+    }
+    replies++;
   }
 
-  /*clientfd = Open_clientfd(host, port);
-  Rio_readinitb(&rio, clientfd);
+  memmove(c->in, c->in + consumed, c->in_len - consumed);
+  c->in_len -= consumed;
+  return replies;
+}
+
+static void *worker_thread(void *vargp) {
+  struct worker *w = vargp;
+  struct epoll_event events[MAX_EVENTS];
+  proto_mode modes[w->nconns];
+  uint64_t now, next_send = start_ns, outstanding;
+  int n, rr = 0, timeout;
 
-  while (Fgets(buf, MAXLINE, stdin) != NULL) {
-          Rio_writen(clientfd, buf, strlen(buf));
-          Rio_readlineb(&rio, buf, MAXLINE);
-          Fputs(buf, stdout);
+  for (int i = 0; i < w->nconns; i++) {
+    modes[i] = PROTO_LEGACY;
   }
 
-  Close(clientfd); //line:netp:echoclient:close
-  exit(0);*/
+  // closed loop: prime every connection with one request
+  for (int i = 0; i < w->nconns && !w->interval_ns; i++) {
+    conn_send(w, &w->conns[i], next_op(w), now_ns());
+  }
+
+  while (1) {
+    now = now_ns();
+    outstanding = 0;
+    for (int i = 0; i < w->nconns; i++) {
+      outstanding += w->conns[i].q_len;
+    }
+    if (now >= end_ns && (!outstanding || now >= end_ns + DRAIN_NS)) {
+      break;
+    }
+
+    if (w->interval_ns && now < end_ns) {
+      for (int burst = 0; next_send <= now && burst < MAX_BURST; burst++) {
+        conn_send(w, &w->conns[rr++ % w->nconns], next_op(w), next_send);
+        next_send += w->interval_ns;
+      }
+    }
+
+    if (w->interval_ns && now < end_ns) {
+      /* round up: a sub-millisecond wait must not become a zero timeout */
+      timeout = next_send > now ? (next_send - now + 999999) / 1000000 : 0;
+    } else {
+      timeout = 10;
+    }
+    if ((n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      unix_error("epoll_wait error");
+    }
+
+    for (int i = 0; i < n; i++) {
+      int idx = events[i].data.u32;
+      struct conn *c = &w->conns[idx];
+      if (events[i].events & EPOLLOUT) {
+        conn_flush(c);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        int replies = conn_receive(w, c, &modes[idx]);
+        // closed loop: replace every completed request
+        for (int r = 0; r < replies && !w->interval_ns && now < end_ns; r++) {
+          conn_send(w, c, next_op(w), now_ns());
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+static void connect_worker(struct worker *w) {
+  struct epoll_event ev;
+  int flags;
+
+  if ((w->epfd = epoll_create1(0)) < 0) {
+    unix_error("epoll_create1 error");
+  }
+  w->conns = Calloc(w->nconns, sizeof(struct conn));
+  for (int i = 0; i < w->nconns; i++) {
+    struct conn *c = &w->conns[i];
+    c->fd = Open_clientfd(cfg.host, cfg.port);
+    if ((flags = fcntl(c->fd, F_GETFL, 0)) < 0 ||
+        fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      unix_error("fcntl error");
+    }
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u32 = i;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+      unix_error("epoll_ctl error");
+    }
+    if (cfg.mode == PROTO_FRAMED) {
+      conn_send(w, c, OP_PROTO, 0);
+    }
+  }
+}
+
+static void print_op_json(const char *name, const hist_t *h, uint64_t rejected,
+                          double elapsed, int last) {
+  printf("    \"%s\": {\"count\": %lu, \"rejected\": %lu, "
+         "\"throughput\": %.1f, \"mean_us\": %.1f, \"p50_us\": %.1f, "
+         "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}%s\n",
+         name, (unsigned long)h->count, (unsigned long)rejected,
+         h->count / elapsed, hist_mean(h) / 1e3,
+         hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.99) / 1e3,
+         hist_percentile(h, 0.999) / 1e3, (h->count ? h->max : 0) / 1e3,
+         last ? "" : ",");
+  fprintf(stderr,
+          "%-6s %10lu ops %10.0f ops/s  p50 %8.1fus  p99 %8.1fus  "
+          "p99.9 %8.1fus\n",
+          name, (unsigned long)h->count, h->count / elapsed,
+          hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.99) / 1e3,
+          hist_percentile(h, 0.999) / 1e3);
+}
+
+static void report(struct worker *workers, double elapsed) {
+  hist_t ops[OP_NUM], all;
+  uint64_t rejected[OP_NUM] = {0}, errors = 0;
+
+  hist_init(&all);
+  for (int op = 0; op < OP_NUM; op++) {
+    hist_init(&ops[op]);
+    for (int t = 0; t < cfg.nthreads; t++) {
+      hist_merge(&ops[op], &workers[t].hist[op]);
+      rejected[op] += workers[t].rejected[op];
+    }
+    hist_merge(&all, &ops[op]);
+  }
+  for (int t = 0; t < cfg.nthreads; t++) {
+    errors += workers[t].errors;
+  }
+
+  printf("{\n");
+  printf("  \"config\": {\"connections\": %d, \"threads\": %d, "
+         "\"duration_s\": %d, \"items\": %d, \"mix\": [%d, %d, %d], "
+         "\"keys\": \"%s\", \"theta\": %.3f, \"target_rate\": %.1f, "
+         "\"protocol\": \"%s\"},\n",
+         cfg.nconns, cfg.nthreads, cfg.duration, cfg.nitems, cfg.mix[OP_SHOW],
+         cfg.mix[OP_BUY], cfg.mix[OP_SELL], cfg.zipf ? "zipf" : "uniform",
+         cfg.theta, cfg.rate, cfg.mode == PROTO_FRAMED ? "framed" : "legacy");
+  printf("  \"elapsed_s\": %.3f,\n", elapsed);
+  printf("  \"errors\": %lu,\n", (unsigned long)errors);
+  printf("  \"ops\": {\n");
+  for (int op = 0; op < OP_NUM; op++) {
+    print_op_json(op_names[op], &ops[op], rejected[op], elapsed, 0);
+  }
+  print_op_json("all", &all, rejected[OP_BUY] + rejected[OP_SELL], elapsed,
+                1);
+  printf("  }\n}\n");
+}
+
+static void usage(char *prog) {
+  fprintf(stderr,
+          "usage: %s [options] <host> <port>\n"
+          "  -c conns     connections (default %d)\n"
+          "  -t threads   worker threads (default: one per core)\n"
+          "  -d seconds   run duration (default %d)\n"
+          "  -m s:b:l     show:buy:sell weights (default 1:1:1)\n"
+          "  -k dist      key distribution, uniform or zipf (default "
+          "uniform)\n"
+          "  -z theta     zipf skew (default %.2f)\n"
+          "  -n items     stock IDs 1..n to trade (default %d)\n"
+          "  -r rate      open-loop target ops/s over all connections "
+          "(default: closed loop)\n"
+          "  -l           legacy fixed-size replies (for old servers)\n",
+          prog, DEFAULT_CONNS, DEFAULT_DURATION, DEFAULT_ZIPF_THETA,
+          DEFAULT_ITEMS);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  struct worker *workers;
+  int opt, ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+  while ((opt = getopt(argc, argv, "c:t:d:m:k:z:n:r:l")) != -1) {
+    switch (opt) {
+    case 'c':
+      cfg.nconns = atoi(optarg);
+      break;
+    case 't':
+      cfg.nthreads = atoi(optarg);
+      break;
+    case 'd':
+      cfg.duration = atoi(optarg);
+      break;
+    case 'm':
+      if (sscanf(optarg, "%d:%d:%d", &cfg.mix[OP_SHOW], &cfg.mix[OP_BUY],
+                 &cfg.mix[OP_SELL]) != 3) {
+        usage(argv[0]);
+      }
+      break;
+    case 'k':
+      cfg.zipf = !strcmp(optarg, "zipf");
+      if (!cfg.zipf && strcmp(optarg, "uniform")) {
+        usage(argv[0]);
+      }
+      break;
+    case 'z':
+      cfg.theta = atof(optarg);
+      break;
+    case 'n':
+      cfg.nitems = atoi(optarg);
+      break;
+    case 'r':
+      cfg.rate = atof(optarg);
+      break;
+    case 'l':
+      cfg.mode = PROTO_LEGACY;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || cfg.nconns < 1 || cfg.duration < 1 ||
+      cfg.nitems < 1 || cfg.mix[OP_SHOW] + cfg.mix[OP_BUY] +
+                                cfg.mix[OP_SELL] <= 0 ||
+      cfg.theta <= 0 || cfg.theta >= 1 || cfg.rate < 0) {
+    usage(argv[0]);
+  }
+  cfg.host = argv[optind];
+  cfg.port = argv[optind + 1];
+  if (cfg.nthreads < 1) {
+    cfg.nthreads = ncpu > 0 ? ncpu : 1;
+  }
+  if (cfg.nthreads > cfg.nconns) {
+    cfg.nthreads = cfg.nconns;
+  }
+  if (cfg.zipf) {
+    zipf_init(cfg.nitems, cfg.theta);
+  }
+
+  Signal(SIGPIPE, SIG_IGN);
+  workers = Calloc(cfg.nthreads, sizeof(struct worker));
+  for (int t = 0; t < cfg.nthreads; t++) {
+    struct worker *w = &workers[t];
+    w->id = t;
+    w->nconns = cfg.nconns / cfg.nthreads + (t < cfg.nconns % cfg.nthreads);
+    w->rng = 0x9e3779b97f4a7c15ULL * (t + 1) ^ (uint64_t)getpid();
+    w->interval_ns = cfg.rate > 0 ? 1e9 * cfg.nthreads / cfg.rate : 0;
+    for (int op = 0; op < OP_NUM; op++) {
+      hist_init(&w->hist[op]);
+    }
+    connect_worker(w);
+  }
+
+  start_ns = now_ns();
+  end_ns = start_ns + cfg.duration * 1000000000ULL;
+  for (int t = 0; t < cfg.nthreads; t++) {
+    Pthread_create(&workers[t].tid, NULL, worker_thread, &workers[t]);
+  }
+  for (int t = 0; t < cfg.nthreads; t++) {
+    Pthread_join(workers[t].tid, NULL);
+  }
 
+  report(workers, (now_ns() - start_ns) / 1e9);
   return 0;
 }
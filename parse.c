@@ -0,0 +1,283 @@
+#include "parse.h"
+
+#include <limits.h>
+
+#include "proto.h"
+
+/* a word of the request line, not null-terminated */
+struct __token {
+  const char *s;
+  size_t len;
+};
+
+#define __is_space(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+#define __word_is(t, lit)                                                      \
+  ((t).len == sizeof(lit) - 1 && !memcmp((t).s, lit, sizeof(lit) - 1))
+
+static const char *op_names[REQ_OPS] = {
+    [REQ_INVALID] = "invalid",
+    [REQ_EXIT] = "exit",
+    [REQ_SHOW] = "show",
+    [REQ_SHOW_RANGE] = "show_range",
+    [REQ_SHOW_PAGE] = "show_page",
+    [REQ_STATS] = "stats",
+    [REQ_VALUE] = "value",
+    [REQ_LOWSTOCK] = "lowstock",
+    [REQ_PROTO] = "proto",
+    [REQ_BUY] = "buy",
+    [REQ_SELL] = "sell",
+    [REQ_ADMIN_POOL] = "admin_pool",
+    [REQ_ADMIN_STATS] = "admin_stats",
+    [REQ_ADMIN_STATS_ON] = "admin_stats_on",
+    [REQ_ADMIN_STATS_OFF] = "admin_stats_off",
+    [REQ_ADMIN_LOCKS] = "admin_locks",
+    [REQ_ORDER] = "order",
+    [REQ_LIMIT_BUY] = "limit_buy",
+    [REQ_LIMIT_SELL] = "limit_sell",
+    [REQ_MARKET_BUY] = "market_buy",
+    [REQ_MARKET_SELL] = "market_sell",
+    [REQ_CANCEL] = "cancel",
+    [REQ_BOOK] = "book",
+    [REQ_ADMIN_HOT] = "admin_hot",
+    [REQ_ADMIN_COLD] = "admin_cold",
+    [REQ_ADMIN_SCHED] = "admin_sched",
+};
+
+/**
+ * @brief Short name of request kind @p op, e.g. for reports.
+ */
+const char *parse_op_name(req_op op) {
+  return op >= 0 && op < REQ_OPS ? op_names[op] : "unknown";
+}
+
+/**
+ * @brief Parse decimal int @p s of @p len bytes, with an optional sign.
+ *
+ * @param[out] out Parsed value, untouched on failure.
+ * @return 0 on success, -1 if @p s is not a number or does not fit an int.
+ */
+int parse_int(const char *s, size_t len, int *out) {
+  const char *end = s + len;
+  int neg = 0;
+  long v = 0;
+
+  if (s < end && (*s == '-' || *s == '+')) {
+    neg = *s++ == '-';
+  }
+  if (s == end) {
+    return -1;
+  }
+  for (; s < end; s++) {
+    if (*s < '0' || *s > '9') {
+      return -1;
+    }
+    v = v * 10 + (*s - '0');
+    if (v > (long)INT_MAX + neg) {
+      return -1;
+    }
+  }
+  *out = neg ? (int)-v : (int)v;
+  return 0;
+}
+
+/**
+ * @brief Split @p line into at most MAX_REQUEST_WORDS words in one pass.
+ *
+ * @return Number of words, MAX_REQUEST_WORDS + 1 if there are more.
+ */
+static int __tokenize(const char *line, struct __token *tok) {
+  const char *p = line;
+  int n = 0;
+
+  while (1) {
+    while (__is_space(*p)) {
+      p++;
+    }
+    if (!*p) {
+      return n;
+    }
+    if (n == MAX_REQUEST_WORDS) {
+      return n + 1;
+    }
+    tok[n].s = p;
+    while (*p && !__is_space(*p)) {
+      p++;
+    }
+    tok[n].len = p - tok[n].s;
+    n++;
+  }
+}
+
+/**
+ * @brief Parse both numeric arguments following the command word.
+ */
+static int __parse_args(const struct __token *tok, cmd_request *req) {
+  return parse_int(tok[0].s, tok[0].len, &req->arg[0]) ||
+         parse_int(tok[1].s, tok[1].len, &req->arg[1]);
+}
+
+/**
+ * @brief Parse the @p n words of an order following the command word: up to
+ * ORDER_MAX_LEGS triples of buy or sell, an id and a quantity.
+ *
+ * @return 0 on success, -1 if any leg is malformed.
+ */
+static int __parse_legs(const struct __token *tok, int n, cmd_request *req) {
+  int qty;
+
+  if (!n || n % 3 || n / 3 > ORDER_MAX_LEGS) {
+    return -1;
+  }
+  for (req->nlegs = 0; req->nlegs < n / 3; req->nlegs++, tok += 3) {
+    if (parse_int(tok[1].s, tok[1].len, &req->legs[req->nlegs][0]) ||
+        parse_int(tok[2].s, tok[2].len, &qty) || qty < 0) {
+      return -1;
+    }
+    if (__word_is(tok[0], "buy")) {
+      req->legs[req->nlegs][1] = -qty;
+    } else if (__word_is(tok[0], "sell")) {
+      req->legs[req->nlegs][1] = qty;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Parse the @p n words of a market or limit order following the
+ * command word: buy or sell, an id, a quantity and, for a limit order, a
+ * price. Quantities and prices must be positive.
+ *
+ * @param ops Request kinds of a buy and of a sell.
+ * @return Operation of the request, REQ_INVALID if it is malformed.
+ */
+static req_op __parse_book_order(const struct __token *tok, int n,
+                                 const req_op ops[2], cmd_request *req) {
+  req_op op;
+
+  if (__word_is(tok[0], "buy")) {
+    op = ops[0];
+  } else if (__word_is(tok[0], "sell")) {
+    op = ops[1];
+  } else {
+    return REQ_INVALID;
+  }
+  if (__parse_args(&tok[1], req) || req->arg[1] <= 0) {
+    return REQ_INVALID;
+  }
+  if (n == 4 &&
+      (parse_int(tok[3].s, tok[3].len, &req->arg[2]) || req->arg[2] <= 0)) {
+    return REQ_INVALID;
+  }
+  return op;
+}
+
+/**
+ * @brief Parse request @p line without modifying or copying it.
+ * @note Commands are told apart by word count, then by word length and
+ * bytes. Numbers must be plain decimal ints, so "12abc" or a value
+ * overflowing an int is invalid rather than silently truncated.
+ *
+ * @param line Null-terminated request line, trailing newline included or not.
+ * @param[out] req Parsed request.
+ * @return Operation of the request, REQ_INVALID if it is malformed.
+ */
+req_op parse_request(const char *line, cmd_request *req) {
+  static const req_op market[2] = {REQ_MARKET_BUY, REQ_MARKET_SELL},
+                      limit[2] = {REQ_LIMIT_BUY, REQ_LIMIT_SELL};
+  struct __token tok[MAX_REQUEST_WORDS];
+  int n = __tokenize(line, tok);
+
+  req->op = REQ_INVALID;
+  switch (n) {
+  case 1:
+    if (__word_is(tok[0], "show")) {
+      req->op = REQ_SHOW;
+    } else if (__word_is(tok[0], "exit")) {
+      req->op = REQ_EXIT;
+    } else if (__word_is(tok[0], "stats")) {
+      req->op = REQ_STATS;
+    } else if (__word_is(tok[0], "value")) {
+      req->op = REQ_VALUE;
+    }
+    break;
+  case 2:
+    if (__word_is(tok[0], "lowstock")) {
+      if (!parse_int(tok[1].s, tok[1].len, &req->arg[0])) {
+        req->op = REQ_LOWSTOCK;
+      }
+    } else if (__word_is(tok[0], "admin")) {
+      if (__word_is(tok[1], "pool")) {
+        req->op = REQ_ADMIN_POOL;
+      } else if (__word_is(tok[1], "stats")) {
+        req->op = REQ_ADMIN_STATS;
+      } else if (__word_is(tok[1], "locks")) {
+        req->op = REQ_ADMIN_LOCKS;
+      } else if (__word_is(tok[1], "sched")) {
+        req->op = REQ_ADMIN_SCHED;
+      }
+    } else if (__word_is(tok[0], "cancel") || __word_is(tok[0], "book")) {
+      if (!parse_int(tok[1].s, tok[1].len, &req->arg[0])) {
+        req->op = tok[0].s[0] == 'c' ? REQ_CANCEL : REQ_BOOK;
+      }
+    } else if (__word_is(tok[0], "proto")) {
+      if (__word_is(tok[1], "framed")) {
+        req->op = REQ_PROTO;
+        req->arg[0] = PROTO_FRAMED;
+      } else if (__word_is(tok[1], "legacy")) {
+        req->op = REQ_PROTO;
+        req->arg[0] = PROTO_LEGACY;
+      }
+    }
+    break;
+  case 3:
+    // trades first: they are nearly all of the traffic
+    if (tok[0].len == 3 && tok[0].s[0] == 'b' && __word_is(tok[0], "buy")) {
+      req->op = REQ_BUY;
+    } else if (tok[0].len == 4 && tok[0].s[0] == 's') {
+      if (__word_is(tok[0], "sell")) {
+        req->op = REQ_SELL;
+      } else if (__word_is(tok[0], "show")) {
+        req->op = REQ_SHOW_RANGE;
+      }
+    }
+    if (req->op != REQ_INVALID) {
+      if (__parse_args(&tok[1], req)) {
+        req->op = REQ_INVALID;
+      }
+    } else if (__word_is(tok[0], "admin") && __word_is(tok[1], "stats")) {
+      if (__word_is(tok[2], "on")) {
+        req->op = REQ_ADMIN_STATS_ON;
+      } else if (__word_is(tok[2], "off")) {
+        req->op = REQ_ADMIN_STATS_OFF;
+      }
+    } else if (__word_is(tok[0], "admin") &&
+               (__word_is(tok[1], "hot") || __word_is(tok[1], "cold")) &&
+               !parse_int(tok[2].s, tok[2].len, &req->arg[0])) {
+      req->op = tok[1].s[0] == 'h' ? REQ_ADMIN_HOT : REQ_ADMIN_COLD;
+    }
+    break;
+  case 4:
+    if (__word_is(tok[0], "show") && __word_is(tok[1], "page") &&
+        !__parse_args(&tok[2], req) && req->arg[1] >= 0) {
+      req->op = REQ_SHOW_PAGE;
+      break;
+    } else if (__word_is(tok[0], "market")) {
+      req->op = __parse_book_order(&tok[1], n - 1, market, req);
+      break;
+    }
+    // fall through: an order of a single leg
+  default:
+    if (n == 5 && __word_is(tok[0], "limit")) {
+      req->op = __parse_book_order(&tok[1], n - 1, limit, req);
+      break;
+    }
+    if (n > 1 && __word_is(tok[0], "order") &&
+        !__parse_legs(&tok[1], n - 1, req)) {
+      req->op = REQ_ORDER;
+    }
+    break;
+  }
+  return req->op;
+}
@@ -0,0 +1,52 @@
+#ifndef __PARSE_H__
+#define __PARSE_H__
+
+#include <stddef.h>
+
+#include "misc.h"
+
+typedef enum {
+  REQ_INVALID = 0,
+  REQ_EXIT,       /* exit */
+  REQ_SHOW,       /* show */
+  REQ_SHOW_RANGE, /* show <from> <to> */
+  REQ_SHOW_PAGE,  /* show page <start> <limit> */
+  REQ_STATS,      /* stats */
+  REQ_VALUE,      /* value */
+  REQ_LOWSTOCK,   /* lowstock <n> */
+  REQ_PROTO,      /* proto framed|legacy, arg[0] is the proto_mode */
+  REQ_BUY,        /* buy <id> <n> */
+  REQ_SELL,       /* sell <id> <n> */
+  REQ_ADMIN_POOL, /* admin pool */
+  REQ_ADMIN_STATS,     /* admin stats */
+  REQ_ADMIN_STATS_ON,  /* admin stats on */
+  REQ_ADMIN_STATS_OFF, /* admin stats off */
+  REQ_ADMIN_LOCKS,     /* admin locks */
+  REQ_ORDER,      /* order buy|sell <id> <n> ..., see legs */
+  REQ_LIMIT_BUY,   /* limit buy <id> <qty> <price> */
+  REQ_LIMIT_SELL,  /* limit sell <id> <qty> <price> */
+  REQ_MARKET_BUY,  /* market buy <id> <qty> */
+  REQ_MARKET_SELL, /* market sell <id> <qty> */
+  REQ_CANCEL,      /* cancel <order_id> */
+  REQ_BOOK,        /* book <id> */
+  REQ_ADMIN_HOT,   /* admin hot <id> */
+  REQ_ADMIN_COLD,  /* admin cold <id> */
+  REQ_ADMIN_SCHED, /* admin sched */
+  REQ_OPS,
+} req_op;
+
+/* parsed request line */
+struct __request {
+  req_op op;
+  int arg[3];
+  int nlegs;
+  int legs[ORDER_MAX_LEGS][2]; /* id and change to its count, buys negative */
+};
+
+typedef struct __request cmd_request;
+
+req_op parse_request(const char *line, cmd_request *req);
+const char *parse_op_name(req_op op);
+int parse_int(const char *s, size_t len, int *out);
+
+#endif /* __PARSE_H__ */
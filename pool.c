@@ -0,0 +1,213 @@
+#include "pool.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+/* enqueue times are kept for fds below this, later ones are not timed */
+#define POOL_MAX_TIMED_FDS (1 << 20)
+
+static struct {
+  int min, max;
+  long idle_ms;
+  void (*handler)(int fd);
+  sbuf_t queue;
+  uint64_t *enqueued; /* enqueue time of each queued fd, by fd */
+  int nfds;
+  atomic_int threads;
+  atomic_int idle;
+  atomic_int peak;
+  atomic_ulong submitted;
+  atomic_ulong served;
+  atomic_ulong spawned;
+  atomic_ulong retired;
+  atomic_uint_least64_t wait_total_ns;
+  atomic_uint_least64_t wait_max_ns;
+} pool;
+
+/**
+ * @brief Account for the time @p fd spent in the queue.
+ */
+static void __record_wait(int fd) {
+  uint64_t wait, max;
+
+  if (fd >= pool.nfds) {
+    return;
+  }
+  wait = now_ns() - pool.enqueued[fd];
+  atomic_fetch_add_explicit(&pool.wait_total_ns, wait, memory_order_relaxed);
+  max = atomic_load_explicit(&pool.wait_max_ns, memory_order_relaxed);
+  while (wait > max && !atomic_compare_exchange_weak_explicit(
+                           &pool.wait_max_ns, &max, wait,
+                           memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+/**
+ * @brief Give up a worker slot if more than the minimum are running.
+ *
+ * @return 1 if the caller should exit.
+ */
+static int __retire(void) {
+  int n = atomic_load(&pool.threads);
+
+  while (n > pool.min) {
+    if (atomic_compare_exchange_weak(&pool.threads, &n, n - 1)) {
+      atomic_fetch_add_explicit(&pool.retired, 1, memory_order_relaxed);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int __spawn(int max);
+
+/**
+ * @brief Start a worker if more connections wait than idle workers could
+ * take.
+ */
+static void __grow(void) {
+  unsigned long queued = atomic_load(&pool.submitted) -
+                         atomic_load_explicit(&pool.served,
+                                              memory_order_relaxed);
+
+  if ((long)queued > atomic_load(&pool.idle)) {
+    __spawn(pool.max);
+  }
+}
+
+static void *__worker(void *vargp) {
+  int fd;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    atomic_fetch_add(&pool.idle, 1);
+    if (!sbuf_remove_timed(&pool.queue, &fd, pool.idle_ms)) {
+      atomic_fetch_sub(&pool.idle, 1);
+      if (__retire()) {
+        debug_print("worker retired after %ldms idle", pool.idle_ms);
+        __grow(); // a connection may have arrived while it timed out
+        return NULL;
+      }
+      continue;
+    }
+    atomic_fetch_sub(&pool.idle, 1);
+    atomic_fetch_add_explicit(&pool.served, 1, memory_order_relaxed);
+    __record_wait(fd);
+    pool.handler(fd);
+  }
+}
+
+/**
+ * @brief Start one more worker unless @p max are running.
+ *
+ * @return 1 if a worker was started.
+ */
+static int __spawn(int max) {
+  int n = atomic_load(&pool.threads), peak;
+  pthread_t tid;
+
+  do {
+    if (n >= max) {
+      return 0;
+    }
+  } while (!atomic_compare_exchange_weak(&pool.threads, &n, n + 1));
+
+  peak = atomic_load(&pool.peak);
+  while (n + 1 > peak &&
+         !atomic_compare_exchange_weak(&pool.peak, &peak, n + 1)) {
+  }
+  atomic_fetch_add_explicit(&pool.spawned, 1, memory_order_relaxed);
+  Pthread_create(&tid, NULL, __worker, NULL);
+  return 1;
+}
+
+/**
+ * @brief Start the worker pool.
+ * @note Workers beyond @p min are started when a connection is queued and
+ * no idle worker is left to take it, and exit after @p idle_ms without work.
+ *
+ * @param min Workers kept running even when idle
+ * @param max Upper bound on workers, i.e. on clients served at once
+ * @param idle_ms Idle time after which a worker above @p min exits
+ * @param handler Serves a connection, closing it before it returns
+ */
+void pool_start(int min, int max, long idle_ms, void (*handler)(int fd)) {
+  struct rlimit rl;
+
+  pool.min = min;
+  pool.max = max;
+  pool.idle_ms = idle_ms;
+  pool.handler = handler;
+  sbuf_init(&pool.queue, SBUF_SIZE);
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  pool.nfds = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > POOL_MAX_TIMED_FDS
+                  ? POOL_MAX_TIMED_FDS
+                  : (int)rl.rlim_cur;
+  pool.enqueued = (uint64_t *)Calloc(pool.nfds, sizeof(uint64_t));
+
+  for (int i = 0; i < min; i++) {
+    __spawn(min);
+  }
+  debug_print("pool started, %d to %d workers, idle=%ldms", min, max,
+              idle_ms);
+}
+
+/**
+ * @brief Queue connection @p fd for the next free worker, starting a worker
+ * when every running one is busy.
+ */
+void pool_submit(int fd) {
+  if (fd < pool.nfds) {
+    pool.enqueued[fd] = now_ns();
+  }
+  sbuf_insert(&pool.queue, fd);
+  atomic_fetch_add(&pool.submitted, 1);
+  __grow();
+}
+
+/**
+ * @brief Take a snapshot of the pool counters.
+ *
+ * @param reset_max Start a new interval for the longest queue wait.
+ */
+void pool_get_stats(pool_stats *stats, int reset_max) {
+  unsigned long submitted = atomic_load(&pool.submitted);
+
+  stats->min = pool.min;
+  stats->max = pool.max;
+  stats->threads = atomic_load(&pool.threads);
+  stats->idle = atomic_load(&pool.idle);
+  stats->peak = atomic_load(&pool.peak);
+  stats->served = atomic_load(&pool.served);
+  stats->queued = submitted > stats->served ? submitted - stats->served : 0;
+  stats->spawned = atomic_load(&pool.spawned);
+  stats->retired = atomic_load(&pool.retired);
+  stats->wait_total_ns = atomic_load(&pool.wait_total_ns);
+  stats->wait_max_ns = reset_max ? atomic_exchange(&pool.wait_max_ns, 0)
+                                 : atomic_load(&pool.wait_max_ns);
+}
+
+/**
+ * @brief Parse a pool size given as "min:max", or "n" for min=max=n.
+ *
+ * @return 0 on success, -1 if @p s is malformed or the bounds are not
+ * 1 <= min <= max.
+ */
+int pool_parse_size(const char *s, int *min, int *max) {
+  char *end;
+  long lo, hi;
+
+  lo = strtol(s, &end, 10);
+  hi = lo;
+  if (*end == ':') {
+    hi = strtol(end + 1, &end, 10);
+  }
+  if (end == s || *end || lo < 1 || hi < lo || hi > INT_MAX) {
+    return -1;
+  }
+  *min = lo;
+  *max = hi;
+  return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+#include "misc.h"
+#include "sbuf.h"
+
+/* workers kept even when idle */
+#define POOL_DEFAULT_MIN 4
+/* workers at most, so at most this many clients are served at once */
+#define POOL_DEFAULT_MAX 1024
+/* time in ms a worker above the minimum waits for work before it exits */
+#define POOL_DEFAULT_IDLE_MS 10000
+
+/* live counters of the worker pool */
+struct __pool_stats {
+  int min;
+  int max;
+  int threads;           /* running workers */
+  int idle;              /* workers waiting for a connection */
+  int peak;              /* most workers ever running at once */
+  size_t queued;         /* accepted connections no worker took yet */
+  unsigned long served;  /* connections handed to a worker */
+  unsigned long spawned; /* workers started, the minimum included */
+  unsigned long retired; /* workers that exited after idling */
+  uint64_t wait_total_ns; /* time served connections spent queued */
+  uint64_t wait_max_ns;   /* longest queue wait since the last report */
+};
+
+typedef struct __pool_stats pool_stats;
+
+void pool_start(int min, int max, long idle_ms, void (*handler)(int fd));
+void pool_submit(int fd);
+void pool_get_stats(pool_stats *stats, int reset_max);
+int pool_parse_size(const char *s, int *min, int *max);
+
+#endif /* __POOL_H__ */
@@ -0,0 +1,75 @@
+#include "proto.h"
+
+/**
+ * @brief Encode @p len as a frame header into @p hdr.
+ *
+ * @param len Payload length
+ * @param hdr Buffer of at least PROTO_HEADER_LEN bytes
+ */
+void proto_header(size_t len, char *hdr) {
+  uint32_t nlen = htonl((uint32_t)len);
+  memcpy(hdr, &nlen, PROTO_HEADER_LEN);
+}
+
+/**
+ * @brief Robustly write every byte described by @p iov.
+ * @warning Modifies @p iov in place while advancing over partial writes.
+ *
+ * @return Number of bytes written, -1 on error with errno set.
+ */
+ssize_t proto_writev(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t n, total = 0;
+
+  while (iovcnt > 0) {
+    if ((n = writev(fd, iov, iovcnt)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    total += n;
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return total;
+}
+
+/**
+ * @brief Read one server reply in the given protocol @p mode.
+ *
+ * @param rp Buffered reader of the connection
+ * @param mode Protocol the connection is in
+ * @param[in,out] buf Heap buffer for the payload, grown as needed. The
+ * payload is null-terminated.
+ * @param[in,out] cap Capacity of @p buf
+ * @return Payload length, -1 if the connection closed or failed.
+ */
+ssize_t proto_read_reply(rio_t *rp, proto_mode mode, char **buf,
+                         size_t *cap) {
+  uint32_t nlen;
+  size_t len = MAXLINE;
+
+  if (mode == PROTO_FRAMED) {
+    if (rio_readnb(rp, &nlen, PROTO_HEADER_LEN) != PROTO_HEADER_LEN) {
+      return -1;
+    }
+    len = ntohl(nlen);
+  }
+
+  if (*cap < len + 1) {
+    *cap = len + 1;
+    *buf = Realloc(*buf, *cap);
+  }
+  if (rio_readnb(rp, *buf, len) != (ssize_t)len) {
+    return -1;
+  }
+  (*buf)[len] = '\0';
+  return mode == PROTO_FRAMED ? (ssize_t)len : (ssize_t)strlen(*buf);
+}
@@ -0,0 +1,23 @@
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "csapp.h"
+
+/* length of the big-endian payload length that prefixes each framed reply */
+#define PROTO_HEADER_LEN 4
+/* request switching a connection to framed replies */
+#define PROTO_FRAMED_CMD "proto framed\n"
+
+typedef enum {
+  PROTO_LEGACY = 0, /* every reply padded to exactly MAXLINE bytes */
+  PROTO_FRAMED,     /* length header followed by the reply bytes only */
+} proto_mode;
+
+void proto_header(size_t len, char *hdr);
+ssize_t proto_writev(int fd, struct iovec *iov, int iovcnt);
+ssize_t proto_read_reply(rio_t *rp, proto_mode mode, char **buf, size_t *cap);
+
+#endif /* __PROTO_H__ */
@@ -0,0 +1,415 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**
+ * @brief Make sure @p buf can take @p need more bytes after @p len.
+ */
+static void __reserve(char **buf, size_t *cap, size_t len, size_t need) {
+  size_t new_cap = *cap ? *cap : 512;
+  while (new_cap - len < need) {
+    new_cap *= 2;
+  }
+  if (new_cap != *cap) {
+    *buf = (char *)Realloc(*buf, new_cap);
+    *cap = new_cap;
+  }
+}
+
+static void __set_nonblocking(int fd) {
+  int flags;
+  if ((flags = fcntl(fd, F_GETFL, 0)) < 0 ||
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    unix_error("fcntl error");
+  }
+}
+
+static void __close(reactor_t *r, reactor_conn *c) {
+  debug_print("reactor %d closing fd=%d", r->id, c->fd);
+  Close(c->fd); // also drops it from the epoll set
+  if (r->hooks && r->hooks->on_close) {
+    r->hooks->on_close(c->fd);
+  }
+  free(c->in);
+  free(c->out);
+  Free(c);
+}
+
+/**
+ * @brief Queue the wire bytes of @p response on @p c.
+ */
+static void __append(reactor_conn *c, const cmd_response *response) {
+  char hdr[PROTO_HEADER_LEN];
+  struct iovec iov[2];
+  int cnt = __response_iov(&c->session, response, hdr, iov);
+
+  for (int i = 0; i < cnt; i++) {
+    __reserve(&c->out, &c->out_cap, c->out_len, iov[i].iov_len);
+    memcpy(c->out + c->out_len, iov[i].iov_base, iov[i].iov_len);
+    c->out_len += iov[i].iov_len;
+  }
+}
+
+/**
+ * @brief Write pending output of @p c until done or the socket is full.
+ *
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int __flush(reactor_conn *c) {
+  uint64_t start;
+  ssize_t n;
+
+  while (c->out_off < c->out_len) {
+    start = latency_now(); // counted against the last request executed
+    n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+    latency_since(LATENCY_WRITE, start);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    c->out_off += n;
+  }
+
+  c->out_off = c->out_len = 0;
+  if (c->out_cap > REACTOR_BUF_KEEP) {
+    free(c->out);
+    c->out = NULL;
+    c->out_cap = 0;
+  }
+  return 0;
+}
+
+/**
+ * @brief Hand the finished scan @p job back to the reactor of its
+ * connection. Called on a scan thread.
+ */
+static void __scan_done(cmd_job *job) {
+  reactor_t *r = ((reactor_conn *)job->arg)->reactor;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&r->done_mutex);
+  job->next = r->done;
+  r->done = job;
+  pthread_mutex_unlock(&r->done_mutex);
+  if (write(r->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    unix_error("eventfd write error");
+  }
+}
+
+/**
+ * @brief Execute every complete request line buffered on @p c, in order.
+ * @note Stops early once REACTOR_OUT_HIGH_WATER reply bytes are pending, so
+ * a client that does not read cannot grow the output without bound. Also
+ * stops at a request handed to the scan pool, until its reply is in. The
+ * replies wait in the output buffer until the trades they acknowledge are
+ * durable, see wait_lsn.
+ *
+ * @return Number of executed lines, -1 on a protocol error.
+ */
+static int __execute(reactor_conn *c) {
+  cmd_response response;
+  cmd_status status;
+  char *line, *nl;
+  int executed = 0;
+
+  if (!c->in_len) {
+    return 0;
+  }
+  while (!c->closing && !c->pending &&
+         c->out_len - c->out_off <= REACTOR_OUT_HIGH_WATER) {
+    line = c->in + c->in_off;
+    if (!(nl = memchr(line, '\n', c->in_len - c->in_off))) {
+      break;
+    }
+    *nl = '\0';
+    c->in_off += nl - line + 1;
+
+    response_init(&response);
+    if ((c->pending = handle_line_async(&c->session, line, &response, &status,
+                                        __scan_done, c))) {
+      break; // its reply comes before those of the lines after it
+    }
+    if (status == COMMAND_EXIT) {
+      c->closing = 1;
+    }
+    __append(c, &response);
+    response_release(&response);
+    executed++;
+  }
+  if (executed) {
+    c->wait_lsn = wal_pending(); // acknowledge trades only once durable
+  }
+
+  // compact the partial line left behind
+  if (c->in_off) {
+    memmove(c->in, c->in + c->in_off, c->in_len - c->in_off);
+    c->in_len -= c->in_off;
+    c->in_off = 0;
+  }
+  if (c->in_len >= MAXLINE) {
+    debug_print("fd=%d sent a line over %d bytes", c->fd, MAXLINE);
+    return -1;
+  }
+  return executed;
+}
+
+/**
+ * @brief Read what is available on @p c.
+ *
+ * @return Bytes read, 0 on end of file, -1 if the socket is drained, -2 on
+ * error.
+ */
+static ssize_t __fill(reactor_conn *c) {
+  ssize_t n;
+
+  __reserve(&c->in, &c->in_cap, c->in_len, MAXLINE);
+  while ((n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len)) < 0) {
+    if (errno != EINTR) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? -1 : -2;
+    }
+  }
+  c->in_len += n;
+  return n;
+}
+
+/**
+ * @brief Make as much progress as possible on @p c without blocking.
+ * @note Connections are registered edge-triggered, so this keeps going until
+ * the socket would block in the direction it is waiting for.
+ */
+static void __service(reactor_t *r, reactor_conn *c) {
+  ssize_t n;
+
+  while (1) {
+    if (c->parked) {
+      return; // resumed by __complete()
+    }
+    if (c->wait_lsn) {
+      if (!wal_durable(c->wait_lsn)) {
+        c->parked = 1;
+        c->next_parked = r->parked;
+        r->parked = c;
+        return; // resumed by __complete() once the flusher signals
+      }
+      c->wait_lsn = 0;
+    }
+    if (__flush(c) < 0) {
+      break;
+    }
+    if (c->pending) {
+      return; // resumed by __complete()
+    }
+    if (c->out_len > REACTOR_OUT_HIGH_WATER) {
+      return; // wait for EPOLLOUT
+    }
+    if (c->closing || (c->eof && !c->in_len)) {
+      if (c->out_len) {
+        return;
+      }
+      break;
+    }
+
+    if ((n = __execute(c)) < 0) {
+      break;
+    } else if (n > 0 || c->closing || c->pending) {
+      continue; // flush what was produced before reading more
+    }
+
+    if (c->eof) {
+      c->in_len = 0; // trailing partial line is dropped
+      continue;
+    }
+    if ((n = __fill(c)) == -1) {
+      if (c->in_cap > REACTOR_BUF_KEEP && !c->in_len) {
+        free(c->in);
+        c->in = NULL;
+        c->in_cap = 0;
+      }
+      return; // wait for EPOLLIN
+    } else if (n == -2) {
+      break;
+    } else if (n == 0) {
+      c->eof = 1;
+    }
+  }
+  if (c->pending) {
+    c->broken = 1; // the scan pool still writes to it
+    return;
+  }
+  __close(r, c);
+}
+
+/**
+ * @brief Queue the replies of finished scans and carry on with their
+ * connections and those whose trades became durable.
+ */
+static void __complete(reactor_t *r) {
+  cmd_job *job, *next;
+  reactor_conn *c, *next_conn;
+  uint64_t n;
+
+  if (read(r->evfd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+    unix_error("eventfd read error");
+  }
+  pthread_mutex_lock(&r->done_mutex);
+  job = r->done;
+  r->done = NULL;
+  pthread_mutex_unlock(&r->done_mutex);
+
+  for (; job; job = next) {
+    next = job->next;
+    c = (reactor_conn *)job->arg;
+    c->pending = NULL;
+    if (c->broken) {
+      command_job_free(job);
+      __close(r, c);
+      continue;
+    }
+    __append(c, &job->reply);
+    command_job_free(job);
+    __service(r, c);
+  }
+
+  c = r->parked;
+  r->parked = NULL;
+  for (; c; c = next_conn) {
+    next_conn = c->next_parked;
+    c->parked = 0;
+    __service(r, c); // parks it again if its trades are still not durable
+  }
+}
+
+/**
+ * @brief Accept every pending connection on the listening socket.
+ */
+static void __accept(reactor_t *r) {
+  struct sockaddr_storage client_addr;
+  socklen_t client_len;
+  struct epoll_event ev;
+  reactor_conn *c;
+  int connfd;
+
+  while (1) {
+    client_len = sizeof(client_addr);
+    connfd = accept4(r->listenfd, (SA *)&client_addr, &client_len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connfd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, "accept4 error: %s\n", strerror(errno));
+      }
+      return;
+    }
+
+    c = (reactor_conn *)Calloc(1, sizeof(reactor_conn));
+    c->fd = connfd;
+    c->session.mode = PROTO_LEGACY;
+    c->reactor = r;
+    if (r->hooks && r->hooks->on_open) {
+      r->hooks->on_open(connfd);
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+      unix_error("epoll_ctl error");
+    }
+    debug_print("reactor %d accepted fd=%d", r->id, connfd);
+  }
+}
+
+static void *__reactor_thread(void *vargp) {
+  reactor_t *r = (reactor_t *)vargp;
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  int n, completed;
+
+  while (1) {
+    if ((n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, -1)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      unix_error("epoll_wait error");
+    }
+    completed = 0;
+    for (int i = 0; i < n; i++) {
+      if (!events[i].data.ptr) {
+        __accept(r);
+      } else if (events[i].data.ptr == r) {
+        completed = 1;
+      } else {
+        __service(r, (reactor_conn *)events[i].data.ptr);
+      }
+    }
+    // last, as it may close connections with events further in the batch
+    if (completed) {
+      __complete(r);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Serve @p listenfd with @p nreactors event loops. Never returns.
+ * @note Each reactor owns an epoll set and the connections it accepted, and
+ * is pinned to its own core. The listening socket is shared with
+ * EPOLLEXCLUSIVE so a new connection wakes a single reactor. Scans run on
+ * the scan pool, which wakes the reactor through its eventfd when done. The
+ * log flusher does the same when trades become durable, so replies never
+ * block a reactor in wal_commit().
+ *
+ * @param listenfd Listening socket
+ * @param nreactors Number of event loop threads
+ * @param hooks Connection callbacks, may be NULL
+ */
+void reactor_run(int listenfd, int nreactors, const reactor_hooks *hooks) {
+  reactor_t *reactors = (reactor_t *)Calloc(nreactors, sizeof(reactor_t));
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  struct epoll_event ev;
+  cpu_set_t cpus;
+
+  __set_nonblocking(listenfd);
+
+  for (int i = 0; i < nreactors; i++) {
+    reactor_t *r = &reactors[i];
+    r->id = i;
+    r->listenfd = listenfd;
+    r->hooks = hooks;
+    if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      unix_error("epoll_create1 error");
+    }
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+      unix_error("epoll_ctl error");
+    }
+    if ((r->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+      unix_error("eventfd error");
+    }
+    pthread_mutex_init(&r->done_mutex, NULL);
+    wal_watch(r->evfd);
+    ev.events = EPOLLIN;
+    ev.data.ptr = r;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->evfd, &ev) < 0) {
+      unix_error("epoll_ctl error");
+    }
+
+    Pthread_create(&r->tid, NULL, __reactor_thread, r);
+    if (ncpu > 0) {
+      CPU_ZERO(&cpus);
+      CPU_SET(i % ncpu, &cpus);
+      pthread_setaffinity_np(r->tid, sizeof(cpus), &cpus);
+    }
+  }
+  debug_print("started %d reactors", nreactors);
+
+  for (int i = 0; i < nreactors; i++) {
+    Pthread_join(reactors[i].tid, NULL);
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include "command.h"
+#include "csapp.h"
+#include "misc.h"
+
+/* stop executing requests while this many reply bytes are unsent */
+#define REACTOR_OUT_HIGH_WATER (1 << 20)
+#define REACTOR_MAX_EVENTS 256
+/* buffers above this size are released once drained */
+#define REACTOR_BUF_KEEP 4096
+
+/* called by reactor threads as connections come and go */
+struct __reactor_hooks {
+  void (*on_open)(int connfd);
+  void (*on_close)(int connfd);
+};
+
+struct __conn {
+  int fd;
+  int closing; /* close once pending output is flushed */
+  int eof;     /* peer closed its side */
+  int broken;  /* failed while a scan was pending, close once it is done */
+  cmd_session session;
+  cmd_job *pending; /* scan running for it, later lines wait their turn */
+  uint64_t wait_lsn; /* output waits until this log record is durable */
+  int parked;        /* on the reactor's parked list */
+  struct __conn *next_parked;
+  struct __reactor *reactor;
+  char *in; /* received bytes not yet executed */
+  size_t in_off, in_len, in_cap;
+  char *out; /* reply bytes not yet sent */
+  size_t out_off, out_len, out_cap;
+};
+
+struct __reactor {
+  int id;
+  int epfd;
+  int listenfd;
+  const struct __reactor_hooks *hooks;
+  pthread_t tid;
+  int evfd; /* eventfd, signalled when scans finish and trades are durable */
+  pthread_mutex_t done_mutex; /* guards done */
+  cmd_job *done;             /* finished scans not yet replied to */
+  struct __conn *parked;     /* connections waiting for wait_lsn */
+};
+
+typedef struct __reactor_hooks reactor_hooks;
+typedef struct __conn reactor_conn;
+typedef struct __reactor reactor_t;
+
+void reactor_run(int listenfd, int nreactors, const reactor_hooks *hooks);
+
+#endif /* __REACTOR_H__ */
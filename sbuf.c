@@ -1,13 +1,44 @@
 #include "sbuf.h"
 
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define __cpu_relax() __builtin_ia32_pause()
+#else
+#define __cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+static void __futex_wait(atomic_uint *word, unsigned expected,
+                         const struct timespec *timeout) {
+  // returns early on a changed word, a wake-up or a signal. callers recheck
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static void __futex_wake(atomic_uint *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 void sbuf_init(sbuf_t *sbuf, size_t len) {
-  debug_print("initialising shared buffer with len=%zu", len);
-  sbuf->buf = Calloc(len, sizeof(int));
-  sbuf->len = len;
-  sbuf->front = sbuf->rear = 0;
-  Sem_init(&sbuf->mutex, 0, 1);
-  Sem_init(&sbuf->slots, 0, len);
-  Sem_init(&sbuf->fds, 0, 0);
+  size_t cap = 2;
+
+  while (cap < len) {
+    cap <<= 1;
+  }
+  debug_print("initialising shared buffer with len=%zu", cap);
+  sbuf->buf = Calloc(cap, sizeof(struct __sbuf_cell));
+  sbuf->mask = cap - 1;
+  sbuf->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SBUF_SPIN : 0;
+  for (size_t i = 0; i < cap; i++) {
+    atomic_init(&sbuf->buf[i].seq, i);
+  }
+  atomic_init(&sbuf->rear, 0);
+  atomic_init(&sbuf->front, 0);
+  atomic_init(&sbuf->inserted, 0);
+  atomic_init(&sbuf->removers, 0);
+  atomic_init(&sbuf->removed, 0);
+  atomic_init(&sbuf->inserters, 0);
   debug_print("initialised shared buffer");
 }
 
@@ -16,21 +47,188 @@ void sbuf_free(sbuf_t *sbuf) {
   free(sbuf->buf);
 }
 
+/**
+ * @brief Claim a free cell and store @p fd in it, unless the queue is full.
+ */
+static int __try_insert(sbuf_t *sbuf, int fd) {
+  size_t pos = atomic_load_explicit(&sbuf->rear, memory_order_relaxed);
+  struct __sbuf_cell *cell;
+  intptr_t diff;
+
+  while (1) {
+    cell = &sbuf->buf[pos & sbuf->mask];
+    diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) -
+           (intptr_t)pos;
+    if (!diff) {
+      // free cell. claim it, or retry from wherever the winner left rear
+      if (atomic_compare_exchange_weak_explicit(&sbuf->rear, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0; // cell still holds the fd from one lap ago
+    } else {
+      pos = atomic_load_explicit(&sbuf->rear, memory_order_relaxed);
+    }
+  }
+  cell->fd = fd;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  return 1;
+}
+
+/**
+ * @brief Claim the oldest full cell and take its fd, unless the queue is
+ * empty.
+ */
+static int __try_remove(sbuf_t *sbuf, int *fd) {
+  size_t pos = atomic_load_explicit(&sbuf->front, memory_order_relaxed);
+  struct __sbuf_cell *cell;
+  intptr_t diff;
+
+  while (1) {
+    cell = &sbuf->buf[pos & sbuf->mask];
+    diff = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) -
+           (intptr_t)(pos + 1);
+    if (!diff) {
+      if (atomic_compare_exchange_weak_explicit(&sbuf->front, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0; // cell not written yet
+    } else {
+      pos = atomic_load_explicit(&sbuf->front, memory_order_relaxed);
+    }
+  }
+  *fd = cell->fd;
+  // hand the cell to the inserter one lap ahead
+  atomic_store_explicit(&cell->seq, pos + sbuf->mask + 1,
+                        memory_order_release);
+  return 1;
+}
+
+/**
+ * @brief Tell one caller parked on @p word, if any, that it changed.
+ */
+static void __signal(atomic_uint *word, atomic_uint *waiters) {
+  atomic_fetch_add(word, 1);
+  // pairs with the fence in __park: either the waiter sees the new word or
+  // we see the waiter
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(waiters, memory_order_relaxed)) {
+    __futex_wake(word);
+  }
+}
+
+/**
+ * @brief Insert @p *fd, or remove into @p fd, waiting until it succeeds.
+ * @note Spins up to SBUF_SPIN times first, then sleeps until the other side
+ * moves between tries.
+ *
+ * @param timeout_ms Longest time to wait, negative to wait forever.
+ * @return 1 on success, 0 on timeout.
+ */
+static int __park(sbuf_t *sbuf, int insert, int *fd, long timeout_ms) {
+  atomic_uint *word = insert ? &sbuf->removed : &sbuf->inserted;
+  atomic_uint *waiters = insert ? &sbuf->inserters : &sbuf->removers;
+  struct timespec now, deadline, left;
+  unsigned seen;
+
+#define __attempt()                                                            \
+  (insert ? __try_insert(sbuf, *fd) : __try_remove(sbuf, fd))
+  for (int i = 0; i < sbuf->spin; i++) {
+    if (__attempt()) {
+      return 1;
+    }
+    __cpu_relax();
+  }
+  if (timeout_ms >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+  while (1) {
+    seen = atomic_load(word);
+    atomic_fetch_add(waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (__attempt()) {
+      atomic_fetch_sub(waiters, 1);
+      return 1;
+    }
+    if (timeout_ms >= 0) {
+      // futex timeouts are relative
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left.tv_sec = deadline.tv_sec - now.tv_sec;
+      left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (left.tv_nsec < 0) {
+        left.tv_sec--;
+        left.tv_nsec += 1000000000;
+      }
+      if (left.tv_sec < 0) {
+        atomic_fetch_sub(waiters, 1);
+        return 0;
+      }
+    }
+    __futex_wait(word, seen, timeout_ms >= 0 ? &left : NULL);
+    atomic_fetch_sub(waiters, 1);
+  }
+#undef __attempt
+}
+
 void sbuf_insert(sbuf_t *sbuf, int fd) {
-  // mutex lock pending for slots
-  P(&sbuf->slots);
-  P(&sbuf->mutex);
-  sbuf->buf[++sbuf->rear % sbuf->len] = fd;
-  V(&sbuf->mutex);
-  V(&sbuf->fds);
+  __park(sbuf, 1, &fd, -1);
+  __signal(&sbuf->inserted, &sbuf->removers);
 }
+
 int sbuf_remove(sbuf_t *sbuf) {
   int fd;
-  // mutex lock pending for fd items
-  P(&sbuf->fds);
-  P(&sbuf->mutex);
-  fd = sbuf->buf[++sbuf->front % sbuf->len];
-  V(&sbuf->mutex);
-  V(&sbuf->slots);
+
+  __park(sbuf, 0, &fd, -1);
+  __signal(&sbuf->removed, &sbuf->inserters);
   return fd;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Take the oldest fd, waiting at most @p timeout_ms for one.
+ *
+ * @return 1 if an fd was stored in @p fd, 0 on timeout.
+ */
+int sbuf_remove_timed(sbuf_t *sbuf, int *fd, long timeout_ms) {
+  if (!__park(sbuf, 0, fd, timeout_ms)) {
+    return 0;
+  }
+  __signal(&sbuf->removed, &sbuf->inserters);
+  return 1;
+}
+
+/**
+ * @brief Append @p fd unless the queue is full. Never blocks.
+ *
+ * @return 1 if @p fd was queued, 0 if the queue is full.
+ */
+int sbuf_try_insert(sbuf_t *sbuf, int fd) {
+  if (!__try_insert(sbuf, fd)) {
+    return 0;
+  }
+  __signal(&sbuf->inserted, &sbuf->removers);
+  return 1;
+}
+
+/**
+ * @brief Take the oldest fd unless the queue is empty. Never blocks.
+ *
+ * @return 1 if an fd was stored in @p fd, 0 if the queue is empty.
+ */
+int sbuf_try_remove(sbuf_t *sbuf, int *fd) {
+  if (!__try_remove(sbuf, fd)) {
+    return 0;
+  }
+  __signal(&sbuf->removed, &sbuf->inserters);
+  return 1;
+}
@@ -1,19 +1,39 @@
 #ifndef __SBUF_H__
 #define __SBUF_H__
 
+#include <stdatomic.h>
+#include <stdint.h>
+
 #include "csapp.h"
 #include "misc.h"
 
-#define SBUF_SIZE 20
+/* slots in the connection queue, rounded up to a power of two */
+#define SBUF_SIZE 256
+/* failed attempts a blocked caller retries before parking in the kernel.
+   on a single CPU nobody can make progress while we spin, so we never do */
+#define SBUF_SPIN 128
+
+/* ring cell. seq tells whose turn it is: == pos free, == pos + 1 full */
+struct __sbuf_cell {
+  atomic_size_t seq;
+  int fd;
+};
 
+/*
+ * bounded lock-free multi-producer, multi-consumer fd queue. callers that
+ * find it full or empty spin briefly, then sleep on a futex until the other
+ * side moves
+ */
 struct __sbuf_t {
-  int *buf;
-  size_t len;
-  int front;
-  int rear;
-  sem_t mutex;
-  sem_t slots;
-  sem_t fds;
+  struct __sbuf_cell *buf;
+  size_t mask;
+  int spin;
+  _Alignas(64) atomic_size_t rear;  /* next position to insert at */
+  _Alignas(64) atomic_size_t front; /* next position to remove from */
+  _Alignas(64) atomic_uint inserted; /* futex: bumped after every insert */
+  atomic_uint removers;              /* removers parked on inserted */
+  _Alignas(64) atomic_uint removed;  /* futex: bumped after every remove */
+  atomic_uint inserters;             /* inserters parked on removed */
 };
 
 typedef struct __sbuf_t sbuf_t;
@@ -23,5 +43,8 @@ void sbuf_free(sbuf_t *sbuf);
 
 void sbuf_insert(sbuf_t *sbuf, int fd);
 int sbuf_remove(sbuf_t *sbuf);
+int sbuf_remove_timed(sbuf_t *sbuf, int *fd, long timeout_ms);
+int sbuf_try_insert(sbuf_t *sbuf, int fd);
+int sbuf_try_remove(sbuf_t *sbuf, int *fd);
 
-#endif /* __SBUF_H__ */
\ No newline at end of file
+#endif /* __SBUF_H__ */
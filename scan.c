@@ -0,0 +1,120 @@
+#include "scan.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+static struct {
+  pthread_mutex_t mutex; /* guards everything below */
+  pthread_cond_t ready;  /* a job was queued */
+  scan_job *head, *tail; /* FIFO of jobs waiting for a thread */
+  int threads;
+  int busy;
+  size_t queued;
+  size_t peak;
+  unsigned long served;
+  hist_t wait;
+  hist_t run;
+} scan = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+};
+
+static void *__worker(void *vargp) {
+  scan_job *job;
+  uint64_t start;
+
+  Pthread_detach(pthread_self());
+  // per-thread on Linux. failing to lower it only costs the priority edge
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), SCAN_NICE);
+  pthread_mutex_lock(&scan.mutex);
+  while (1) {
+    while (!scan.head) {
+      pthread_cond_wait(&scan.ready, &scan.mutex);
+    }
+    job = scan.head;
+    if (!(scan.head = job->next)) {
+      scan.tail = NULL;
+    }
+    scan.queued--;
+    scan.busy++;
+    scan.served++;
+    start = now_ns();
+    hist_record(&scan.wait, start - job->queued_ns);
+    pthread_mutex_unlock(&scan.mutex);
+
+    job->run(job); // the job may be gone from here on
+
+    pthread_mutex_lock(&scan.mutex);
+    hist_record(&scan.run, now_ns() - start);
+    scan.busy--;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Start @p threads scan threads. With none, scan_submit() runs jobs
+ * on the caller.
+ * @note Scan threads run at SCAN_NICE below the rest of the server, so
+ * when cores are short the kernel serves trades first.
+ */
+void scan_start(int threads) {
+  pthread_t tid;
+
+  hist_init(&scan.wait);
+  hist_init(&scan.run);
+  scan.threads = threads > 0 ? threads : 0;
+  for (int i = 0; i < scan.threads; i++) {
+    Pthread_create(&tid, NULL, __worker, NULL);
+  }
+  debug_print("scan pool started, %d threads", scan.threads);
+}
+
+/**
+ * @brief Whether scan_submit() hands jobs to scan threads.
+ */
+int scan_running(void) { return scan.threads > 0; }
+
+/**
+ * @brief Queue @p job behind the ones already waiting, or run it right away
+ * on the caller when no scan threads were started.
+ */
+void scan_submit(scan_job *job) {
+  if (!scan.threads) {
+    job->run(job);
+    return;
+  }
+  job->next = NULL;
+  pthread_mutex_lock(&scan.mutex);
+  job->queued_ns = now_ns();
+  if (scan.tail) {
+    scan.tail->next = job;
+  } else {
+    scan.head = job;
+  }
+  scan.tail = job;
+  if (++scan.queued > scan.peak) {
+    scan.peak = scan.queued;
+  }
+  pthread_cond_signal(&scan.ready);
+  pthread_mutex_unlock(&scan.mutex);
+}
+
+/**
+ * @brief Take a snapshot of the scan pool counters.
+ *
+ * @param reset_peak Start a new interval for the deepest queue seen.
+ */
+void scan_get_stats(scan_stats *stats, int reset_peak) {
+  pthread_mutex_lock(&scan.mutex);
+  stats->threads = scan.threads;
+  stats->busy = scan.busy;
+  stats->queued = scan.queued;
+  stats->peak = scan.peak;
+  stats->served = scan.served;
+  stats->wait = scan.wait;
+  stats->run = scan.run;
+  if (reset_peak) {
+    scan.peak = scan.queued;
+  }
+  pthread_mutex_unlock(&scan.mutex);
+}
@@ -0,0 +1,41 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+#include "hist.h"
+#include "misc.h"
+
+/* threads running expensive read-only requests, unless -s says otherwise */
+#define SCAN_DEFAULT_THREADS 2
+/* nice value added to scan threads, so trades win a contended CPU */
+#define SCAN_NICE 5
+
+/* work handed to the scan pool. embed it first in a larger struct */
+struct __scan_job {
+  void (*run)(struct __scan_job *job); /* may free or reuse the job */
+  uint64_t queued_ns;
+  struct __scan_job *next;
+};
+
+/* live counters of the scan pool */
+struct __scan_stats {
+  int threads;
+  int busy;             /* threads running a job */
+  size_t queued;        /* jobs waiting for a thread */
+  size_t peak;          /* most jobs waiting at once since the last report */
+  unsigned long served; /* jobs started */
+  hist_t wait;          /* time from submit to start, in ns */
+  hist_t run;           /* time spent running, in ns */
+};
+
+typedef struct __scan_job scan_job;
+typedef struct __scan_stats scan_stats;
+
+void scan_start(int threads);
+int scan_running(void);
+void scan_submit(scan_job *job);
+void scan_get_stats(scan_stats *stats, int reset_peak);
+
+#endif /* __SCAN_H__ */
@@ -0,0 +1,69 @@
+#include "slab.h"
+
+/**
+ * @brief Initialise an empty slab of @p size byte objects, reserving memory
+ * @p per_chunk objects at a time.
+ */
+void slab_init(slab_t *slab, size_t size, size_t per_chunk) {
+  *slab = (slab_t)SLAB_INITIALIZER(size, per_chunk);
+}
+
+/**
+ * @brief Release every chunk, and with them every object of @p slab.
+ */
+void slab_free(slab_t *slab) {
+  void *chunk, *prev;
+
+  for (chunk = slab->chunks; chunk; chunk = prev) {
+    prev = *(void **)chunk;
+    free(chunk);
+  }
+  slab->chunks = NULL;
+  slab->cur = slab->end = NULL;
+  slab->nchunks = 0;
+}
+
+/**
+ * @brief Allocate one zeroed object from @p slab.
+ * @note Objects are packed back to back in cache line aligned chunks and
+ * carry no per-object header. They are released all at once by
+ * slab_free().
+ *
+ * @return Pointer to the new object.
+ */
+void *slab_alloc(slab_t *slab) {
+  char *chunk, *obj;
+  void *mem;
+  int err;
+
+  pthread_mutex_lock(&slab->mutex);
+  if (slab->cur == slab->end) {
+    // first line of a chunk links chunks, objects start on the second
+    if ((err = posix_memalign(&mem, SLAB_ALIGN,
+                              SLAB_ALIGN + slab->per_chunk * slab->size))) {
+      errno = err;
+      unix_error("posix_memalign error");
+    }
+    chunk = (char *)mem;
+    *(void **)chunk = slab->chunks;
+    slab->chunks = chunk;
+    slab->nchunks++;
+    slab->cur = chunk + SLAB_ALIGN;
+    slab->end = slab->cur + slab->per_chunk * slab->size;
+    debug_print("slab of %zu byte objects grew to %zu chunks", slab->size,
+                slab->nchunks);
+  }
+  obj = slab->cur;
+  slab->cur += slab->size;
+  pthread_mutex_unlock(&slab->mutex);
+
+  memset(obj, 0, slab->size);
+  return obj;
+}
+
+/**
+ * @brief Bytes reserved by @p slab, including unused objects.
+ */
+size_t slab_reserved(const slab_t *slab) {
+  return slab->nchunks * (SLAB_ALIGN + slab->per_chunk * slab->size);
+}
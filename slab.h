@@ -0,0 +1,33 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+#include "misc.h"
+
+#define SLAB_ALIGN 64
+
+struct __slab {
+  size_t size;      /* bytes per object */
+  size_t per_chunk; /* objects per chunk */
+  char *cur;        /* next free object in the newest chunk */
+  char *end;
+  void *chunks; /* newest chunk, each links to the one before */
+  size_t nchunks;
+  pthread_mutex_t mutex;
+};
+
+typedef struct __slab slab_t;
+
+/* static initialiser, so that no slab_init() call is needed */
+#define SLAB_INITIALIZER(obj_size, objs)                                       \
+  {                                                                            \
+    .size = (obj_size), .per_chunk = (objs), .cur = NULL, .end = NULL,         \
+    .chunks = NULL, .nchunks = 0, .mutex = PTHREAD_MUTEX_INITIALIZER,          \
+  }
+
+void slab_init(slab_t *slab, size_t size, size_t per_chunk);
+void slab_free(slab_t *slab);
+void *slab_alloc(slab_t *slab);
+size_t slab_reserved(const slab_t *slab);
+
+#endif /* __SLAB_H__ */
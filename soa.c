@@ -0,0 +1,275 @@
+#include "soa.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOA_X86 1
+#endif
+
+struct __kernels {
+  int64_t (*units)(const int *counts, size_t n);
+  int64_t (*value)(const int *counts, const int *prices, size_t n);
+  size_t (*below)(const int *counts, size_t n, int threshold);
+};
+
+static int64_t __units_scalar(const int *counts, size_t n) {
+  int64_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += counts[i];
+  }
+  return sum;
+}
+
+static int64_t __value_scalar(const int *counts, const int *prices, size_t n) {
+  int64_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += (int64_t)counts[i] * prices[i];
+  }
+  return sum;
+}
+
+static size_t __below_scalar(const int *counts, size_t n, int threshold) {
+  size_t cnt = 0;
+  for (size_t i = 0; i < n; i++) {
+    cnt += counts[i] < threshold;
+  }
+  return cnt;
+}
+
+#ifdef SOA_X86
+__attribute__((target("sse4.1"))) static int64_t
+__units_sse41(const int *counts, size_t n) {
+  __m128i acc = _mm_setzero_si128();
+  int64_t lanes[2];
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(counts + i));
+    acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(v));
+    acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+  }
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return lanes[0] + lanes[1] + __units_scalar(counts + i, n - i);
+}
+
+__attribute__((target("sse4.1"))) static int64_t
+__value_sse41(const int *counts, const int *prices, size_t n) {
+  __m128i acc = _mm_setzero_si128();
+  int64_t lanes[2];
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i c = _mm_loadu_si128((const __m128i *)(counts + i));
+    __m128i p = _mm_loadu_si128((const __m128i *)(prices + i));
+    // signed 32x32->64 products of the even lanes, then of the odd ones
+    acc = _mm_add_epi64(acc, _mm_mul_epi32(c, p));
+    acc = _mm_add_epi64(
+        acc, _mm_mul_epi32(_mm_srli_epi64(c, 32), _mm_srli_epi64(p, 32)));
+  }
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return lanes[0] + lanes[1] + __value_scalar(counts + i, prices + i, n - i);
+}
+
+__attribute__((target("sse4.1"))) static size_t
+__below_sse41(const int *counts, size_t n, int threshold) {
+  __m128i t = _mm_set1_epi32(threshold), acc = _mm_setzero_si128();
+  int lanes[4];
+  size_t i = 0;
+
+  // every lane counts at most n / 4 matches, far below INT_MAX
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(counts + i));
+    acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(t, v));
+  }
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         __below_scalar(counts + i, n - i, threshold);
+}
+
+__attribute__((target("avx2"))) static int64_t __units_avx2(const int *counts,
+                                                            size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  int64_t lanes[4];
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(counts + i));
+    acc = _mm256_add_epi64(acc,
+                           _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+    acc = _mm256_add_epi64(
+        acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         __units_scalar(counts + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int64_t
+__value_avx2(const int *counts, const int *prices, size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  int64_t lanes[4];
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)(counts + i));
+    __m256i p = _mm256_loadu_si256((const __m256i *)(prices + i));
+    acc = _mm256_add_epi64(acc, _mm256_mul_epi32(c, p));
+    acc = _mm256_add_epi64(acc, _mm256_mul_epi32(_mm256_srli_epi64(c, 32),
+                                                 _mm256_srli_epi64(p, 32)));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         __value_scalar(counts + i, prices + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+__below_avx2(const int *counts, size_t n, int threshold) {
+  __m256i t = _mm256_set1_epi32(threshold), acc = _mm256_setzero_si256();
+  int lanes[8];
+  size_t i = 0, cnt = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(counts + i));
+    acc = _mm256_sub_epi32(acc, _mm256_cmpgt_epi32(t, v));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  for (int j = 0; j < 8; j++) {
+    cnt += lanes[j];
+  }
+  return cnt + __below_scalar(counts + i, n - i, threshold);
+}
+#endif
+
+static const struct __kernels kernels[] = {
+    [SOA_SCALAR] = {__units_scalar, __value_scalar, __below_scalar},
+#ifdef SOA_X86
+    [SOA_SSE41] = {__units_sse41, __value_sse41, __below_sse41},
+    [SOA_AVX2] = {__units_avx2, __value_avx2, __below_avx2},
+#endif
+};
+
+static const struct __kernels *active;
+
+/**
+ * @brief Whether the CPU can run @p kernel.
+ */
+static int __supported(soa_kernel kernel) {
+#ifdef SOA_X86
+  __builtin_cpu_init();
+  if (kernel == SOA_AVX2) {
+    return __builtin_cpu_supports("avx2");
+  } else if (kernel == SOA_SSE41) {
+    return __builtin_cpu_supports("sse4.1");
+  }
+#endif
+  return kernel == SOA_SCALAR;
+}
+
+/**
+ * @brief Scan with @p kernel from now on, or with the widest supported one
+ * below it.
+ *
+ * @return Kernel actually used.
+ */
+soa_kernel soa_use_kernel(soa_kernel kernel) {
+  if (kernel == SOA_AUTO) {
+    kernel = SOA_AVX2;
+  }
+  while (kernel != SOA_SCALAR && !__supported(kernel)) {
+    kernel--;
+  }
+  __atomic_store_n(&active, &kernels[kernel], __ATOMIC_RELEASE);
+  debug_print("scanning with %s kernels", soa_kernel_name(kernel));
+  return kernel;
+}
+
+const char *soa_kernel_name(soa_kernel kernel) {
+  static const char *names[] = {"scalar", "sse4.1", "avx2", "auto"};
+  return names[kernel];
+}
+
+static const struct __kernels *__kernels(void) {
+  const struct __kernels *k = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+  if (!k) {
+    soa_use_kernel(SOA_AUTO);
+    k = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+  }
+  return k;
+}
+
+static int *__reserve_column(size_t cap) {
+  return (int *)Mmap(NULL, cap * sizeof(int), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+
+/**
+ * @brief Reserve columns for @p cap slots.
+ * @note Only address space is reserved up front. Pages are backed as slots
+ * are used, and columns never move, so scans and adds need no lock.
+ */
+void soa_init(soa_t *soa, size_t cap) {
+  soa->ids = __reserve_column(cap);
+  soa->counts = __reserve_column(cap);
+  soa->prices = __reserve_column(cap);
+  soa->len = 0;
+  soa->cap = cap;
+}
+
+/**
+ * @brief Append one entry.
+ *
+ * @return Slot of the new entry.
+ */
+size_t soa_append(soa_t *soa, int id, int count, int price) {
+  const int rec[1][3] = {{id, count, price}};
+  return soa_append_records(soa, rec, 1);
+}
+
+/**
+ * @brief Append @p n entries given as id, count, price triples.
+ *
+ * @return Slot of the first new entry.
+ */
+size_t soa_append_records(soa_t *soa, const int (*rec)[3], size_t n) {
+  size_t slot;
+
+  pthread_mutex_lock(&soa->mutex);
+  slot = soa->len;
+  if (n > soa->cap - slot) {
+    app_error("soa_append error: columns are full");
+  }
+  for (size_t i = 0; i < n; i++) {
+    soa->ids[slot + i] = rec[i][0];
+    soa->counts[slot + i] = rec[i][1];
+    soa->prices[slot + i] = rec[i][2];
+  }
+  // scans see the entries complete or not at all
+  __atomic_store_n(&soa->len, slot + n, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&soa->mutex);
+  return slot;
+}
+
+/**
+ * @brief Sum of every count.
+ * @note Scans run concurrently with trades, so the result reflects each
+ * count at some point during the scan rather than a single instant.
+ */
+int64_t soa_units(const soa_t *soa) {
+  size_t len = __atomic_load_n(&soa->len, __ATOMIC_ACQUIRE);
+  return __kernels()->units(soa->counts, len);
+}
+
+/**
+ * @brief Sum of count * price over every entry.
+ */
+int64_t soa_value(const soa_t *soa) {
+  size_t len = __atomic_load_n(&soa->len, __ATOMIC_ACQUIRE);
+  return __kernels()->value(soa->counts, soa->prices, len);
+}
+
+/**
+ * @brief Number of entries with a count below @p n.
+ */
+size_t soa_count_below(const soa_t *soa, int n) {
+  size_t len = __atomic_load_n(&soa->len, __ATOMIC_ACQUIRE);
+  return __kernels()->below(soa->counts, len, n);
+}
@@ -0,0 +1,53 @@
+#ifndef __SOA_H__
+#define __SOA_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+#include "misc.h"
+
+enum __soa_kernel {
+  SOA_SCALAR = 0,
+  SOA_SSE41,
+  SOA_AVX2,
+  SOA_AUTO, /* widest the CPU supports */
+};
+
+/* columns of ids, counts and prices, one entry per slot */
+struct __soa {
+  int *ids;
+  int *counts;
+  int *prices;
+  size_t len; /* published slots */
+  size_t cap; /* reserved slots. columns never move */
+  pthread_mutex_t mutex; /* serialises appends */
+};
+
+typedef enum __soa_kernel soa_kernel;
+typedef struct __soa soa_t;
+
+#define SOA_INITIALIZER                                                        \
+  {                                                                            \
+    .ids = NULL, .counts = NULL, .prices = NULL, .len = 0, .cap = 0,           \
+    .mutex = PTHREAD_MUTEX_INITIALIZER,                                        \
+  }
+
+void soa_init(soa_t *soa, size_t cap);
+size_t soa_append(soa_t *soa, int id, int count, int price);
+size_t soa_append_records(soa_t *soa, const int (*rec)[3], size_t n);
+
+/**
+ * @brief Add @p n to the count in @p slot. Safe against concurrent adds.
+ */
+static inline void soa_add(soa_t *soa, size_t slot, int n) {
+  __atomic_add_fetch(&soa->counts[slot], n, __ATOMIC_RELAXED);
+}
+
+int64_t soa_units(const soa_t *soa);
+int64_t soa_value(const soa_t *soa);
+size_t soa_count_below(const soa_t *soa, int n);
+
+soa_kernel soa_use_kernel(soa_kernel kernel);
+const char *soa_kernel_name(soa_kernel kernel);
+
+#endif /* __SOA_H__ */
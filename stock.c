@@ -1,11 +1,429 @@
+#define _GNU_SOURCE
 #include "stock.h"
+#include "checkpoint.h"
+#include "latency.h"
 
 /* global variable for stock data */
 struct __db stock_db = {
-    .tree = NULL,
+    .tree = BTREE_INITIALIZER,
+    .index = HASH_INITIALIZER,
     .size = 0,
+    .format = STOCK_FORMAT_TEXT,
+    .soa = SOA_INITIALIZER,
 };
 
+/* items of a mapped binary database, in slots [0, nloaded) of the columns */
+static stock_item *loaded;
+static size_t nloaded;
+/* items created after loading, packed 12 bytes apart in the following slots.
+ * address space is reserved up front so they never move */
+static stock_item *arena;
+
+/* binary records are the items themselves */
+_Static_assert(sizeof(stock_item) == 3 * sizeof(int32_t),
+               "stock_item must not be padded");
+
+/* most recently rendered `show` payload */
+static stock_snapshot *snapshot;
+static sem_t snapshot_mutex; /* guards snapshot and every refcnt */
+static sem_t render_mutex;   /* only one thread renders at a time */
+
+/* a thread's share of the database gate and of the modification count.
+ * modifications are inside the gate from apply to log, stock_write() closes
+ * it to take a snapshot that matches a position in the log */
+struct __gate_slot {
+  unsigned long inside;  /* modifications of the thread in progress */
+  unsigned long version; /* modifications the thread made */
+} __attribute__((aligned(64)));
+
+static struct __gate_slot gate_slots[STOCK_GATE_SLOTS];
+static __thread struct __gate_slot *gate_slot;
+static int gate_closed;
+/* held by stock_write() while the gate is closed, for latecomers to wait */
+static pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+
+/* insert() holds it exclusively to add to the tree, walks of the tree hold
+ * it shared. trades only use the hash index and never take it */
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* point-in-time views. a view is taken by starting a new epoch, after which
+ * the first trade on each item saves the count it replaces, tagged with the
+ * epoch, before changing it. up to STOCK_VIEWS views are live at once, each
+ * with counts saved of its own. epoch_mutex is only held while a view
+ * starts; lock order is epoch_mutex, gate, tree_lock, order_lock */
+static pthread_mutex_t epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t epoch_last;
+static uint32_t views[STOCK_VIEWS]; /* epoch each view was started at */
+static uint32_t views_live;         /* bit k set while view k is being taken */
+/* per view and slot: epoch << 32 | count the epoch began with */
+static uint64_t *saved[STOCK_VIEWS];
+/* hands out views, before any other lock is taken */
+static pthread_mutex_t view_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t view_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t views_taken; /* bit k set while view k is handed out */
+
+/* per slot: bit 0 is set while an order holds the item, and every trade on
+ * it in progress adds 2 */
+static uint32_t *holds;
+/* orders hold it shared while they apply, views start with it held
+ * exclusively, so that no order straddles the start of a view */
+static pthread_rwlock_t order_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* per-core slice of the count of a hot item, a cache line each */
+struct __hot_shard {
+  int count; /* stocks this core sells from and buys into */
+  uint32_t lock;
+} __attribute__((aligned(64)));
+
+/* an item in hot mode. its count is item->count, the shared reserve that
+ * slices refill from, plus every slice */
+struct __hot {
+  stock_item *item;
+  int on;
+  int nshards;
+  int slice_max; /* most a slice holds, so the sum always fits an int */
+  struct __hot_shard shards[STOCK_HOT_SHARDS];
+};
+
+/* items that were ever made hot. an item keeps its entry and is turned off
+ * and on in place. entries are added with epoch_mutex held, which every
+ * view also holds while it starts, so a view sees a fixed set */
+static struct __hot hot_table[STOCK_HOT_MAX];
+static int nhot;
+static struct __hot **hot_of; /* per slot: entry of the item, if any */
+
+static void __init_snapshot(void) {
+  Sem_init(&snapshot_mutex, 0, 1);
+  Sem_init(&render_mutex, 0, 1);
+}
+
+static void __init_store(void) {
+  soa_init(&stock_db.soa, STOCK_MAX_ITEMS);
+  arena = (stock_item *)Mmap(NULL, STOCK_MAX_ITEMS * sizeof(stock_item),
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                             0);
+  for (int k = 0; k < STOCK_VIEWS; k++) {
+    saved[k] = (uint64_t *)Mmap(NULL, STOCK_MAX_ITEMS * sizeof(uint64_t),
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                -1, 0);
+  }
+  holds = (uint32_t *)Mmap(NULL, STOCK_MAX_ITEMS * sizeof(uint32_t),
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  hot_of = (struct __hot **)Mmap(
+      NULL, STOCK_MAX_ITEMS * sizeof(struct __hot *), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+
+/**
+ * @brief Reserve the item arena and the columns on first use.
+ */
+static void __reserve_store(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  Pthread_once(&once, __init_store);
+}
+
+/**
+ * @brief Slot of @p item in the columns of stock_db.soa.
+ */
+static inline size_t __slot(const stock_item *item) {
+  if (item >= loaded && item < loaded + nloaded) {
+    return item - loaded;
+  }
+  return nloaded + (item - arena);
+}
+
+static inline void __shard_lock(struct __hot_shard *s) {
+  while (__atomic_exchange_n(&s->lock, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&s->lock, __ATOMIC_RELAXED)) {
+      sched_yield();
+    }
+  }
+}
+
+static inline void __shard_unlock(struct __hot_shard *s) {
+  __atomic_store_n(&s->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Lock every slice of @p hot, in order, so that no trade on it is in
+ * progress until __hot_unlock().
+ */
+static void __hot_lock(struct __hot *hot) {
+  for (int i = 0; i < hot->nshards; i++) {
+    __shard_lock(&hot->shards[i]);
+  }
+}
+
+static void __hot_unlock(struct __hot *hot) {
+  for (int i = hot->nshards - 1; i >= 0; i--) {
+    __shard_unlock(&hot->shards[i]);
+  }
+}
+
+/**
+ * @brief Exact count of hot item @p hot. Call with it locked.
+ */
+static int __hot_total(const struct __hot *hot) {
+  int64_t total = hot->item->count;
+
+  for (int i = 0; i < hot->nshards; i++) {
+    total += hot->shards[i].count;
+  }
+  return (int)total;
+}
+
+/**
+ * @brief Move every slice of @p hot back into the reserve, so that
+ * item->count is the exact count again. Call with it locked.
+ */
+static void __hot_drain(struct __hot *hot) {
+  stock_item *item = hot->item;
+  int total = __hot_total(hot);
+
+  soa_add(&stock_db.soa, __slot(item), total - item->count);
+  __atomic_store_n(&item->count, total, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < hot->nshards; i++) {
+    hot->shards[i].count = 0;
+  }
+}
+
+/**
+ * @brief Hot mode entry of @p item, NULL unless the item is in hot mode.
+ */
+static inline struct __hot *__hot_get(const stock_item *item) {
+  struct __hot *hot = __atomic_load_n(&hot_of[__slot(item)], __ATOMIC_ACQUIRE);
+
+  return hot && __atomic_load_n(&hot->on, __ATOMIC_ACQUIRE) ? hot : NULL;
+}
+
+/**
+ * @brief Hand out a view for __epoch_begin(), waiting while all
+ * STOCK_VIEWS are taken. Call before taking any other lock.
+ */
+static int __view_get(void) {
+  int view;
+
+  pthread_mutex_lock(&view_mutex);
+  while (views_taken == (1u << STOCK_VIEWS) - 1) {
+    pthread_cond_wait(&view_cond, &view_mutex);
+  }
+  view = __builtin_ctz(~views_taken);
+  views_taken |= 1u << view;
+  pthread_mutex_unlock(&view_mutex);
+  return view;
+}
+
+/**
+ * @brief Start @p view of the database as it is now. Call with the tree
+ * lock held shared, so that no item is added during the walk, and with
+ * epoch_mutex held.
+ * @note Hot items are left locked with their exact counts saved for the
+ * view. Call __epoch_thaw() once nothing else needs to happen at the same
+ * moment. epoch_mutex may be released after that, while the view is read.
+ */
+static void __epoch_begin(int view) {
+  struct __hot *hot;
+
+  for (int i = 0; i < nhot; i++) {
+    __hot_lock(&hot_table[i]);
+  }
+  if (!++epoch_last) {
+    epoch_last++; // 0 means no view
+  }
+  __atomic_store_n(&views[view], epoch_last, __ATOMIC_SEQ_CST);
+  __atomic_or_fetch(&views_live, 1u << view, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < nhot; i++) {
+    if ((hot = &hot_table[i])->on) {
+      // hot trades never save counts themselves
+      __atomic_store_n(&saved[view][__slot(hot->item)],
+                       (uint64_t)epoch_last << 32 |
+                           (uint32_t)__hot_total(hot),
+                       __ATOMIC_SEQ_CST);
+    }
+  }
+}
+
+/**
+ * @brief Let trades on hot items go on after __epoch_begin().
+ */
+static void __epoch_thaw(void) {
+  for (int i = nhot - 1; i >= 0; i--) {
+    __hot_unlock(&hot_table[i]);
+  }
+}
+
+/**
+ * @brief Stop saving counts for @p view and hand it back.
+ */
+static void __epoch_end(int view) {
+  __atomic_and_fetch(&views_live, ~(1u << view), __ATOMIC_RELEASE);
+  pthread_mutex_lock(&view_mutex);
+  views_taken &= ~(1u << view);
+  pthread_cond_signal(&view_cond);
+  pthread_mutex_unlock(&view_mutex);
+}
+
+/**
+ * @brief Save the count of @p item for every view being taken, unless a
+ * trade already did in its epoch. Called by every trade before it changes
+ * the count.
+ */
+static inline void __save_count(const stock_item *item) {
+  uint32_t live = __atomic_load_n(&views_live, __ATOMIC_SEQ_CST), e;
+  uint64_t *s, old;
+  int view;
+
+  for (; live; live &= live - 1) {
+    view = __builtin_ctz(live);
+    e = __atomic_load_n(&views[view], __ATOMIC_SEQ_CST);
+    s = &saved[view][__slot(item)];
+    old = __atomic_load_n(s, __ATOMIC_ACQUIRE);
+    // an older tag is left over from an earlier view. a newer one belongs
+    // to a view started since live was read, which this trade predates
+    if ((int32_t)((uint32_t)(old >> 32) - e) < 0) {
+      // losing the race means another trade saved first
+      __atomic_compare_exchange_n(
+          s, &old,
+          (uint64_t)e << 32 |
+              (uint32_t)__atomic_load_n(&item->count, __ATOMIC_SEQ_CST),
+          0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * @brief Count of @p item when @p view was started.
+ * @note A trade that was in flight when the view started may or may not be
+ * included. Either way the view matches a moment during that trade, since
+ * every trade that started later is excluded.
+ */
+static inline int __count_at(const stock_item *item, int view) {
+  int count = __atomic_load_n(&item->count, __ATOMIC_SEQ_CST);
+  uint64_t s = __atomic_load_n(&saved[view][__slot(item)], __ATOMIC_SEQ_CST);
+
+  // read after the count: a trade newer than the view saved before changing it
+  return (uint32_t)(s >> 32) == views[view] ? (int)(uint32_t)s : count;
+}
+
+/**
+ * @brief Announce a trade on @p item, waiting while an order holds it.
+ *
+ * @return Hold word to pass to __trade_exit().
+ */
+static inline uint32_t *__trade_enter(const stock_item *item) {
+  uint32_t *h = &holds[__slot(item)];
+
+  while (__atomic_add_fetch(h, 2, __ATOMIC_SEQ_CST) & 1) {
+    __atomic_sub_fetch(h, 2, __ATOMIC_RELAXED);
+    while (__atomic_load_n(h, __ATOMIC_ACQUIRE) & 1) {
+      sched_yield();
+    }
+  }
+  return h;
+}
+
+static inline void __trade_exit(uint32_t *h) {
+  __atomic_sub_fetch(h, 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Hold @p item for an order: wait for any other order holding it,
+ * then for the trades on it in progress. New trades wait for the release.
+ */
+static void __hold(const stock_item *item) {
+  uint32_t *h = &holds[__slot(item)];
+
+  while (__atomic_fetch_or(h, 1, __ATOMIC_SEQ_CST) & 1) {
+    sched_yield();
+  }
+  while (__atomic_load_n(h, __ATOMIC_ACQUIRE) != 1) {
+    sched_yield();
+  }
+}
+
+static void __release(const stock_item *item) {
+  __atomic_and_fetch(&holds[__slot(item)], ~1u, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Gate slot of the calling thread, handed out round-robin on first
+ * use.
+ */
+static inline struct __gate_slot *__gate_slot(void) {
+  static unsigned next;
+
+  if (!gate_slot) {
+    gate_slot = &gate_slots[__atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) %
+                            STOCK_GATE_SLOTS];
+  }
+  return gate_slot;
+}
+
+/**
+ * @brief Enter the gate unless stock_write() closed it.
+ * @note Only touches the cache line of the thread's own slot.
+ *
+ * @return 1 if entered, 0 if closed.
+ */
+static inline int __gate_try(void) {
+  struct __gate_slot *g = __gate_slot();
+
+  __atomic_add_fetch(&g->inside, 1, __ATOMIC_SEQ_CST);
+  // pairs with __gate_close(): it sees us inside, or we see it closed
+  if (!__atomic_load_n(&gate_closed, __ATOMIC_SEQ_CST)) {
+    return 1;
+  }
+  __atomic_sub_fetch(&g->inside, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * @brief Enter the gate, waiting while stock_write() has it closed.
+ */
+static void __gate_enter(void) {
+  while (!__gate_try()) {
+    pthread_mutex_lock(&gate);
+    pthread_mutex_unlock(&gate);
+  }
+}
+
+static inline void __gate_exit(void) {
+  __atomic_sub_fetch(&gate_slot->inside, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Close the gate and wait for every modification inside to leave.
+ */
+static void __gate_close(void) {
+  pthread_mutex_lock(&gate);
+  __atomic_store_n(&gate_closed, 1, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < STOCK_GATE_SLOTS; i++) {
+    while (__atomic_load_n(&gate_slots[i].inside, __ATOMIC_SEQ_CST)) {
+      sched_yield();
+    }
+  }
+}
+
+static void __gate_open(void) {
+  __atomic_store_n(&gate_closed, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&gate);
+}
+
+/**
+ * @brief Mark the database as modified, invalidating the cached snapshot.
+ * @note Counts in the slot of the calling thread. Only every
+ * STOCK_DIRTY_SAMPLE-th call sums the slots for the snapshot dirty count.
+ */
+static inline void __bump_version(void) {
+  if (!(__atomic_add_fetch(&__gate_slot()->version, 1, __ATOMIC_RELEASE) %
+        STOCK_DIRTY_SAMPLE)) {
+    checkpoint_dirty(stock_version());
+  }
+}
+
 /**
  * @brief Insert @p n stock entry with given @p id and @p price.
  *
@@ -15,226 +433,939 @@ struct __db stock_db = {
  * @param price Price of the stock
  * @return STOCK_SUCCESS by default, STOCK_FAILED when there are not
  * enough number of stocks to remove
+ * @note Safe to call while trades are in flight. New items are created one
+ * at a time and published to the hash index once complete, so trades find
+ * them whole or not at all.
  */
 stock_status insert(int id, int n, int price) {
-  stock_status status;
   debug_print("inserting id=%d, n=%d, price=%d", id, n, price);
-  stock_item *item = __search(stock_db.tree, id, &status);
+  stock_item *item = search_stock(id), *new;
+
+  if (item) {
+    // pre-existing item was found
+    return stock_add(item, n);
+  }
 
-  if (n < 0 && status != STOCK_MATCH) {
+  if (n < 0) {
     debug_print("tried to remove count from non-existing entry. failing...");
     return STOCK_FAILED;
   }
 
-  if (stock_db.size == 0) {
-    // empty db. initialize new item as root
-    stock_item *new = (stock_item *)Malloc(sizeof(stock_item));
-    *new = (stock_item){
-        .id = id,
-        .count = n,
-        .price = price,
-        .read_cnt = 0,
-    };
-    Sem_init(&new->r_mutex, 0, 1);
-    Sem_init(&new->w_mutex, 0, 1);
+  __reserve_store();
+  __gate_enter();
+  pthread_rwlock_wrlock(&tree_lock);
+  if ((item = search_stock(id))) {
+    // inserted by another thread meanwhile
+    pthread_rwlock_unlock(&tree_lock);
+    __gate_exit();
+    return stock_add(item, n);
+  }
+  new = &arena[soa_append(&stock_db.soa, id, n, price) - nloaded];
+  *new = (stock_item){
+      .id = id,
+      .count = n,
+      .price = price,
+  };
+  btree_insert(&stock_db.tree, id, new);
+  hash_insert(&stock_db.index, id, new);
+  stock_db.size++;
+  pthread_rwlock_unlock(&tree_lock);
+
+  __bump_version();
+  wal_append(WAL_INSERT, id, n, price);
+  __gate_exit();
+  return STOCK_SUCCESS;
+}
 
-    stock_db.tree = new;
-    stock_db.size++;
-    return STOCK_SUCCESS;
+/**
+ * @brief Apply a logged modification without validating it.
+ * @note Concurrent trades may be logged in a different order than they were
+ * applied, so intermediate counts can dip below zero during replay. The
+ * final sum is the same either way.
+ */
+static void __replay(const wal_record *rec) {
+  stock_item *item = search_stock(rec->id);
+
+  if (rec->type == WAL_INSERT && !item) {
+    insert(rec->id, rec->n, rec->price);
+  } else if (item) {
+    item->count += rec->n;
+    soa_add(&stock_db.soa, __slot(item), rec->n);
+    __bump_version();
+  } else {
+    fprintf(stderr, "wal: modification of unknown id=%d skipped\n", rec->id);
   }
+}
 
-  if (status == STOCK_MATCH) {
-    // pre-existing item was found
-    debug_print("attempting to update id=%d's count from %d to %d", item->id,
-                item->count, item->count + n);
-    if (item->count + n < 0) {
-      debug_print("not enough items left. insert failed.");
-      return STOCK_FAILED;
+/**
+ * @brief FNV-1a over the 32-bit words of @p buf, continuing from @p h.
+ *
+ * @param len Length of @p buf in bytes, a multiple of 4
+ */
+static uint64_t __checksum(uint64_t h, const void *buf, size_t len) {
+  const uint32_t *p = (const uint32_t *)buf;
+  for (size_t i = 0; i < len / sizeof(uint32_t); i++) {
+    h = (h ^ p[i]) * 1099511628211ull;
+  }
+  return h;
+}
+
+#define CHECKSUM_INIT 14695981039346656037ull
+
+/**
+ * @brief Parse a database format name as given on the command line.
+ *
+ * @return Matching format, -1 if @p s names none.
+ */
+stock_format stock_parse_format(const char *s) {
+  if (!strcmp(s, "text")) {
+    return STOCK_FORMAT_TEXT;
+  } else if (!strcmp(s, "binary")) {
+    return STOCK_FORMAT_BINARY;
+  }
+  return (stock_format)-1;
+}
+
+/**
+ * @brief Insert every "id count price" line of @p fp.
+ *
+ * @return Checkpoint named by the header line, 0 without one.
+ */
+static uint32_t __load_text(FILE *fp) {
+  char line[MAXLINE];
+  unsigned checkpoint = 0;
+  int id, count, price;
+
+  while (Fgets(line, MAXLINE, fp)) {
+    if (sscanf(line, STOCK_DB_HEADER " %u", &checkpoint) == 1) {
+      continue;
     }
-    item->count += n;
-    return STOCK_SUCCESS;
-  } else {
-    // next insert position was returned
-    stock_item *new = (stock_item *)Malloc(sizeof(stock_item));
-    *new = (stock_item){
-        .id = id,
-        .count = n,
-        .price = price,
-        .read_cnt = 0,
-    };
-    Sem_init(&new->r_mutex, 0, 1);
-    Sem_init(&new->w_mutex, 0, 1);
+    if (sscanf(line, "%d %d %d", &id, &count, &price) == 3) {
+      debug_print("found entry id=%d count=%d price=%d", id, count, price);
+      insert(id, count, price);
+    }
+  }
+  return checkpoint;
+}
+
+/**
+ * @brief Map the binary database in @p fd and index its items in place.
+ * @note The mapping is private, so trades modify pages of memory, never the
+ * file. The items are not copied and the index is built in a single pass.
+ *
+ * @return Checkpoint stored in the header.
+ */
+static uint32_t __load_binary(int fd, size_t len) {
+  const stock_file_header *hdr;
+  stock_item *items;
+  uint64_t sum;
+  char *map;
+
+  if (len < sizeof(stock_file_header) + sizeof(sum)) {
+    app_error("stock_load error: truncated binary database");
+  }
+  map = (char *)Mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  hdr = (const stock_file_header *)map;
+  items = (stock_item *)(map + sizeof(stock_file_header));
 
-    if (item->id < id) {
-      item->rchild = new;
-    } else {
-      item->lchild = new;
+  if (hdr->version != STOCK_BIN_VERSION ||
+      hdr->count > (len - sizeof(*hdr) - sizeof(sum)) / sizeof(stock_item) ||
+      len != sizeof(*hdr) + hdr->count * sizeof(stock_item) + sizeof(sum)) {
+    app_error("stock_load error: unsupported or truncated binary database");
+  }
+  memcpy(&sum, map + len - sizeof(sum), sizeof(sum));
+  if (__checksum(CHECKSUM_INIT, map, len - sizeof(sum)) != sum) {
+    app_error("stock_load error: binary database checksum mismatch");
+  }
+  for (size_t i = 0; i < hdr->count; i++) {
+    if ((i && items[i].id <= items[i - 1].id) || items[i].count < 0) {
+      app_error("stock_load error: binary database items out of order");
     }
-    stock_db.size++;
-    return STOCK_SUCCESS;
   }
+
+  btree_bulk_load(&stock_db.tree, items, hdr->count, sizeof(stock_item),
+                  offsetof(stock_item, id));
+  hash_bulk_load(&stock_db.index, items, hdr->count, sizeof(stock_item),
+                 offsetof(stock_item, id));
+  __reserve_store();
+  soa_append_records(&stock_db.soa, (const int(*)[3])items, hdr->count);
+  loaded = items;
+  nloaded = hdr->count;
+  stock_db.size = hdr->count;
+  stock_db.map = map;
+  stock_db.map_len = len;
+  __bump_version();
+  return hdr->checkpoint;
+}
+
+/**
+ * @brief Load the database file at @p path into the empty database. The
+ * format is told by the file's first bytes.
+ *
+ * @return Trade log checkpoint the file was written at, 0 if unknown.
+ */
+uint32_t stock_load(const char *path) {
+  char magic[STOCK_BIN_MAGIC_LEN];
+  uint32_t checkpoint;
+  struct stat st;
+  FILE *fp;
+  int fd;
+
+  if (stock_db.tree.root || stock_db.size) {
+    app_error("stock_load() needs an empty database");
+  }
+
+  fd = Open(path, O_RDONLY, 0);
+  Fstat(fd, &st);
+  if (rio_readn(fd, magic, sizeof(magic)) == sizeof(magic) &&
+      !memcmp(magic, STOCK_BIN_MAGIC, sizeof(magic))) {
+    checkpoint = __load_binary(fd, st.st_size);
+    Close(fd);
+  } else {
+    Close(fd);
+    fp = Fopen(path, "r");
+    checkpoint = __load_text(fp);
+    Fclose(fp);
+  }
+  debug_print("loaded %zu entries from %s, checkpoint %u", stock_db.size,
+              path, checkpoint);
+  return checkpoint;
 }
 
 /**
- * @brief Initialise stock database.
- * @note Fails when stock database had been modified in any way.
+ * @brief Initialise stock database, then replay the trade log on top.
+ * @note Fails when stock database had been modified in any way. In binary
+ * format STOCK_BIN_FILENAME is loaded if present, STOCK_DB_FILENAME
+ * otherwise, so a text database is converted by the first stock_write().
  */
 void stock_init(void) {
-  int id, count, price;
+  const char *path = STOCK_DB_FILENAME;
+  uint32_t checkpoint;
 
-  if (stock_db.tree || stock_db.size) {
+  if (stock_db.tree.root || stock_db.size) {
     unix_error("stock_init() should not be called after any modification");
   }
+  if (stock_db.format == STOCK_FORMAT_BINARY &&
+      !access(STOCK_BIN_FILENAME, F_OK)) {
+    path = STOCK_BIN_FILENAME;
+  }
+
+  debug_print("initialising with data in %s", path);
+  checkpoint = stock_load(path);
+  wal_replay(STOCK_WAL_FILENAME, checkpoint, __replay);
+
+  debug_print("stock init complete. height=%d, size=%zu",
+              stock_db.tree.height, stock_db.size);
+}
 
-  debug_print("initialising with data in %s", STOCK_DB_FILENAME);
-  FILE *fp = Fopen(STOCK_DB_FILENAME, "r");
+/**
+ * @brief Copy every entry in ID order as of @p view. Called with the tree
+ * lock held shared.
+ */
+static stock_item *__copy_items(int view, size_t *n) {
+  stock_item *items, *item;
+  btree_iter it;
 
-  while (fscanf(fp, "%d %d %d", &id, &count, &price) != EOF) {
-    debug_print("found entry id=%d count=%d price=%d", id, count, price);
-    insert(id, count, price);
+  items = (stock_item *)Malloc((stock_db.size + 1) * sizeof(stock_item));
+  *n = 0;
+  btree_first(&stock_db.tree, &it);
+  while ((item = btree_next(&it))) {
+    items[*n] = *item;
+    items[(*n)++].count = __count_at(item, view);
   }
-  Fclose(fp);
+  return items;
+}
 
-  debug_print("stock init complete. root addr.=%#010x, size=%zu", stock_db.tree,
-              stock_db.size);
+static void __write_text(FILE *fp, const stock_item *items, size_t n,
+                         uint32_t checkpoint) {
+  fprintf(fp, "%s %u\n", STOCK_DB_HEADER, checkpoint);
+  for (size_t i = 0; i < n; i++) {
+    fprintf(fp, "%d %d %d\n", items[i].id, items[i].count, items[i].price);
+  }
+}
+
+static void __write_binary(FILE *fp, const stock_item *items, size_t n,
+                           uint32_t checkpoint) {
+  stock_file_header hdr = {
+      .version = STOCK_BIN_VERSION,
+      .checkpoint = checkpoint,
+      .count = n,
+  };
+  uint64_t sum;
+
+  memcpy(hdr.magic, STOCK_BIN_MAGIC, STOCK_BIN_MAGIC_LEN);
+  sum = __checksum(CHECKSUM_INIT, &hdr, sizeof(hdr));
+  sum = __checksum(sum, items, n * sizeof(stock_item));
+  Fwrite(&hdr, sizeof(hdr), 1, fp);
+  if (n) {
+    Fwrite(items, sizeof(stock_item), n, fp);
+  }
+  Fwrite(&sum, sizeof(sum), 1, fp);
 }
 
 /**
- * @brief Write stock database to STOCK_DB_FILENAME file.
+ * @brief Write @p items to @p path. The file is written aside, fsynced and
+ * renamed into place, so a crash leaves either version.
  */
-void stock_write() {
+static void __save(const char *path, stock_format format,
+                   const stock_item *items, size_t n, uint32_t checkpoint) {
+  char tmp[MAXLINE];
   FILE *fp;
-  debug_print("writing %zu entries to file", stock_db.size);
-  fp = Fopen(STOCK_DB_FILENAME, "w");
-  __write_item(stock_db.tree, fp);
+
+  debug_print("writing %zu entries to %s, checkpoint %u", n, path,
+              checkpoint);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fp = Fopen(tmp, "w");
+  if (format == STOCK_FORMAT_BINARY) {
+    __write_binary(fp, items, n, checkpoint);
+  } else {
+    __write_text(fp, items, n, checkpoint);
+  }
+  if (fflush(fp) || fsync(fileno(fp))) {
+    unix_error("stock_write sync error");
+  }
   Fclose(fp);
+
+  if (rename(tmp, path) < 0) {
+    unix_error("stock_write rename error");
+  }
+  wal_sync_dir(path);
+}
+
+/**
+ * @brief Write the database to @p path in @p format, tagged with trade log
+ * @p checkpoint.
+ * @note Not synchronised with the trade log. Use stock_write() in a running
+ * server.
+ */
+void stock_save(const char *path, stock_format format, uint32_t checkpoint) {
+  int view = __view_get();
+  stock_item *items;
+  size_t n;
+
+  pthread_mutex_lock(&epoch_mutex);
+  pthread_rwlock_rdlock(&tree_lock);
+  pthread_rwlock_wrlock(&order_lock);
+  __epoch_begin(view);
+  __epoch_thaw();
+  pthread_rwlock_unlock(&order_lock);
+  pthread_mutex_unlock(&epoch_mutex);
+  items = __copy_items(view, &n);
+  pthread_rwlock_unlock(&tree_lock);
+  __epoch_end(view);
+  __save(path, format, items, n, checkpoint);
+  Free(items);
+}
+
+/**
+ * @brief Write a consistent snapshot of the stock database to
+ * STOCK_DB_FILENAME, or STOCK_BIN_FILENAME in binary format.
+ * @note Trades only wait for the view to start, not while the entries are
+ * copied. Starting it with no trade in flight makes the view match the
+ * checkpoint in the log exactly. The trade log is cut once the new file is
+ * on disk.
+ */
+void stock_write(void) {
+  int view = __view_get();
+  stock_item *items;
+  uint32_t checkpoint;
+  size_t n;
+
+  pthread_mutex_lock(&epoch_mutex);
+  __gate_close();
+  pthread_rwlock_rdlock(&tree_lock);
+  __epoch_begin(view);
+  checkpoint = wal_checkpoint();
+  __epoch_thaw();
+  __gate_open();
+  pthread_mutex_unlock(&epoch_mutex);
+  items = __copy_items(view, &n);
+  pthread_rwlock_unlock(&tree_lock);
+  __epoch_end(view);
+
+  __save(stock_db.format == STOCK_FORMAT_BINARY ? STOCK_BIN_FILENAME
+                                                : STOCK_DB_FILENAME,
+         stock_db.format, items, n, checkpoint);
+  Free(items);
+  wal_truncate(checkpoint);
 }
 
 /**
  * @brief Print stock database to @p s buffer.
+ * @note Output is truncated to MAXLINE bytes. Use stock_snapshot_get() to
+ * access the full payload.
  *
- * @param s Reference of buffer to print to.
+ * @param s Reference of buffer to print to. Must hold MAXLINE bytes.
  * @return Pointer to written buffer.
  */
 char *stock_write_to_buf(char *s) {
-  memset(s, 0, strlen(s));
-  debug_print("writing %zu entries to buffer", stock_db.size);
-  __snprint_item(stock_db.tree, s);
+  stock_snapshot *snap = stock_snapshot_get();
+  size_t len = snap->len < MAXLINE - 1 ? snap->len : MAXLINE - 1;
+
+  memcpy(s, snap->buf, len);
+  s[len] = '\0';
+  stock_snapshot_put(snap);
   return s;
 }
 
+/**
+ * @brief Get the rendered `show` payload of the current database version.
+ * @note The payload is rendered at most once per version. Concurrent callers
+ * wait for the thread that is rendering and share its result.
+ *
+ * @return Referenced snapshot. Release with stock_snapshot_put().
+ */
+stock_snapshot *stock_snapshot_get(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  stock_snapshot *snap, *old = NULL;
+  unsigned long version;
+
+  Pthread_once(&once, __init_snapshot);
+
+  P(&snapshot_mutex);
+  version = stock_version();
+  if ((snap = snapshot) && snap->version == version) {
+    snap->refcnt++;
+    V(&snapshot_mutex);
+    return snap;
+  }
+  V(&snapshot_mutex);
+
+  P(&render_mutex);
+  P(&snapshot_mutex);
+  // another thread may have rendered this version while we waited
+  version = stock_version();
+  if ((snap = snapshot) && snap->version == version) {
+    snap->refcnt++;
+    V(&snapshot_mutex);
+    V(&render_mutex);
+    return snap;
+  }
+  V(&snapshot_mutex);
+
+  // writes racing with the walk bump the version past ours, so the next
+  // caller renders again
+  snap = (stock_snapshot *)Malloc(sizeof(stock_snapshot));
+  snap->version = version;
+  snap->refcnt = 2; // one for the cache, one for the caller
+  snap->buf = __snprint_item(&stock_db.tree, &snap->len);
+  debug_print("rendered version %lu (%zu bytes)", version, snap->len);
+
+  P(&snapshot_mutex);
+  if (snapshot && --snapshot->refcnt == 0) {
+    old = snapshot;
+  }
+  snapshot = snap;
+  V(&snapshot_mutex);
+  V(&render_mutex);
+
+  if (old) {
+    Free(old->buf);
+    Free(old);
+  }
+  return snap;
+}
+
+/**
+ * @brief Release a snapshot obtained from stock_snapshot_get().
+ */
+void stock_snapshot_put(stock_snapshot *snap) {
+  int refcnt;
+
+  P(&snapshot_mutex);
+  refcnt = --snap->refcnt;
+  V(&snapshot_mutex);
+
+  if (!refcnt) {
+    Free(snap->buf);
+    Free(snap);
+  }
+}
+
 /**
  * @brief Search for stock item in db with matching @p id
+ * @note Lock-free hash lookup, see hash_search().
  *
  * @param id ID of stock item to search for.
  * @return Pointer to stock item with matching @p id. NULL if no such item were
  * found.
  */
 stock_item *search_stock(int id) {
-  stock_status status;
-  stock_item *item;
   debug_print("searching for stock with id=%d", id);
-  item = __search(stock_db.tree, id, &status);
-  if (status != STOCK_MATCH) {
-    return NULL;
+  return hash_search(&stock_db.index, id);
+}
+
+/**
+ * @brief Whether selling @p n into slice @p s of @p hot keeps its count in
+ * range. Slices are capped so that the reserve and every full slice add up
+ * to at most INT_MAX.
+ */
+static inline int __hot_room(const struct __hot *hot,
+                             const struct __hot_shard *s, int n) {
+  return n <= hot->slice_max - s->count &&
+         __atomic_load_n(&hot->item->count, __ATOMIC_RELAXED) <=
+             INT_MAX - hot->nshards * hot->slice_max;
+}
+
+/**
+ * @brief Move at least @p need stocks from the reserve of @p hot into dry
+ * slice @p s, plus a share of what is left so that the next buys stay
+ * local. Call with the slice locked.
+ *
+ * @return 1 if the slice got them, 0 if the reserve is short.
+ */
+static int __hot_refill(struct __hot *hot, struct __hot_shard *s, int need) {
+  stock_item *item = hot->item;
+  int old = __atomic_load_n(&item->count, __ATOMIC_RELAXED), take;
+
+  do {
+    if (old < need || need > hot->slice_max - s->count) {
+      return 0;
+    }
+    take = need + (old - need) / (2 * hot->nshards);
+    if (take > hot->slice_max - s->count) {
+      take = hot->slice_max - s->count;
+    }
+  } while (!__atomic_compare_exchange_n(&item->count, &old, old - take, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  soa_add(&stock_db.soa, __slot(item), -take);
+  s->count += take;
+  return 1;
+}
+
+/**
+ * @brief Add @p n to hot item @p hot against its exact count, for trades
+ * that their slice cannot serve. Every slice is drained into the reserve.
+ * Call inside the gate.
+ *
+ * @return STOCK_SUCCESS or STOCK_FAILED, -1 if the item left hot mode.
+ */
+static int __hot_settle(struct __hot *hot, int n) {
+  stock_item *item = hot->item;
+  int total;
+
+  __hot_lock(hot);
+  if (!hot->on) {
+    __hot_unlock(hot);
+    return -1;
+  }
+  if (__builtin_add_overflow(__hot_total(hot), n, &total) || total < 0) {
+    __hot_unlock(hot);
+    debug_print("cannot update hot id=%d by %d", item->id, n);
+    return STOCK_FAILED;
   }
-  return item;
+  __hot_drain(hot);
+  __atomic_store_n(&item->count, total, __ATOMIC_SEQ_CST);
+  soa_add(&stock_db.soa, __slot(item), n);
+  __hot_unlock(hot);
+
+  __bump_version();
+  wal_append(WAL_DELTA, item->id, n, 0);
+  return STOCK_SUCCESS;
 }
 
 /**
- * @brief Search for position in @p root suitable for @p id to be in.
+ * @brief Add @p n to hot item @p hot in the slice of the calling core.
+ * Call inside the gate.
+ * @note Touches only the cache line of that slice and the gate slot of the
+ * thread, unless the slice runs dry and is refilled from the reserve, or
+ * the trade has to be settled against the exact count. The trade is logged
+ * after the slice is unlocked. Being inside the gate keeps stock_write()
+ * from placing its log marker between the two.
  *
- * @param root Root of the tree
- * @param id ID to search for
- * @param[out] status Reference to variable. Set to STOCK_MATCH when
- * matching entry is found, else STOCK_NO_MATCH.
- * @return If matching entry was found, that entry's pointer is returned. If
- * not, the parent entry's pointer is returned. Returns NULL if @p root is NULL.
+ * @return STOCK_SUCCESS or STOCK_FAILED, -1 if the item left hot mode.
  */
-stock_item *__search(stock_item *root, int id, stock_status *status) {
-  *status = STOCK_NO_MATCH;
-  if (!root) {
-    debug_print("root is empty");
-    return NULL;
+static int __hot_add(struct __hot *hot, int n) {
+  struct __hot_shard *s =
+      &hot->shards[(unsigned)sched_getcpu() % hot->nshards];
+
+  __shard_lock(s);
+  if (!hot->on) {
+    __shard_unlock(s);
+    return -1;
+  }
+  if (n >= 0 ? !__hot_room(hot, s, n)
+             : s->count < -n && !__hot_refill(hot, s, -n - s->count)) {
+    __shard_unlock(s);
+    return __hot_settle(hot, n);
   }
+  s->count += n;
+  __shard_unlock(s);
+
+  __bump_version();
+  wal_append(WAL_DELTA, hot->item->id, n, 0);
+  return STOCK_SUCCESS;
+}
 
-  debug_print("traversing root->id=%d. lchild=%#010x, rchild=%#010x", root->id,
-              root->lchild, root->rchild);
-  if (root->id == id) {
-    debug_print("item matches id");
-    *status = STOCK_MATCH;
-    return root;
+/**
+ * @brief Atomically add @p n to the count of @p item.
+ * @note The count is updated with a single compare-and-swap, so concurrent
+ * callers never observe or produce a negative count. Trades share the gate
+ * and only ever wait for stock_write() starting a view. While a view is
+ * being taken, the first trade on the item saves its count for it. Items in
+ * hot mode are traded in per-core slices instead, see stock_hot().
+ *
+ * @param item Stock item to update
+ * @param n Number of stocks to add. May be negative to remove stocks
+ * @return STOCK_SUCCESS if the count was updated, STOCK_FAILED if it would
+ * have become negative or overflowed
+ */
+stock_status stock_add(stock_item *item, int n) {
+  struct __hot *hot;
+  uint64_t start;
+  uint32_t *h;
+  int old, new;
+
+  if (__gate_try()) {
+    latency_record(LATENCY_LOCK, 0); // the common case costs no clock reads
+  } else {
+    start = latency_now();
+    __gate_enter();
+    latency_since(LATENCY_LOCK, start);
+  }
+  if ((hot = __hot_get(item)) && (old = __hot_add(hot, n)) >= 0) {
+    __gate_exit();
+    return (stock_status)old;
   }
+  h = __trade_enter(item);
+  __save_count(item);
+  old = __atomic_load_n(&item->count, __ATOMIC_RELAXED);
+  do {
+    if (__builtin_add_overflow(old, n, &new) || new < 0) {
+      __trade_exit(h);
+      __gate_exit();
+      debug_print("cannot update id=%d's count from %d by %d", item->id, old,
+                  n);
+      return STOCK_FAILED;
+    }
+  } while (!__atomic_compare_exchange_n(&item->count, &old, new, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  __trade_exit(h);
+
+  soa_add(&stock_db.soa, __slot(item), n);
+  __bump_version();
+  wal_append(WAL_DELTA, item->id, n, 0);
+  __gate_exit();
+  debug_print("updated id=%d's count from %d to %d", item->id, old, new);
+  return STOCK_SUCCESS;
+}
+
+/**
+ * @brief Apply every leg of an order, or none of them.
+ * @note Legs on the same id are combined. The items are held in ID order,
+ * so concurrent orders cannot deadlock, and every leg is checked before any
+ * count changes. The slices of a hot item are drained while it is held.
+ * Trades on other items go on meanwhile; trades on a held item wait for the
+ * order.
+ *
+ * @param legs Id and change to its count of each leg, buys negative
+ * @param n Number of legs, at most ORDER_MAX_LEGS
+ * @return STOCK_SUCCESS if every leg was applied, STOCK_FAILED if an id
+ * does not exist or a count would have become negative or overflowed
+ */
+stock_status stock_order(const int (*legs)[2], int n) {
+  int merged[ORDER_MAX_LEGS][2], count[ORDER_MAX_LEGS], m = 0, i, j;
+  stock_item *items[ORDER_MAX_LEGS];
+  struct __hot *hots[ORDER_MAX_LEGS];
+  stock_status status = STOCK_SUCCESS;
 
-  stock_item *next_root = NULL;
+  if (n < 1 || n > ORDER_MAX_LEGS) {
+    return STOCK_FAILED;
+  }
+  // sort the legs by id, combining repeated ids
+  for (i = 0; i < n; i++) {
+    for (j = m; j && merged[j - 1][0] > legs[i][0]; j--) {
+    }
+    if (j && merged[j - 1][0] == legs[i][0]) {
+      if (__builtin_add_overflow(merged[j - 1][1], legs[i][1],
+                                 &merged[j - 1][1])) {
+        return STOCK_FAILED;
+      }
+      continue;
+    }
+    memmove(&merged[j + 1], &merged[j], (m - j) * sizeof(merged[0]));
+    merged[j][0] = legs[i][0];
+    merged[j][1] = legs[i][1];
+    m++;
+  }
+  for (i = 0; i < m; i++) {
+    if (!(items[i] = search_stock(merged[i][0]))) {
+      debug_print("order names unknown id=%d", merged[i][0]);
+      return STOCK_FAILED;
+    }
+  }
 
-  if (root->id < id) {
-    if (root->rchild) {
-      next_root = root->rchild;
-    } else {
-      debug_print("can be inserted as rchild of id=%d", root->id);
-      return root;
+  __gate_enter();
+  pthread_rwlock_rdlock(&order_lock);
+  for (i = 0; i < m; i++) {
+    __hold(items[i]);
+    // a hot item cannot turn on or off while held
+    if ((hots[i] = __hot_get(items[i]))) {
+      __hot_lock(hots[i]);
+      __hot_drain(hots[i]);
     }
-  } else {
-    if (root->lchild) {
-      next_root = root->lchild;
-    } else {
-      debug_print("can be inserted as lchild of id=%d", root->id);
-      return root;
+  }
+  for (i = 0; i < m && status == STOCK_SUCCESS; i++) {
+    if (__builtin_add_overflow(items[i]->count, merged[i][1], &count[i]) ||
+        count[i] < 0) {
+      debug_print("order leg id=%d cannot change %d by %d", items[i]->id,
+                  items[i]->count, merged[i][1]);
+      status = STOCK_FAILED;
     }
   }
-  return __search(next_root, id, status); // tail call optimisation
+  if (status == STOCK_SUCCESS) {
+    for (i = 0; i < m; i++) {
+      __save_count(items[i]);
+      __atomic_store_n(&items[i]->count, count[i], __ATOMIC_SEQ_CST);
+      soa_add(&stock_db.soa, __slot(items[i]), merged[i][1]);
+    }
+    __bump_version();
+    wal_append_order((const int(*)[2])merged, m);
+  }
+  for (i = m - 1; i >= 0; i--) {
+    if (hots[i]) {
+      __hot_unlock(hots[i]);
+    }
+    __release(items[i]);
+  }
+  pthread_rwlock_unlock(&order_lock);
+  __gate_exit();
+  return status;
 }
 
 /**
- * @brief Recursively write @p data into @p fp.
- *
- * @param root Root of the stock database to write
- * @param fp File pointer to write to
+ * @brief Stocks of hot item @p hot held in its slices, which the columns
+ * do not include.
  */
-void __write_item(stock_item *root, FILE *fp) {
-  if (!root) {
-    return;
+static int64_t __hot_sliced(const struct __hot *hot) {
+  int64_t n = 0;
+
+  for (int i = 0; i < hot->nshards; i++) {
+    n += __atomic_load_n(&hot->shards[i].count, __ATOMIC_RELAXED);
   }
-  __write_item(root->lchild, fp);
-  fprintf(fp, "%d %d %d\n", root->id, root->count, root->price);
-  __write_item(root->rchild, fp);
+  return n;
+}
+
+/**
+ * @brief Count of @p item, hot slices included. Trades may change it right
+ * after it is read.
+ */
+int stock_count(const stock_item *item) {
+  struct __hot *hot = __hot_get(item);
+
+  return __atomic_load_n(&item->count, __ATOMIC_ACQUIRE) +
+         (hot ? (int)__hot_sliced(hot) : 0);
 }
 
 /**
- * @brief Print entries in database @p root to buffer @p s.
+ * @brief Total number of stocks on hand.
+ */
+int64_t stock_total_units(void) {
+  int64_t units = soa_units(&stock_db.soa);
+
+  for (int i = 0; i < __atomic_load_n(&nhot, __ATOMIC_ACQUIRE); i++) {
+    units += __hot_sliced(&hot_table[i]);
+  }
+  return units;
+}
+
+/**
+ * @brief Total value of the stocks on hand, the sum of count * price.
+ */
+int64_t stock_total_value(void) {
+  int64_t value = soa_value(&stock_db.soa);
+
+  for (int i = 0; i < __atomic_load_n(&nhot, __ATOMIC_ACQUIRE); i++) {
+    value += __hot_sliced(&hot_table[i]) * hot_table[i].item->price;
+  }
+  return value;
+}
+
+/**
+ * @brief Number of items with fewer than @p n stocks left.
+ */
+size_t stock_count_below(int n) {
+  size_t below = soa_count_below(&stock_db.soa, n);
+  const struct __hot *hot;
+  int reserve;
+
+  // the columns only count the reserve of a hot item
+  for (int i = 0; i < __atomic_load_n(&nhot, __ATOMIC_ACQUIRE); i++) {
+    hot = &hot_table[i];
+    reserve = __atomic_load_n(&hot->item->count, __ATOMIC_RELAXED);
+    below += (reserve + __hot_sliced(hot) < n) - (reserve < n);
+  }
+  return below;
+}
+
+/**
+ * @brief Modification count of the database, hot trades included. Equal
+ * versions mean an unchanged database.
+ * @note Also what checkpoint_dirty() is given, so both ends of the dirty
+ * count agree.
+ */
+unsigned long stock_version(void) {
+  unsigned long version = 0;
+
+  for (int i = 0; i < STOCK_GATE_SLOTS; i++) {
+    version += __atomic_load_n(&gate_slots[i].version, __ATOMIC_ACQUIRE);
+  }
+  return version;
+}
+
+/**
+ * @brief Turn hot mode of item @p id on or off.
+ * @note In hot mode, each core buys and sells from its own slice of the count,
+ * on its own cache line, without the item's shared count. A slice that runs dry
+ * refills from the reserve in item->count, and a trade that neither can serve
+ * is settled against the exact count with every slice locked. Views, orders and
+ * snapshots lock all slices of the item for a moment to read or drain its exact
+ * count. Turning hot mode off drains every slice into the reserve.
  *
- * @param root Root of the stock database.
- * @param s buffer to write to.
+ * @return STOCK_SUCCESS, or STOCK_FAILED if there is no such item or
+ * STOCK_HOT_MAX items are already hot.
  */
-void __snprint_item(stock_item *root, char *s) {
-  char buf[MAXLINE];
-  if (!root) {
-    return;
+stock_status stock_hot(int id, int on) {
+  stock_item *item = search_stock(id);
+  struct __hot *hot;
+  long cpus;
+
+  if (!item) {
+    return STOCK_FAILED;
   }
-  debug_print("on node id=%d", root->id);
+  pthread_mutex_lock(&epoch_mutex);
+  if (!(hot = hot_of[__slot(item)])) {
+    if (!on || nhot == STOCK_HOT_MAX) {
+      pthread_mutex_unlock(&epoch_mutex);
+      return on ? STOCK_FAILED : STOCK_SUCCESS;
+    }
+    hot = &hot_table[nhot];
+    cpus = sysconf(_SC_NPROCESSORS_CONF);
+    hot->item = item;
+    hot->nshards = cpus < 1 ? 1 : cpus > STOCK_HOT_SHARDS ? STOCK_HOT_SHARDS
+                                                          : (int)cpus;
+    hot->slice_max = INT_MAX / 2 / hot->nshards;
+    __atomic_store_n(&hot_of[__slot(item)], hot, __ATOMIC_RELEASE);
+    __atomic_store_n(&nhot, nhot + 1, __ATOMIC_RELEASE);
+  }
+  if (on) {
+    // trades already past the check finish on the shared count first. views
+    // being read get the count now, as hot trades never save it
+    __hold(item);
+    __save_count(item);
+    __atomic_store_n(&hot->on, 1, __ATOMIC_RELEASE);
+    __release(item);
+  } else {
+    __hot_lock(hot);
+    __hot_drain(hot);
+    __atomic_store_n(&hot->on, 0, __ATOMIC_RELEASE);
+    __hot_unlock(hot);
+  }
+  pthread_mutex_unlock(&epoch_mutex);
+  debug_print("hot mode of id=%d %s", id, on ? "on" : "off");
+  return STOCK_SUCCESS;
+}
 
-  __snprint_item(root->lchild, s);
+/**
+ * @brief Write every entry of @p tree into @p fp in ID order.
+ *
+ * @param tree Index of the stock database to write
+ * @param fp File pointer to write to
+ */
+void __write_item(const btree_t *tree, FILE *fp) {
+  btree_iter it;
+  stock_item *item;
 
-  P(&root->r_mutex); // lock read
-  if (++root->read_cnt == 1) {
-    P(&root->w_mutex); // lock write
+  pthread_rwlock_rdlock(&tree_lock);
+  btree_first(tree, &it);
+  while ((item = btree_next(&it))) {
+    fprintf(fp, "%d %d %d\n", item->id,
+            __atomic_load_n(&item->count, __ATOMIC_RELAXED), item->price);
   }
-  V(&root->r_mutex);
+  pthread_rwlock_unlock(&tree_lock);
+}
+
+/**
+ * @brief Render entries in database @p tree into a new buffer in ID order.
+ *
+ * @param tree Index of the stock database.
+ * @param[out] len Length of the rendered text, excluding the terminator.
+ * @return Heap allocated, null-terminated buffer.
+ */
+char *__snprint_item(const btree_t *tree, size_t *len) {
+  return __snprint_range(tree, INT_MIN, INT_MAX, SIZE_MAX, len);
+}
 
-  snprintf(buf, sizeof(buf), "%d %d %d\n", root->id, root->count, root->price);
+/**
+ * @brief Render at most @p limit entries with IDs in [@p from, @p to] into a
+ * new buffer in ID order.
+ * @note Seeks to @p from in the index and walks only the rendered entries.
+ * The counts are those of a single moment, and trades never wait for the
+ * walk.
+ *
+ * @param tree Index of the stock database.
+ * @param[out] len Length of the rendered text, excluding the terminator.
+ * @return Heap allocated, null-terminated buffer.
+ */
+char *__snprint_range(const btree_t *tree, int from, int to, size_t limit,
+                      size_t *len) {
+  // widest line: three 11 char integers, two spaces and a newline
+  const size_t line_max = 3 * 11 + 3;
+  size_t cap, n = 0;
+  char *s;
+  btree_iter it;
+  stock_item *item;
+  int view = __view_get();
 
-  P(&root->r_mutex); // lock read
-  if (--root->read_cnt == 0) {
-    V(&root->w_mutex); // unlock write
+  pthread_mutex_lock(&epoch_mutex);
+  pthread_rwlock_rdlock(&tree_lock);
+  pthread_rwlock_wrlock(&order_lock);
+  __epoch_begin(view);
+  __epoch_thaw();
+  pthread_rwlock_unlock(&order_lock);
+  pthread_mutex_unlock(&epoch_mutex);
+  cap = ((tree->size < limit ? tree->size : limit) + 1) * 16;
+  s = (char *)Malloc(cap);
+  btree_seek(tree, from, &it);
+  while (limit-- && (item = btree_next(&it)) && item->id <= to) {
+    debug_print("on node id=%d", item->id);
+    if (cap - n <= line_max) {
+      cap *= 2;
+      s = (char *)Realloc(s, cap);
+    }
+    n += sprintf(s + n, "%d %d %d\n", item->id, __count_at(item, view),
+                 item->price);
   }
-  V(&root->r_mutex);
+  pthread_rwlock_unlock(&tree_lock);
+  __epoch_end(view);
+  s[n] = '\0';
+  *len = n;
+  return s;
+}
 
-  strcat(s, buf);
-  __snprint_item(root->rchild, s);
+/**
+ * @brief Render the entries with IDs in [@p from, @p to].
+ *
+ * @param[out] len Length of the rendered text, excluding the terminator.
+ * @return Heap allocated, null-terminated buffer.
+ */
+char *stock_print_range(int from, int to, size_t *len) {
+  return __snprint_range(&stock_db.tree, from, to, SIZE_MAX, len);
+}
+
+/**
+ * @brief Render up to @p limit entries starting at ID @p start.
+ * @note Pass the last returned ID + 1 as @p start to continue. Fewer than
+ * @p limit entries means the end was reached.
+ *
+ * @param[out] len Length of the rendered text, excluding the terminator.
+ * @return Heap allocated, null-terminated buffer.
+ */
+char *stock_print_page(int start, size_t limit, size_t *len) {
+  return __snprint_range(&stock_db.tree, start, INT_MAX, limit, len);
 }
 
 /**
  * @brief Print all entries in database to stdout.
  */
-void __print_db(void) { __write_item(stock_db.tree, stdout); }
\ No newline at end of file
+void __print_db(void) { __write_item(&stock_db.tree, stdout); }
\ No newline at end of file
@@ -2,13 +2,39 @@
 #ifndef __STOCK_H__
 #define __STOCK_H__
 
+#include <limits.h>
 #include <semaphore.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include "btree.h"
 #include "csapp.h"
+#include "hash.h"
 #include "misc.h"
+#include "soa.h"
+#include "wal.h"
 
 #define STOCK_DB_FILENAME "stock.txt"
+#define STOCK_BIN_FILENAME "stock.bin"
+/* first line of a written database, followed by the trade log checkpoint */
+#define STOCK_DB_HEADER "# checkpoint"
+#define STOCK_BIN_MAGIC "STOCKBIN"
+#define STOCK_BIN_MAGIC_LEN 8
+#define STOCK_BIN_VERSION 1
+/* most items the database can hold. only address space is reserved */
+#ifndef STOCK_MAX_ITEMS
+#define STOCK_MAX_ITEMS (1 << 26)
+#endif
+/* most items in hot mode, and most per-core slices of each */
+#define STOCK_HOT_MAX 64
+#define STOCK_HOT_SHARDS 64
+/* per-thread slots of the database gate and modification count. threads
+ * beyond it share */
+#define STOCK_GATE_SLOTS 64
+/* every this many modifications a thread checks the snapshot dirty count */
+#define STOCK_DIRTY_SAMPLE 64
+/* views, i.e. shows and snapshots, taken at the same time. more wait */
+#define STOCK_VIEWS 4
 
 enum __status {
   STOCK_FAILED = 0,
@@ -17,36 +43,79 @@ enum __status {
   STOCK_NO_MATCH,
 };
 
+enum __format {
+  STOCK_FORMAT_TEXT = 0, /* one "id count price" line per item */
+  STOCK_FORMAT_BINARY,   /* header, sorted records, checksum. mmap-able */
+};
+
 struct __item {
   int id;
   int count;
   int price;
-  int read_cnt;
-  sem_t r_mutex;
-  sem_t w_mutex;
-  struct __item *lchild;
-  struct __item *rchild;
 };
 
 struct __db {
-  struct __item *tree;
+  btree_t tree;          /* ordered index, for ranges and full walks */
+  hash_t index;          /* id to item, for point lookups */
   size_t size;
+  enum __format format;  /* of the file stock_write() produces */
+  void *map;             /* loaded binary database, items point into it */
+  size_t map_len;
+  soa_t soa;             /* column copy of every item for aggregate scans */
+};
+
+/* binary database: this header, count items sorted by id in host byte
+ * order, then a 64-bit checksum of everything in front of it */
+struct __file_header {
+  char magic[STOCK_BIN_MAGIC_LEN];
+  uint32_t version;
+  uint32_t checkpoint;
+  uint64_t count;
+};
+
+/* rendered `show` payload shared between readers of the same version */
+struct __snapshot {
+  unsigned long version;
+  int refcnt;
+  size_t len;
+  char *buf;
 };
 
 typedef enum __status stock_status;
+typedef enum __format stock_format;
+typedef struct __file_header stock_file_header;
 typedef struct __item stock_item;
+typedef struct __snapshot stock_snapshot;
 extern struct __db stock_db;
 
 void stock_init(void);
 void stock_write(void);
+uint32_t stock_load(const char *path);
+void stock_save(const char *path, stock_format format, uint32_t checkpoint);
+stock_format stock_parse_format(const char *s);
 char *stock_write_to_buf(char *s);
+char *stock_print_range(int from, int to, size_t *len);
+char *stock_print_page(int start, size_t limit, size_t *len);
 
 stock_status insert(int id, int n, int price);
 stock_item *search_stock(int id);
+stock_status stock_add(stock_item *item, int n);
+stock_status stock_order(const int (*legs)[2], int n);
+stock_status stock_hot(int id, int on);
+int stock_count(const stock_item *item);
+
+int64_t stock_total_units(void);
+int64_t stock_total_value(void);
+size_t stock_count_below(int n);
+unsigned long stock_version(void);
+
+stock_snapshot *stock_snapshot_get(void);
+void stock_snapshot_put(stock_snapshot *snap);
 
-stock_item *__search(stock_item *root, int id, stock_status *status);
-void __write_item(stock_item *root, FILE *fp);
-void __snprint_item(stock_item *root, char *s);
+void __write_item(const btree_t *tree, FILE *fp);
+char *__snprint_item(const btree_t *tree, size_t *len);
+char *__snprint_range(const btree_t *tree, int from, int to, size_t limit,
+                      size_t *len);
 void __print_db();
 
 #endif /* __STOCK_H__ */
\ No newline at end of file
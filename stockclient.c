@@ -3,31 +3,103 @@
  */
 /* $begin echoclientmain */
 #include "csapp.h"
+#include "misc.h"
+#include "proto.h"
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-l] [-p depth] <host> <port>\n", prog);
+  fprintf(stderr, "  -l  legacy fixed-size replies (for old servers)\n");
+  fprintf(stderr, "  -p  send up to depth requests before reading replies, "
+                  "and report timing\n");
+  exit(0);
+}
 
 int main(int argc, char **argv) {
-  int clientfd;
-  char *host, *port, buf[MAXLINE];
+  int clientfd, opt, depth = 1, nreq, done = 0;
+  long total = 0;
+  char *host, *port, buf[MAXLINE], *reply = NULL, *batch;
+  size_t cap = 0, len;
+  proto_mode mode = PROTO_FRAMED, *modes;
+  double elapsed = 0, start;
   rio_t rio;
 
-  if (argc != 3) {
-    fprintf(stderr, "usage: %s <host> <port>\n", argv[0]);
-    exit(0);
+  while ((opt = getopt(argc, argv, "lp:")) != -1) {
+    switch (opt) {
+    case 'l':
+      mode = PROTO_LEGACY;
+      break;
+    case 'p':
+      depth = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
   }
-  host = argv[1];
-  port = argv[2];
+  if (argc - optind != 2 || depth < 1) {
+    usage(argv[0]);
+  }
+  host = argv[optind];
+  port = argv[optind + 1];
+  batch = Malloc((size_t)depth * MAXLINE);
+  modes = Malloc(depth * sizeof(proto_mode));
 
   clientfd = Open_clientfd(host, port);
   Rio_readinitb(&rio, clientfd);
 
-  while (Fgets(buf, MAXLINE, stdin) != NULL) {
-    Rio_writen(clientfd, buf, strlen(buf));
-    if (!strcmp(buf, "exit\n")) {
+  if (mode == PROTO_FRAMED) {
+    Rio_writen(clientfd, PROTO_FRAMED_CMD, strlen(PROTO_FRAMED_CMD));
+    if (proto_read_reply(&rio, mode, &reply, &cap) < 0) {
+      app_error("server closed the connection");
+    }
+  }
+
+  while (!done) {
+    // collect a batch of requests
+    for (nreq = 0, len = 0; nreq < depth;) {
+      if (Fgets(buf, MAXLINE, stdin) == NULL) {
+        done = 1;
+        break;
+      }
+      if (!strcmp(buf, "exit\n")) {
+        done = 2;
+        break;
+      }
+      // the reply to a protocol switch already arrives in the new format
+      if (!strcmp(buf, PROTO_FRAMED_CMD)) {
+        mode = PROTO_FRAMED;
+      } else if (!strcmp(buf, "proto legacy\n")) {
+        mode = PROTO_LEGACY;
+      }
+      memcpy(batch + len, buf, strlen(buf));
+      len += strlen(buf);
+      modes[nreq++] = mode;
+    }
+    if (!nreq) {
       break;
     }
-    // Rio_readlineb(&rio, buf, MAXLINE);
-    Rio_readnb(&rio, buf, MAXLINE);
-    Fputs(buf, stdout);
+
+    start = now_ns() / 1e9;
+    Rio_writen(clientfd, batch, len);
+    for (int i = 0; i < nreq; i++) {
+      if (proto_read_reply(&rio, modes[i], &reply, &cap) < 0) {
+        app_error("server closed the connection");
+      }
+      Fputs(reply, stdout);
+    }
+    elapsed += now_ns() / 1e9 - start;
+    total += nreq;
+  }
+  if (done == 2) {
+    Rio_writen(clientfd, "exit\n", 5);
+  }
+
+  if (depth > 1 && total) {
+    fprintf(stderr, "%ld requests, depth %d: %.3f ms, %.0f req/s\n", total,
+            depth, elapsed * 1e3, total / elapsed);
   }
+  free(reply);
+  free(batch);
+  free(modes);
   Close(clientfd); // line:netp:echoclient:close
   exit(0);
 }
@@ -0,0 +1,21 @@
+/*
+ * stockconv.c - convert a stock database between text and binary formats
+ */
+#include "stock.h"
+
+int main(int argc, char **argv) {
+  stock_format format;
+  uint32_t checkpoint;
+
+  if (argc != 4 || (int)(format = stock_parse_format(argv[1])) < 0) {
+    fprintf(stderr, "usage: %s <text|binary> <input> <output>\n", argv[0]);
+    fprintf(stderr, "  reads a database in either format and writes it in "
+                    "the given one\n");
+    exit(0);
+  }
+
+  checkpoint = stock_load(argv[2]);
+  stock_save(argv[3], format, checkpoint);
+  printf("%zu items, checkpoint %u\n", stock_db.size, checkpoint);
+  return 0;
+}
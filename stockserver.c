@@ -2,75 +2,190 @@
  * echoserveri.c - An iterative echo server
  */
 /* $begin echoserverimain */
+#include "acceptor.h"
+#include "checkpoint.h"
 #include "command.h"
 #include "csapp.h"
 #include "misc.h"
-#include "sbuf.h"
+#include "pool.h"
+#include "reactor.h"
+#include "scan.h"
 #include "stock.h"
+#include "wal.h"
 
-#define MAX_CONNECTIONS 256
-
-void *thread(void *vargp);
+static void submit(int connfd);
+static void serve(int connfd);
+static void client_open(int connfd);
+static void client_close(int connfd);
 
 static sem_t client_len_mutex;
 volatile int active_client_len = 0;
-sbuf_t sbuf;
+
+static const reactor_hooks hooks = {
+    .on_open = client_open,
+    .on_close = client_close,
+};
+
+static void usage(char *prog) {
+  fprintf(stderr,
+          "usage: %s [-e] [-r reactors] [-t min:max] [-k idle] [-a acceptors] "
+          "[-s scans] [-v] [-w level] [-b budget] [-i interval] [-d dirty] "
+          "[-f format] <port>\n",
+          prog);
+  fprintf(stderr, "  -e  event-driven mode: epoll reactors instead of "
+                  "a worker pool\n");
+  fprintf(stderr, "  -r  number of reactors in event-driven mode "
+                  "(default: one per core)\n");
+  fprintf(stderr, "  -t  fewest and most pool workers, i.e. clients served "
+                  "at once (default: %d:%d)\n",
+          POOL_DEFAULT_MIN, POOL_DEFAULT_MAX);
+  fprintf(stderr, "  -k  time in ms a spare pool worker idles before it "
+                  "exits (default: %d)\n",
+          POOL_DEFAULT_IDLE_MS);
+  fprintf(stderr, "  -a  accept threads for the worker pool, each on its own "
+                  "SO_REUSEPORT socket (default: 1)\n");
+  fprintf(stderr, "  -s  threads running show, stats and other scans, "
+                  "0 to run them inline (default: %d)\n",
+          SCAN_DEFAULT_THREADS);
+  fprintf(stderr, "  -v  log the address of every connection\n");
+  fprintf(stderr, "  -w  trade log durability: off, async, group or sync "
+                  "(default: off)\n");
+  fprintf(stderr, "  -b  longest time in us a logged trade waits to be "
+                  "written (default: %d)\n",
+          WAL_DEFAULT_BUDGET_US);
+  fprintf(stderr, "  -i  longest time in ms between database snapshots, 0 "
+                  "for none (default: %d)\n",
+          CHECKPOINT_DEFAULT_INTERVAL_MS);
+  fprintf(stderr, "  -d  modifications that trigger a snapshot early, 0 for "
+                  "none (default: %d)\n",
+          CHECKPOINT_DEFAULT_DIRTY);
+  fprintf(stderr, "  -f  database format: text (%s) or binary (%s) "
+                  "(default: text)\n",
+          STOCK_DB_FILENAME, STOCK_BIN_FILENAME);
+  exit(0);
+}
 
 int main(int argc, char **argv) {
-  /* Enough space for any address */ // line:netp:echoserveri:sockaddrstorage
-  char client_hostname[MAXLINE], client_port[MAXLINE];
-  int listenfd, connfd;
-  struct sockaddr_storage client_addr;
-  socklen_t client_len;
-  pthread_t tid;
+  int listenfd, opt, event_driven = 0, nacceptors = 1, log = 0;
+  int nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+  wal_level level = WAL_OFF;
+  long budget_us = WAL_DEFAULT_BUDGET_US;
+  long interval_ms = CHECKPOINT_DEFAULT_INTERVAL_MS;
+  long dirty_max = CHECKPOINT_DEFAULT_DIRTY;
+  int pool_min = POOL_DEFAULT_MIN, pool_max = POOL_DEFAULT_MAX;
+  long idle_ms = POOL_DEFAULT_IDLE_MS;
+  int nscans = SCAN_DEFAULT_THREADS;
 
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    exit(0);
+  while ((opt = getopt(argc, argv, "er:t:k:a:s:vw:b:i:d:f:")) != -1) {
+    switch (opt) {
+    case 'e':
+      event_driven = 1;
+      break;
+    case 'r':
+      nreactors = atoi(optarg);
+      break;
+    case 't':
+      if (pool_parse_size(optarg, &pool_min, &pool_max) < 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'k':
+      idle_ms = atol(optarg);
+      break;
+    case 'a':
+      nacceptors = atoi(optarg);
+      break;
+    case 's':
+      nscans = atoi(optarg);
+      break;
+    case 'v':
+      log = 1;
+      break;
+    case 'w':
+      level = wal_parse_level(optarg);
+      break;
+    case 'b':
+      budget_us = atol(optarg);
+      break;
+    case 'i':
+      interval_ms = atol(optarg);
+      break;
+    case 'd':
+      dirty_max = atol(optarg);
+      break;
+    case 'f':
+      stock_db.format = stock_parse_format(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1 || nreactors < 1 || nacceptors < 1 || idle_ms < 0 ||
+      nscans < 0 ||
+      (int)level < 0 || budget_us < 0 || interval_ms < 0 || dirty_max < 0 ||
+      (int)stock_db.format < 0) {
+    usage(argv[0]);
   }
 
+  Signal(SIGPIPE, SIG_IGN); // failed writes end the connection instead
   stock_init();
-  sbuf_init(&sbuf, SBUF_SIZE);
+  wal_open(STOCK_WAL_FILENAME, level, budget_us);
+  checkpoint_start(interval_ms, dirty_max);
+  scan_start(nscans);
   Sem_init(&client_len_mutex, 0, 1);
 
-  listenfd = Open_listenfd(argv[1]);
-  debug_print("now listening...");
-
-  for (int i = 0; i < MAX_CONNECTIONS; i++) {
-    // create threads in advance
-    Pthread_create(&tid, NULL, thread, NULL);
+  if (event_driven) {
+    if ((listenfd = acceptor_open_listenfd(argv[optind], 0)) < 0) {
+      unix_error("acceptor_open_listenfd error");
+    }
+    debug_print("now listening...");
+    reactor_run(listenfd, nreactors, &hooks);
+    exit(0);
   }
 
-  while (1) {
-    // new connection is being established
-    client_len = sizeof(struct sockaddr_storage);
-    connfd = Accept(listenfd, (SA *)&client_addr, &client_len);
-    Getnameinfo((SA *)&client_addr, client_len, client_hostname, MAXLINE,
-                client_port, MAXLINE, 0);
-    printf("Connected to (%s, %s)\n", client_hostname, client_port);
-
-    P(&client_len_mutex);
-    active_client_len++;
-    V(&client_len_mutex);
-    sbuf_insert(&sbuf, connfd);
-  }
+  pool_start(pool_min, pool_max, idle_ms, serve);
+  acceptor_run(argv[optind], nacceptors, log, submit);
   exit(0);
 }
 /* $end echoserverimain */
 
-void *thread(void *vargp) {
-  int connfd;
-  Pthread_detach(pthread_self());
-  while (1) {
-    connfd = sbuf_remove(&sbuf);
-    handle_threaded_connection(connfd);
-    Close(connfd);
+/**
+ * @brief Hand newly accepted client @p connfd to the worker pool.
+ */
+static void submit(int connfd) {
+  client_open(connfd);
+  pool_submit(connfd);
+}
 
-    P(&client_len_mutex);
-    active_client_len--;
-    if (!active_client_len) {
-      stock_write();
-    }
-    V(&client_len_mutex);
+/**
+ * @brief Serve client @p connfd on a pool worker until it disconnects.
+ */
+static void serve(int connfd) {
+  handle_threaded_connection(connfd);
+  Close(connfd);
+  client_close(connfd);
+}
+
+/**
+ * @brief Account for a newly accepted client.
+ */
+static void client_open(int connfd) {
+  P(&client_len_mutex);
+  active_client_len++;
+  V(&client_len_mutex);
+}
+
+/**
+ * @brief Account for a closed client. Once the last client is gone the
+ * checkpointer is asked to write the database, without waiting for it.
+ */
+static void client_close(int connfd) {
+  int last;
+
+  P(&client_len_mutex);
+  last = !--active_client_len;
+  V(&client_len_mutex);
+  if (last) {
+    checkpoint_request();
   }
-}
\ No newline at end of file
+}
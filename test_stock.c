@@ -1,8 +1,855 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "book.h"
+#include "latency.h"
+#include "parse.h"
+#include "pool.h"
+#include "proto.h"
+#include "sbuf.h"
+#include "scan.h"
+#include "slab.h"
 #include "stock.h"
 
+#define BTREE_TEST_KEYS 100000
+
+/* index must stay ordered and shallow for sorted and reverse-sorted loads */
+static void test_btree(void) {
+  btree_t tree;
+  btree_iter it;
+  void *val;
+  int prev = -1, n = 0;
+
+  btree_init(&tree);
+  for (int i = BTREE_TEST_KEYS; i > 0; i--) {
+    assert(!btree_insert(&tree, i * 2, (void *)(intptr_t)(i * 2)));
+  }
+  for (int i = 1; i <= BTREE_TEST_KEYS; i++) {
+    assert(btree_search(&tree, i * 2) == (void *)(intptr_t)(i * 2));
+    assert(!btree_search(&tree, i * 2 + 1));
+  }
+  assert(btree_insert(&tree, 2, NULL) == (void *)(intptr_t)2);
+
+  btree_first(&tree, &it);
+  while ((val = btree_next(&it))) {
+    assert((intptr_t)val > prev);
+    prev = (intptr_t)val;
+    n++;
+  }
+  assert(n == BTREE_TEST_KEYS && tree.size == BTREE_TEST_KEYS);
+
+  btree_seek(&tree, 1001, &it);
+  assert(btree_next(&it) == (void *)(intptr_t)1002);
+  printf("btree: %zu keys, height %d\n", tree.size, tree.height);
+  btree_free(&tree);
+}
+
+/* bulk loaded index must match one built by inserts, at every size */
+static void test_btree_bulk(void) {
+  static int keys[BTREE_TEST_KEYS];
+  btree_t tree;
+  btree_iter it;
+  int *val;
+
+  for (int i = 0; i < BTREE_TEST_KEYS; i++) {
+    keys[i] = i * 2;
+  }
+  for (int n = 0; n <= BTREE_TEST_KEYS; n = n * 3 + 1) {
+    btree_init(&tree);
+    btree_bulk_load(&tree, keys, n, sizeof(int), 0);
+    assert(tree.size == (size_t)n);
+    for (int i = 0; i < n; i++) {
+      assert(btree_search(&tree, i * 2) == &keys[i]);
+      assert(!btree_search(&tree, i * 2 + 1));
+    }
+    btree_first(&tree, &it);
+    for (int i = 0; i < n; i++) {
+      assert((val = btree_next(&it)) && *val == i * 2);
+    }
+    assert(!btree_next(&it));
+    assert(!btree_insert(&tree, -1, keys) && tree.size == (size_t)n + 1);
+    btree_free(&tree);
+  }
+}
+
+#define HASH_TEST_KEYS 100000
+#define HASH_TEST_THREADS 4
+
+static hash_t test_hash_index;
+
+/* inserters race on overlapping keys, each key is stored exactly once */
+static void *__hash_inserter(void *vargp) {
+  long won = 0;
+
+  for (int i = 0; i < HASH_TEST_KEYS; i++) {
+    won += !hash_insert(&test_hash_index, i * 3 - HASH_TEST_KEYS,
+                        (void *)(intptr_t)(i + 1));
+    assert(hash_search(&test_hash_index, i * 3 - HASH_TEST_KEYS) ==
+           (void *)(intptr_t)(i + 1));
+  }
+  return (void *)won;
+}
+
+/* lookups stay correct while the table grows under concurrent inserts */
+static void test_hash(void) {
+  pthread_t tids[HASH_TEST_THREADS];
+  long won = 0;
+  void *ret;
+
+  hash_init(&test_hash_index);
+  assert(!hash_search(&test_hash_index, 0));
+  assert(!hash_insert(&test_hash_index, INT_MIN, &won));
+  assert(hash_insert(&test_hash_index, INT_MIN, NULL) == &won);
+  assert(!hash_search(&test_hash_index, 0));
+  hash_free(&test_hash_index);
+
+  for (int i = 0; i < HASH_TEST_THREADS; i++) {
+    Pthread_create(&tids[i], NULL, __hash_inserter, NULL);
+  }
+  for (int i = 0; i < HASH_TEST_THREADS; i++) {
+    Pthread_join(tids[i], &ret);
+    won += (long)ret;
+  }
+  assert(won == HASH_TEST_KEYS && test_hash_index.size == HASH_TEST_KEYS);
+  for (int i = 0; i < HASH_TEST_KEYS; i++) {
+    assert(hash_search(&test_hash_index, i * 3 - HASH_TEST_KEYS) ==
+           (void *)(intptr_t)(i + 1));
+    assert(!hash_search(&test_hash_index, i * 3 - HASH_TEST_KEYS + 1));
+  }
+  printf("hash: %zu keys, %zu slots\n", test_hash_index.size,
+         test_hash_index.table->mask + 1);
+  hash_free(&test_hash_index);
+}
+
+/* slab objects are packed back to back, chunks start on a cache line */
+static void test_slab(void) {
+  slab_t slab;
+  stock_item *prev = NULL, *item;
+
+  slab_init(&slab, sizeof(stock_item), 100);
+  for (int i = 0; i < 1000; i++) {
+    item = slab_alloc(&slab);
+    assert(!item->id && !item->count && !item->price);
+    if (i % 100 == 0) {
+      assert((uintptr_t)item % SLAB_ALIGN == 0);
+    } else {
+      assert(item == prev + 1);
+    }
+    prev = item;
+  }
+  assert(slab.nchunks == 10 &&
+         slab_reserved(&slab) == 10 * (SLAB_ALIGN + 100 * sizeof(stock_item)));
+  slab_free(&slab);
+}
+
+/* every scan kernel agrees with the scalar one, tails included */
+static void test_soa_kernels(void) {
+  soa_t soa = SOA_INITIALIZER;
+  unsigned seed = 3;
+
+  soa_init(&soa, 1000);
+  for (int n = 0; n < 1000; n++) {
+    int64_t units, value;
+    size_t below;
+
+    soa_use_kernel(SOA_SCALAR);
+    units = soa_units(&soa);
+    value = soa_value(&soa);
+    below = soa_count_below(&soa, 500);
+    for (int k = SOA_SSE41; k <= SOA_AVX2; k++) {
+      soa_use_kernel((soa_kernel)k);
+      assert(soa_units(&soa) == units && soa_value(&soa) == value &&
+             soa_count_below(&soa, 500) == below);
+    }
+    soa_append(&soa, n, rand_r(&seed) % 1000, rand_r(&seed) % 100000 - 500);
+  }
+  soa_use_kernel(SOA_AUTO);
+}
+
+/* render items @p from to @p to, which must all exist, like `show` does */
+static void __expect_lines(char *buf, int from, int to) {
+  size_t off = 0;
+  buf[0] = '\0';
+  for (int id = from; id <= to; id++) {
+    stock_item *item = search_stock(id);
+    off += sprintf(buf + off, "%d %d %d\n", id, item->count, item->price);
+  }
+}
+
+#define SBUF_TEST_ITEMS 100000
+#define SBUF_TEST_THREADS 4
+
+static sbuf_t test_sbuf;
+static long sbuf_sums[SBUF_TEST_THREADS];
+
+static void *__sbuf_consumer(void *vargp) {
+  long *sum = vargp;
+  int v;
+
+  while ((v = sbuf_remove(&test_sbuf)) >= 0) {
+    *sum += v;
+  }
+  return NULL;
+}
+
+static void *__sbuf_producer(void *vargp) {
+  for (int i = 1; i <= SBUF_TEST_ITEMS; i++) {
+    sbuf_insert(&test_sbuf, i);
+  }
+  return NULL;
+}
+
+/* every handed-off value arrives exactly once, with the queue mostly full */
+static void test_sbuf_handoff(void) {
+  pthread_t producers[SBUF_TEST_THREADS], consumers[SBUF_TEST_THREADS];
+  long total = 0;
+  int v;
+
+  sbuf_init(&test_sbuf, 3); // rounds up to 4
+  assert(test_sbuf.mask == 3);
+  for (int i = 0; i < 4; i++) {
+    assert(sbuf_try_insert(&test_sbuf, i));
+  }
+  assert(!sbuf_try_insert(&test_sbuf, 4));
+  for (int i = 0; i < 4; i++) {
+    assert(sbuf_try_remove(&test_sbuf, &v) && v == i);
+  }
+  assert(!sbuf_try_remove(&test_sbuf, &v));
+
+  for (int i = 0; i < SBUF_TEST_THREADS; i++) {
+    Pthread_create(&consumers[i], NULL, __sbuf_consumer, &sbuf_sums[i]);
+    Pthread_create(&producers[i], NULL, __sbuf_producer, NULL);
+  }
+  for (int i = 0; i < SBUF_TEST_THREADS; i++) {
+    Pthread_join(producers[i], NULL);
+  }
+  for (int i = 0; i < SBUF_TEST_THREADS; i++) {
+    sbuf_insert(&test_sbuf, -1);
+  }
+  for (int i = 0; i < SBUF_TEST_THREADS; i++) {
+    Pthread_join(consumers[i], NULL);
+    total += sbuf_sums[i];
+  }
+  assert(total ==
+         SBUF_TEST_THREADS * (long)SBUF_TEST_ITEMS * (SBUF_TEST_ITEMS + 1) / 2);
+  sbuf_free(&test_sbuf);
+}
+
+#define POOL_TEST_JOBS 8
+
+static atomic_int pool_handled;
+
+static void __pool_job(int fd) {
+  usleep(20000);
+  atomic_fetch_add(&pool_handled, 1);
+}
+
+/* busy workers make the pool grow to its maximum, idle ones shrink it */
+static void test_pool(void) {
+  pool_stats st;
+  int min, max;
+
+  assert(!pool_parse_size("2:8", &min, &max) && min == 2 && max == 8);
+  assert(!pool_parse_size("3", &min, &max) && min == 3 && max == 3);
+  assert(pool_parse_size("8:2", &min, &max) < 0 &&
+         pool_parse_size("0:2", &min, &max) < 0 &&
+         pool_parse_size("2:x", &min, &max) < 0);
+
+  pool_start(1, 4, 50, __pool_job);
+  for (int i = 0; i < POOL_TEST_JOBS; i++) {
+    pool_submit(i);
+  }
+  while (atomic_load(&pool_handled) < POOL_TEST_JOBS) {
+    usleep(1000);
+  }
+  usleep(200000);
+  pool_get_stats(&st, 0);
+  assert(st.served == POOL_TEST_JOBS && !st.queued && st.peak == 4 &&
+         st.threads == 1 && st.retired == 3 && st.wait_max_ns);
+}
+
+#define SCAN_TEST_THREADS 2
+#define SCAN_TEST_JOBS 8
+
+static atomic_int scan_running_now, scan_running_max;
+static sem_t scan_done;
+
+static void __scan_job(scan_job *job) {
+  int n = atomic_fetch_add(&scan_running_now, 1) + 1, max;
+
+  max = atomic_load(&scan_running_max);
+  while (n > max && !atomic_compare_exchange_weak(&scan_running_max, &max, n)) {
+  }
+  usleep(10000);
+  atomic_fetch_sub(&scan_running_now, 1);
+  V(&scan_done);
+}
+
+/* jobs run inline until the pool starts, then at most its threads at once */
+static void test_scan(void) {
+  scan_job jobs[SCAN_TEST_JOBS];
+  scan_stats st;
+
+  Sem_init(&scan_done, 0, 0);
+  jobs[0].run = __scan_job;
+  scan_submit(&jobs[0]);
+  assert(!scan_running() && !sem_trywait(&scan_done));
+
+  scan_start(SCAN_TEST_THREADS);
+  assert(scan_running());
+  for (int i = 0; i < SCAN_TEST_JOBS; i++) {
+    jobs[i].run = __scan_job;
+    scan_submit(&jobs[i]);
+  }
+  for (int i = 0; i < SCAN_TEST_JOBS; i++) {
+    P(&scan_done);
+  }
+  assert(atomic_load(&scan_running_max) == SCAN_TEST_THREADS);
+  do { // threads record a run after the job returned
+    usleep(1000);
+    scan_get_stats(&st, 0);
+  } while (st.busy);
+  scan_get_stats(&st, 1);
+  assert(st.threads == SCAN_TEST_THREADS && st.served == SCAN_TEST_JOBS &&
+         !st.queued && st.peak >= 1 && st.wait.count == SCAN_TEST_JOBS &&
+         st.run.count == SCAN_TEST_JOBS &&
+         hist_percentile(&st.run, 0.5) >= 10000000);
+  scan_get_stats(&st, 0);
+  assert(!st.peak);
+}
+
+/* every request is counted, one in LATENCY_SAMPLE is timed per phase */
+static void test_latency(void) {
+  int op = LATENCY_MAX_OPS - 1;
+  uint64_t start;
+  hist_t h;
+
+  for (int i = 0; i < 4 * LATENCY_SAMPLE; i++) {
+    start = latency_start();
+    latency_set_op(op);
+    assert(!start == !latency_now());
+    latency_record(LATENCY_EXECUTE, 1000);
+  }
+  hist_init(&h);
+  latency_collect(op, LATENCY_EXECUTE, &h);
+  assert(latency_count(op) == 4 * LATENCY_SAMPLE && h.count >= 1 &&
+         hist_percentile(&h, 0.99) == 1000);
+
+  latency_enable(0);
+  assert(!latency_start() && !latency_now());
+  latency_set_op(op);
+  assert(latency_count(op) == 4 * LATENCY_SAMPLE);
+  latency_enable(1);
+}
+
+/* request lines are split, dispatched and range-checked in one pass */
+static void test_parse(void) {
+  cmd_request req;
+  int v;
+
+  assert(parse_request("buy 3 10\n", &req) == REQ_BUY && req.arg[0] == 3 &&
+         req.arg[1] == 10);
+  assert(parse_request("  sell\t-1 +7\r\n", &req) == REQ_SELL &&
+         req.arg[0] == -1 && req.arg[1] == 7);
+  assert(parse_request("show", &req) == REQ_SHOW);
+  assert(parse_request("show 2 5", &req) == REQ_SHOW_RANGE &&
+         req.arg[0] == 2 && req.arg[1] == 5);
+  assert(parse_request("show page 3 2", &req) == REQ_SHOW_PAGE &&
+         req.arg[0] == 3 && req.arg[1] == 2);
+  assert(parse_request("lowstock 10", &req) == REQ_LOWSTOCK);
+  assert(parse_request("proto framed", &req) == REQ_PROTO &&
+         req.arg[0] == PROTO_FRAMED);
+  assert(parse_request("stats\n", &req) == REQ_STATS);
+  assert(parse_request("exit", &req) == REQ_EXIT);
+  assert(parse_request("order buy 3 10 sell 4 2\n", &req) == REQ_ORDER &&
+         req.nlegs == 2 && req.legs[0][0] == 3 && req.legs[0][1] == -10 &&
+         req.legs[1][0] == 4 && req.legs[1][1] == 2);
+  assert(parse_request("order sell 1 1", &req) == REQ_ORDER && req.nlegs == 1);
+  assert(parse_request("limit sell 3 10 250", &req) == REQ_LIMIT_SELL &&
+         req.arg[0] == 3 && req.arg[1] == 10 && req.arg[2] == 250);
+  assert(parse_request("market buy 3 10", &req) == REQ_MARKET_BUY &&
+         req.arg[0] == 3 && req.arg[1] == 10);
+  assert(parse_request("cancel 42", &req) == REQ_CANCEL && req.arg[0] == 42);
+  assert(parse_request("book 3", &req) == REQ_BOOK && req.arg[0] == 3);
+  assert(parse_request("admin hot 3", &req) == REQ_ADMIN_HOT &&
+         req.arg[0] == 3);
+  assert(parse_request("admin cold 3", &req) == REQ_ADMIN_COLD);
+  assert(parse_request("admin sched", &req) == REQ_ADMIN_SCHED);
+
+  // anything not exactly a command is invalid, never half-parsed
+  assert(parse_request("", &req) == REQ_INVALID);
+  assert(parse_request("buy 3", &req) == REQ_INVALID);
+  assert(parse_request("buy 3 10 1 2", &req) == REQ_INVALID);
+  assert(parse_request("buys 3 10", &req) == REQ_INVALID);
+  assert(parse_request("buy 3x 10", &req) == REQ_INVALID);
+  assert(parse_request("buy 3 2147483648", &req) == REQ_INVALID);
+  assert(parse_request("show page 3 -1", &req) == REQ_INVALID);
+  assert(parse_request("proto binary", &req) == REQ_INVALID);
+  assert(parse_request("order", &req) == REQ_INVALID);
+  assert(parse_request("order buy 3", &req) == REQ_INVALID);
+  assert(parse_request("order buy 3 -1", &req) == REQ_INVALID);
+  assert(parse_request("order buy 3 1 show 4 1", &req) == REQ_INVALID);
+  assert(parse_request("limit buy 3 10", &req) == REQ_INVALID);
+  assert(parse_request("limit buy 3 10 0", &req) == REQ_INVALID);
+  assert(parse_request("limit hold 3 10 5", &req) == REQ_INVALID);
+  assert(parse_request("market sell 3 0", &req) == REQ_INVALID);
+  assert(parse_request("market sell 3 1 5", &req) == REQ_INVALID);
+  assert(parse_request("admin hot x", &req) == REQ_INVALID);
+
+  assert(!parse_int("-2147483648", 11, &v) && v == INT_MIN);
+  assert(!parse_int("2147483647", 10, &v) && v == INT_MAX);
+  assert(parse_int("-", 1, &v) && parse_int("99999999999", 11, &v));
+}
+
+#define INSERT_TEST_ITEMS 200
+#define INSERT_TEST_BASE 100000
+
+static volatile int inserting;
+
+static void *__insert_trader(void *vargp) {
+  stock_item *item = search_stock(1);
+
+  while (inserting) {
+    assert(stock_add(item, -1) == STOCK_SUCCESS);
+    assert(stock_add(item, 1) == STOCK_SUCCESS);
+  }
+  return NULL;
+}
+
+/* new items appear whole while trades are in flight */
+static void test_stock_insert_concurrent(void) {
+  int count = search_stock(1)->count;
+  size_t size = stock_db.size;
+  stock_item *item;
+  pthread_t tid;
+
+  inserting = 1;
+  Pthread_create(&tid, NULL, __insert_trader, NULL);
+  for (int i = 0; i < INSERT_TEST_ITEMS; i++) {
+    assert(insert(INSERT_TEST_BASE + i, i + 1, 7) == STOCK_SUCCESS);
+    item = search_stock(INSERT_TEST_BASE + i);
+    assert(item && item->count == i + 1 && item->price == 7);
+  }
+  inserting = 0;
+  Pthread_join(tid, NULL);
+  assert(search_stock(1)->count == count);
+  assert(stock_db.size == size + INSERT_TEST_ITEMS &&
+         stock_db.tree.size == stock_db.size);
+}
+
+/* insert @p n items from id @p base on, none of which may exist yet */
+static void __fresh_items(int base, int n, int count, int price) {
+  for (int i = 0; i < n; i++) {
+    assert(!search_stock(base + i));
+    assert(insert(base + i, count, price) == STOCK_SUCCESS);
+  }
+}
+
+#define VIEW_TEST_ITEMS 64
+#define VIEW_TEST_BASE 200000
+#define VIEW_TEST_ROUNDS 200
+#define VIEW_TEST_READERS (STOCK_VIEWS + 2)
+
+static volatile int viewing;
+
+/* adds one to every item in turn, so any moment shows a step in the counts */
+static void *__view_trader(void *vargp) {
+  stock_item *items[VIEW_TEST_ITEMS];
+
+  for (int i = 0; i < VIEW_TEST_ITEMS; i++) {
+    items[i] = search_stock(VIEW_TEST_BASE + i);
+  }
+  while (viewing) {
+    for (int i = 0; i < VIEW_TEST_ITEMS; i++) {
+      assert(stock_add(items[i], 1) == STOCK_SUCCESS);
+    }
+  }
+  return NULL;
+}
+
+/* a moment of __view_trader: counts c+1 up to some item, c from there on */
+static void __expect_step(const int *counts) {
+  int i = 1;
+
+  while (i < VIEW_TEST_ITEMS && counts[i] == counts[0]) {
+    i++;
+  }
+  while (i < VIEW_TEST_ITEMS && counts[i] == counts[0] - 1) {
+    i++;
+  }
+  assert(i == VIEW_TEST_ITEMS);
+}
+
+/* takes VIEW_TEST_ROUNDS ranges, counting those taken mid-round */
+static void *__view_reader(void *vargp) {
+  int counts[VIEW_TEST_ITEMS], id, price;
+  int *steps = (int *)vargp;
+  char *range, *line;
+  size_t len;
+
+  for (int r = 0; r < VIEW_TEST_ROUNDS; r++) {
+    range = stock_print_range(VIEW_TEST_BASE,
+                              VIEW_TEST_BASE + VIEW_TEST_ITEMS - 1, &len);
+    line = range;
+    for (int i = 0; i < VIEW_TEST_ITEMS; i++) {
+      assert(sscanf(line, "%d %d %d", &id, &counts[i], &price) == 3);
+      assert(id == VIEW_TEST_BASE + i);
+      line = strchr(line, '\n') + 1;
+    }
+    __expect_step(counts);
+    *steps += counts[0] != counts[VIEW_TEST_ITEMS - 1];
+    Free(range);
+  }
+  return NULL;
+}
+
+/* ranges and saved files match a single moment while trades go on, also
+ * with more of them taken at once than there are views */
+static void test_stock_view_consistent(void) {
+  int counts[VIEW_TEST_ITEMS], id, price, steps[VIEW_TEST_READERS] = {0};
+  char path[] = "test_view.txt", buf[MAXLINE];
+  pthread_t tid, readers[VIEW_TEST_READERS];
+  FILE *fp;
+
+  __fresh_items(VIEW_TEST_BASE, VIEW_TEST_ITEMS, 0, 1);
+  viewing = 1;
+  Pthread_create(&tid, NULL, __view_trader, NULL);
+  for (int i = 0; i < VIEW_TEST_READERS; i++) {
+    Pthread_create(&readers[i], NULL, __view_reader, &steps[i]);
+  }
+  for (int r = 0; r < VIEW_TEST_ROUNDS / 50; r++) {
+    stock_save(path, STOCK_FORMAT_TEXT, 0);
+    fp = Fopen(path, "r");
+    for (int i = 0; Fgets(buf, MAXLINE, fp);) {
+      if (sscanf(buf, "%d %d %d", &id, &counts[i], &price) == 3 &&
+          id >= VIEW_TEST_BASE) {
+        i++;
+      }
+    }
+    Fclose(fp);
+    __expect_step(counts);
+  }
+  for (int i = 0; i < VIEW_TEST_READERS; i++) {
+    Pthread_join(readers[i], NULL);
+    steps[0] += i ? steps[i] : 0;
+  }
+  viewing = 0;
+  Pthread_join(tid, NULL);
+  unlink(path);
+  printf("views: %d of %d taken mid-round\n", steps[0],
+         VIEW_TEST_READERS * VIEW_TEST_ROUNDS);
+}
+
+#define ORDER_TEST_BASE 300000
+#define ORDER_TEST_ROUNDS 2000
+
+static volatile int ordering;
+
+/* moves one stock at a time between the order test items */
+static void *__order_trader(void *vargp) {
+  int legs[2][2] = {{ORDER_TEST_BASE, -1}, {ORDER_TEST_BASE + 1, 1}};
+  unsigned seed = (uintptr_t)vargp;
+
+  while (ordering) {
+    legs[0][0] = ORDER_TEST_BASE + rand_r(&seed) % 3;
+    legs[1][0] = ORDER_TEST_BASE + rand_r(&seed) % 3;
+    stock_order((const int(*)[2])legs, 2);
+  }
+  return NULL;
+}
+
+/* orders apply whole or not at all, also as seen by views */
+static void test_stock_order(void) {
+  int legs[3][2] = {{ORDER_TEST_BASE, -5}, {ORDER_TEST_BASE + 1, 5}};
+  int id, count, price, sum, total = 0;
+  pthread_t tids[2];
+  char *range, *line;
+  size_t len;
+
+  __fresh_items(ORDER_TEST_BASE, 3, 10, 1);
+  assert(stock_order((const int(*)[2])legs, 2) == STOCK_SUCCESS);
+  assert(search_stock(ORDER_TEST_BASE)->count == 5 &&
+         search_stock(ORDER_TEST_BASE + 1)->count == 15);
+
+  // a failing leg leaves the others untouched, wherever it is
+  legs[0][1] = 1;
+  legs[1][1] = -16;
+  assert(stock_order((const int(*)[2])legs, 2) == STOCK_FAILED);
+  legs[2][0] = ORDER_TEST_BASE + 99; // no such item
+  legs[1][1] = -1;
+  assert(!search_stock(legs[2][0]));
+  assert(stock_order((const int(*)[2])legs, 3) == STOCK_FAILED);
+  assert(search_stock(ORDER_TEST_BASE)->count == 5 &&
+         search_stock(ORDER_TEST_BASE + 1)->count == 15);
+
+  // legs on one id are combined before checking
+  legs[0][1] = -5;
+  legs[1][0] = ORDER_TEST_BASE;
+  legs[1][1] = 10;
+  assert(stock_order((const int(*)[2])legs, 2) == STOCK_SUCCESS &&
+         search_stock(ORDER_TEST_BASE)->count == 10);
+  legs[0][1] = -10;
+  assert(stock_order((const int(*)[2])legs, 1) == STOCK_SUCCESS &&
+         stock_order((const int(*)[2])legs, 1) == STOCK_FAILED);
+  stock_add(search_stock(ORDER_TEST_BASE), 10);
+  for (int i = 0; i < 3; i++) {
+    total += search_stock(ORDER_TEST_BASE + i)->count;
+  }
+
+  ordering = 1;
+  for (int i = 0; i < 2; i++) {
+    Pthread_create(&tids[i], NULL, __order_trader, (void *)(uintptr_t)i);
+  }
+  for (int r = 0; r < ORDER_TEST_ROUNDS; r++) {
+    range = stock_print_range(ORDER_TEST_BASE, ORDER_TEST_BASE + 2, &len);
+    sum = 0;
+    for (line = range; *line; line = strchr(line, '\n') + 1) {
+      assert(sscanf(line, "%d %d %d", &id, &count, &price) == 3 && count >= 0);
+      sum += count;
+    }
+    assert(sum == total);
+    Free(range);
+  }
+  ordering = 0;
+  for (int i = 0; i < 2; i++) {
+    Pthread_join(tids[i], NULL);
+  }
+}
+
+#define BOOK_TEST_ID 400000
+/* exactly what the sells below take out of the count */
+#define BOOK_TEST_STOCK 1019
+
+/* orders match best price first, then oldest first, at the resting price,
+ * and every match is sold out of the count */
+static void test_book(void) {
+  stock_item *item;
+  book_fill fill;
+  int oid[4], qty, price;
+  int64_t depth;
+
+  __fresh_items(BOOK_TEST_ID, 1, BOOK_TEST_STOCK, 100);
+  item = search_stock(BOOK_TEST_ID);
+  assert(!book_top(item, BOOK_BUY, &price, &depth));
+  assert(book_market(item, BOOK_SELL, BOOK_TEST_STOCK + 1, &fill) ==
+             BOOK_SHORT &&
+         !fill.filled);
+
+  assert(book_limit(item, BOOK_SELL, 5, 102, &fill) == BOOK_OK && fill.oid &&
+         !fill.filled);
+  oid[0] = fill.oid;
+  book_limit(item, BOOK_SELL, 5, 101, &fill);
+  oid[1] = fill.oid;
+  book_limit(item, BOOK_SELL, 5, 101, &fill);
+  oid[2] = fill.oid;
+  book_limit(item, BOOK_BUY, 3, 99, &fill);
+  oid[3] = fill.oid;
+  assert(book_top(item, BOOK_SELL, &price, &depth) && price == 101 &&
+         depth == 10);
+  assert(book_top(item, BOOK_BUY, &price, &depth) && price == 99 &&
+         depth == 3);
+  // resting asks count against the stock a sell may offer
+  assert(book_limit(item, BOOK_SELL, BOOK_TEST_STOCK - 14, 103, &fill) ==
+             BOOK_SHORT &&
+         !fill.oid);
+  assert(item->count == BOOK_TEST_STOCK);
+
+  // crosses 101 oldest first, then 102, and rests the rest at its price
+  assert(book_limit(item, BOOK_BUY, 12, 102, &fill) == BOOK_OK &&
+         fill.filled == 12 && fill.value == 10 * 101 + 2 * 102 && !fill.oid);
+  assert(item->count == BOOK_TEST_STOCK - 12);
+  assert(book_cancel(oid[1], &qty) == BOOK_NO_ORDER);
+  assert(book_cancel(oid[0], &qty) == BOOK_OK && qty == 3);
+  assert(book_cancel(oid[0], &qty) == BOOK_NO_ORDER);
+  assert(!book_top(item, BOOK_SELL, &price, &depth));
+  assert(book_cancel(0, &qty) == BOOK_NO_ORDER &&
+         book_cancel(-1, &qty) == BOOK_NO_ORDER);
+
+  // a reused node does not answer to the id of its earlier order
+  book_limit(item, BOOK_BUY, 4, 100, &fill);
+  assert(fill.oid != oid[0] && fill.oid != oid[2]);
+  assert(book_cancel(oid[2], &qty) == BOOK_NO_ORDER);
+
+  // limit buys stop at their price, market orders take what is there
+  book_limit(item, BOOK_SELL, 2, 100, &fill);
+  assert(fill.filled == 2 && fill.value == 200 && !fill.oid);
+  book_market(item, BOOK_SELL, 10, &fill);
+  assert(fill.filled == 2 + 3 && fill.value == 2 * 100 + 3 * 99);
+  assert(!book_top(item, BOOK_BUY, &price, &depth));
+  assert(book_cancel(oid[3], &qty) == BOOK_NO_ORDER);
+
+  // many prices on both sides, matched back to empty in price order
+  for (int i = 1; i <= 1000; i++) {
+    book_limit(item, BOOK_SELL, 1, 1000 + (i * 7919) % 1000, &fill);
+    assert(fill.oid && !fill.filled);
+  }
+  for (int i = 0; i < 1000; i++) {
+    book_market(item, BOOK_BUY, 1, &fill);
+    assert(fill.filled == 1 && fill.value == 1000 + i);
+  }
+  assert(!book_top(item, BOOK_SELL, &price, &depth));
+  assert(item->count == 0);
+
+  // with nothing left to sell, a bid waits rather than match
+  book_limit(item, BOOK_BUY, 1, 100, &fill);
+  oid[0] = fill.oid;
+  assert(book_limit(item, BOOK_SELL, 1, 100, &fill) == BOOK_SHORT &&
+         !fill.filled && !fill.oid);
+  assert(book_cancel(oid[0], &qty) == BOOK_OK && qty == 1);
+
+  // an ask that plain buys left uncovered is dropped when it is reached
+  assert(stock_add(item, 5) == STOCK_SUCCESS);
+  assert(book_limit(item, BOOK_SELL, 5, 101, &fill) == BOOK_OK && fill.oid);
+  assert(stock_add(item, -3) == STOCK_SUCCESS);
+  assert(book_limit(item, BOOK_BUY, 5, 101, &fill) == BOOK_OK &&
+         !fill.filled && fill.oid);
+  assert(!book_top(item, BOOK_SELL, &price, &depth) && item->count == 2);
+  assert(book_cancel(fill.oid, &qty) == BOOK_OK && qty == 5);
+}
+
+#define HOT_TEST_ID 500000
+#define HOT_TEST_ROUNDS 2000
+
+static volatile int hot_trading;
+
+static void *__hot_trader(void *vargp) {
+  stock_item *item = search_stock(HOT_TEST_ID);
+
+  while (hot_trading) {
+    if (stock_add(item, -3) == STOCK_SUCCESS) {
+      assert(stock_add(item, 3) == STOCK_SUCCESS);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Count of item @p id as rendered by a view.
+ */
+static int __viewed_count(int id) {
+  int vid, count, price;
+  size_t len;
+  char *range = stock_print_range(id, id, &len);
+
+  assert(sscanf(range, "%d %d %d", &vid, &count, &price) == 3 && vid == id);
+  Free(range);
+  return count;
+}
+
+/* per-core slices add up to the exact count in views, totals and orders */
+static void test_stock_hot(void) {
+  int legs[1][2] = {{HOT_TEST_ID, -5}}, count;
+  int64_t units, value;
+  stock_item *item;
+  pthread_t tids[2];
+
+  __fresh_items(HOT_TEST_ID, 1, 100, 2);
+  item = search_stock(HOT_TEST_ID);
+  units = stock_total_units();
+  value = stock_total_value();
+  assert(stock_hot(HOT_TEST_ID, 1) == STOCK_SUCCESS);
+  assert(!search_stock(HOT_TEST_ID + 1) &&
+         stock_hot(HOT_TEST_ID + 1, 1) == STOCK_FAILED);
+
+  // a dry slice refills from the reserve, only the exact count limits buys
+  assert(stock_add(item, -60) == STOCK_SUCCESS);
+  assert(stock_add(item, -41) == STOCK_FAILED);
+  assert(stock_add(item, -40) == STOCK_SUCCESS);
+  assert(__viewed_count(HOT_TEST_ID) == 0 && stock_count_below(1) >= 1);
+  assert(stock_add(item, 100) == STOCK_SUCCESS);
+  assert(stock_total_units() == units && stock_total_value() == value);
+  assert(stock_order((const int(*)[2])legs, 1) == STOCK_SUCCESS &&
+         item->count == 95 && __viewed_count(HOT_TEST_ID) == 95);
+  assert(stock_add(item, 5) == STOCK_SUCCESS);
+
+  hot_trading = 1;
+  for (int i = 0; i < 2; i++) {
+    Pthread_create(&tids[i], NULL, __hot_trader, NULL);
+  }
+  for (int r = 0; r < HOT_TEST_ROUNDS; r++) {
+    count = __viewed_count(HOT_TEST_ID);
+    assert(count <= 100 && count >= 94 && count % 3 == 1);
+  }
+  hot_trading = 0;
+  for (int i = 0; i < 2; i++) {
+    Pthread_join(tids[i], NULL);
+  }
+
+  assert(stock_hot(HOT_TEST_ID, 0) == STOCK_SUCCESS && item->count == 100);
+  assert(stock_total_units() == units && stock_total_value() == value);
+}
+
+/* column copy follows every trade */
+static void test_stock_columns(void) {
+  btree_iter it;
+  stock_item *item;
+  int64_t units = 0, value = 0;
+  size_t below = 0;
+
+  btree_first(&stock_db.tree, &it);
+  while ((item = btree_next(&it))) {
+    units += item->count;
+    value += (int64_t)item->count * item->price;
+    below += item->count < 10;
+  }
+  assert(stock_total_units() == units && stock_total_value() == value &&
+         stock_count_below(10) == below);
+}
+
+/*
+ * Database tests run on a copy of the stock DB in a scratch directory, so
+ * the files in the working directory are never rewritten and the suite can
+ * be run again. A failed assertion leaves the directory behind to look at.
+ */
+static char sandbox[] = "/tmp/test_stock.XXXXXX";
+
+static void __sandbox_leave(void) {
+  unlink(STOCK_DB_FILENAME);
+  unlink(STOCK_BIN_FILENAME);
+  unlink(STOCK_WAL_FILENAME);
+  if (chdir("/") < 0 || rmdir(sandbox) < 0) {
+    perror("sandbox cleanup");
+  }
+}
+
+static void __sandbox_enter(void) {
+  char buf[MAXBUF];
+  char path[sizeof(sandbox) + sizeof(STOCK_DB_FILENAME)];
+  FILE *in = Fopen(STOCK_DB_FILENAME, "r"), *out;
+  size_t n;
+
+  if (!mkdtemp(sandbox)) {
+    unix_error("mkdtemp error");
+  }
+  snprintf(path, sizeof(path), "%s/%s", sandbox, STOCK_DB_FILENAME);
+  out = Fopen(path, "w");
+  while ((n = Fread(buf, 1, sizeof(buf), in))) {
+    Fwrite(buf, 1, n, out);
+  }
+  Fclose(in);
+  Fclose(out);
+  if (chdir(sandbox) < 0) {
+    unix_error("chdir error");
+  }
+  atexit(__sandbox_leave); // the last stock_init() exits
+}
+
 int main(int argc, const char *argv[]) {
   char buf[MAXLINE];
 
+  test_btree();
+  test_btree_bulk();
+  test_hash();
+  test_slab();
+  test_soa_kernels();
+  test_parse();
+  test_sbuf_handoff();
+  test_pool();
+  test_scan();
+  test_latency();
+
+  __sandbox_enter();
   stock_init();
 
   insert(1, 10, 5000);
@@ -20,8 +867,58 @@ int main(int argc, const char *argv[]) {
   __print_db();
 
   printf("%s\n", stock_write_to_buf(buf));
+  test_stock_insert_concurrent();
+  test_stock_view_consistent();
+  test_stock_order();
+  test_stock_hot();
+  test_stock_columns();
+  test_book();
+
+  // ranges and pages seek to their first id and stop at the bound
+  size_t len;
+  char *range = stock_print_range(2, 5, &len);
+  __expect_lines(buf, 2, 5);
+  assert(!strcmp(range, buf) && len == strlen(buf));
+  Free(range);
+  range = stock_print_page(3, 2, &len);
+  __expect_lines(buf, 3, 4);
+  assert(!strcmp(range, buf) && len == strlen(buf));
+  Free(range);
+  range = stock_print_page(INT_MAX, 5, &len);
+  assert(!strcmp(range, "") && !len);
+  Free(range);
+
+  // unchanged db shares one rendering, any write invalidates it
+  stock_snapshot *snap = stock_snapshot_get(), *next = stock_snapshot_get();
+  assert(snap == next);
+  stock_snapshot_put(next);
+  insert(1, 1, 5000);
+  next = stock_snapshot_get();
+  assert(next != snap && next->version > snap->version);
+  stock_snapshot_put(snap);
+  stock_snapshot_put(next);
 
   stock_write(); // should write to file
 
+  // written file holds the checkpoint header and exactly the show payload
+  FILE *fp = Fopen(STOCK_DB_FILENAME, "r");
+  unsigned checkpoint;
+  snap = stock_snapshot_get();
+  assert(fscanf(fp, STOCK_DB_HEADER " %u\n", &checkpoint) == 1);
+  len = fread(buf, 1, MAXLINE, fp);
+  assert(len == snap->len && !memcmp(buf, snap->buf, len));
+  assert(access(STOCK_DB_FILENAME ".tmp", F_OK) < 0);
+  stock_snapshot_put(snap);
+  Fclose(fp);
+
+  // binary database is a header, the items and a checksum
+  struct stat st;
+  stock_save("test_stock.bin", STOCK_FORMAT_BINARY, checkpoint);
+  Stat("test_stock.bin", &st);
+  assert((size_t)st.st_size == sizeof(stock_file_header) +
+                                   stock_db.size * sizeof(stock_item) +
+                                   sizeof(uint64_t));
+  unlink("test_stock.bin");
+
   stock_init(); // stock_init() should fail if stock DB had been modified
 }
\ No newline at end of file
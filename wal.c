@@ -0,0 +1,596 @@
+#include "wal.h"
+
+#include <sched.h>
+#include <time.h>
+
+#define WAL_MASK (WAL_RING - 1)
+
+static struct {
+  int fd;
+  wal_level level;
+  long budget_us;
+  char *path;
+  pthread_mutex_t mutex;       /* held while writing the file */
+  pthread_cond_t flush_cond;   /* flusher waits for records */
+  pthread_cond_t durable_cond; /* committers and full-ring appenders wait */
+  wal_record *ring;            /* record at position p is at p & WAL_MASK */
+  uint64_t *ready;             /* p + 1 once position p is filled in */
+  _Alignas(64) uint64_t head;  /* next position to hand out */
+  _Alignas(64) uint64_t flushed; /* positions below are written (and synced),
+                                    i.e. the last durable record */
+  int idle;                    /* flusher waits for the next record */
+  off_t end;           /* file size once flushed records are written */
+  uint64_t marker;     /* sequence number of the last checkpoint marker */
+  uint32_t checkpoint; /* number of the last database snapshot */
+  int running;
+  pthread_t flusher;
+  int *watchers; /* eventfds told whenever records become durable */
+  int nwatchers;
+} wal = {.fd = -1};
+
+/* last record appended by this thread, see wal_commit() */
+static __thread uint64_t last_lsn;
+
+/**
+ * @brief FNV-1a over every field but the checksum itself.
+ */
+static uint32_t __checksum(const wal_record *rec) {
+  const unsigned char *p = (const unsigned char *)rec;
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < offsetof(wal_record, checksum); i++) {
+    h = (h ^ p[i]) * 16777619u;
+  }
+  return h;
+}
+
+static void __write_all(int fd, const void *buf, size_t len) {
+  if (rio_writen(fd, (void *)buf, len) != (ssize_t)len) {
+    unix_error("wal write error");
+  }
+}
+
+static void __sync(int fd) {
+  if (fdatasync(fd) < 0) {
+    unix_error("wal fdatasync error");
+  }
+}
+
+/**
+ * @brief Make a file created or renamed next to @p path survive a crash.
+ */
+void wal_sync_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char dir[MAXLINE];
+  int fd;
+
+  if (!slash) {
+    strcpy(dir, ".");
+  } else {
+    snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path),
+             path);
+  }
+  if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    unix_error("wal open dir error");
+  }
+  if (fsync(fd) < 0) {
+    unix_error("wal fsync dir error");
+  }
+  Close(fd);
+}
+
+/**
+ * @brief Write out the run of filled-in records in front of the ring and, in
+ * WAL_GROUP and WAL_SYNC levels, sync them. Called with the mutex held.
+ * @note Stops at the first record an appender is still filling in.
+ *
+ * @return Number of records written.
+ */
+static uint64_t __flush_locked(void) {
+  uint64_t from = wal.flushed, to = from;
+  uint64_t head = __atomic_load_n(&wal.head, __ATOMIC_ACQUIRE);
+  size_t first;
+
+  while (to < head && __atomic_load_n(&wal.ready[to & WAL_MASK],
+                                      __ATOMIC_ACQUIRE) == to + 1) {
+    to++;
+  }
+  if (to == from) {
+    return 0;
+  }
+
+  // a run across the end of the ring goes out in two pieces
+  first = WAL_RING - (from & WAL_MASK);
+  if (first > to - from) {
+    first = to - from;
+  }
+  __write_all(wal.fd, &wal.ring[from & WAL_MASK], first * sizeof(wal_record));
+  if (first < to - from) {
+    __write_all(wal.fd, wal.ring, (to - from - first) * sizeof(wal_record));
+  }
+  if (wal.level != WAL_ASYNC) {
+    __sync(wal.fd);
+  }
+  wal.end += (to - from) * sizeof(wal_record);
+
+  __atomic_store_n(&wal.flushed, to, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&wal.durable_cond);
+  for (int i = 0; i < wal.nwatchers; i++) {
+    uint64_t one = 1;
+    if (write(wal.watchers[i], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      unix_error("wal eventfd write error");
+    }
+  }
+  return to - from;
+}
+
+/**
+ * @brief Write out every record up to sequence number @p lsn. Called with
+ * the mutex held.
+ */
+static void __flush_upto_locked(uint64_t lsn) {
+  while (wal.flushed < lsn) {
+    if (!__flush_locked()) {
+      // a record in front is still being filled in, which is brief
+      pthread_mutex_unlock(&wal.mutex);
+      sched_yield();
+      pthread_mutex_lock(&wal.mutex);
+    }
+  }
+}
+
+/**
+ * @brief Group commit loop. Waits up to the latency budget after the first
+ * pending record so that concurrent trades share one write and fsync.
+ */
+static void *__flusher(void *vargp) {
+  struct timespec deadline;
+
+  pthread_mutex_lock(&wal.mutex);
+  while (wal.running) {
+    // appenders look at idle after taking a position, see __append()
+    __atomic_store_n(&wal.idle, 1, __ATOMIC_SEQ_CST);
+    while (wal.running &&
+           __atomic_load_n(&wal.head, __ATOMIC_SEQ_CST) == wal.flushed) {
+      pthread_cond_wait(&wal.flush_cond, &wal.mutex);
+    }
+    __atomic_store_n(&wal.idle, 0, __ATOMIC_RELAXED);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (wal.budget_us % 1000000) * 1000;
+    deadline.tv_sec += wal.budget_us / 1000000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (wal.running &&
+           __atomic_load_n(&wal.head, __ATOMIC_ACQUIRE) - wal.flushed <
+               WAL_RING / 2 &&
+           pthread_cond_timedwait(&wal.flush_cond, &wal.mutex, &deadline) !=
+               ETIMEDOUT)
+      ;
+
+    if (!__flush_locked()) {
+      // the record in front waits for room in the ring. let it in
+      pthread_mutex_unlock(&wal.mutex);
+      sched_yield();
+      pthread_mutex_lock(&wal.mutex);
+    }
+  }
+  pthread_mutex_unlock(&wal.mutex);
+  return NULL;
+}
+
+/**
+ * @brief Parse a durability level name as given on the command line.
+ *
+ * @return Matching level, -1 if @p s names none.
+ */
+wal_level wal_parse_level(const char *s) {
+  static const char *names[] = {"off", "async", "group", "sync"};
+  for (int i = 0; i < (int)(sizeof(names) / sizeof(*names)); i++) {
+    if (!strcmp(s, names[i])) {
+      return (wal_level)i;
+    }
+  }
+  return (wal_level)-1;
+}
+
+/**
+ * @brief Start logging trades to @p path at durability @p level.
+ * @note Must be called after the log was replayed, since records are
+ * appended to whatever the file already holds.
+ *
+ * @param budget_us Longest time a record may wait before it is written out
+ * in WAL_ASYNC and WAL_GROUP levels
+ */
+void wal_open(const char *path, wal_level level, long budget_us) {
+  pthread_condattr_t attr;
+  struct stat st;
+
+  wal.level = level;
+  wal.path = strdup(path);
+  if (level == WAL_OFF) {
+    return;
+  }
+
+  if ((wal.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) <
+      0) {
+    unix_error("wal open error");
+  }
+  Fstat(wal.fd, &st);
+  wal.end = st.st_size;
+  if (!st.st_size) {
+    __write_all(wal.fd, WAL_MAGIC, WAL_MAGIC_LEN);
+    __sync(wal.fd);
+    wal.end = WAL_MAGIC_LEN;
+  }
+
+  wal.budget_us = budget_us;
+  wal.ring = (wal_record *)Malloc(WAL_RING * sizeof(wal_record));
+  wal.ready = (uint64_t *)Calloc(WAL_RING, sizeof(uint64_t));
+  wal.head = wal.flushed = wal.marker = 0;
+  pthread_mutex_init(&wal.mutex, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wal.flush_cond, &attr);
+  pthread_cond_init(&wal.durable_cond, NULL);
+  pthread_condattr_destroy(&attr);
+
+  if (level == WAL_ASYNC || level == WAL_GROUP) {
+    wal.running = 1;
+    Pthread_create(&wal.flusher, NULL, __flusher, NULL);
+  }
+  debug_print("wal opened at %s, level=%d, budget=%ldus", path, level,
+              budget_us);
+}
+
+/**
+ * @brief Write out everything pending and stop logging.
+ */
+void wal_close(void) {
+  if (wal.fd < 0) {
+    free(wal.path);
+    wal.path = NULL;
+    return;
+  }
+
+  pthread_mutex_lock(&wal.mutex);
+  wal.running = 0;
+  pthread_cond_signal(&wal.flush_cond);
+  pthread_mutex_unlock(&wal.mutex);
+  if (wal.level == WAL_ASYNC || wal.level == WAL_GROUP) {
+    Pthread_join(wal.flusher, NULL);
+  }
+  pthread_mutex_lock(&wal.mutex);
+  __flush_upto_locked(wal.head);
+  pthread_mutex_unlock(&wal.mutex);
+  __sync(wal.fd);
+  Close(wal.fd);
+
+  free(wal.ring);
+  free(wal.ready);
+  free(wal.path);
+  free(wal.watchers);
+  pthread_mutex_destroy(&wal.mutex);
+  pthread_cond_destroy(&wal.flush_cond);
+  pthread_cond_destroy(&wal.durable_cond);
+  wal.fd = -1;
+  wal.ring = NULL;
+  wal.ready = NULL;
+  wal.path = NULL;
+  wal.watchers = NULL;
+  wal.nwatchers = 0;
+  wal.head = wal.flushed = wal.marker = 0;
+  wal.end = 0;
+  wal.level = WAL_OFF;
+}
+
+/**
+ * @brief Sequence the @p n records at @p rec, back to back, after every
+ * record appended so far.
+ * @note Appenders only take the mutex when the ring is full or, in WAL_SYNC
+ * level, to write their records out. Positions come from one fetch-add.
+ *
+ * @return Log sequence number of the last record.
+ */
+static uint64_t __append(wal_record *rec, size_t n) {
+  uint64_t pos = __atomic_fetch_add(&wal.head, n, __ATOMIC_SEQ_CST);
+  uint64_t flushed = __atomic_load_n(&wal.flushed, __ATOMIC_ACQUIRE);
+
+  if (pos + n > flushed + WAL_RING) {
+    // the ring is full. wait for the records in front to be written
+    pthread_mutex_lock(&wal.mutex);
+    while (pos + n > wal.flushed + WAL_RING) {
+      pthread_cond_signal(&wal.flush_cond);
+      pthread_cond_wait(&wal.durable_cond, &wal.mutex);
+    }
+    pthread_mutex_unlock(&wal.mutex);
+  } else if (pos - flushed < WAL_RING / 2 &&
+             pos + n - flushed >= WAL_RING / 2 && wal.level != WAL_SYNC) {
+    pthread_mutex_lock(&wal.mutex);
+    pthread_cond_signal(&wal.flush_cond);
+    pthread_mutex_unlock(&wal.mutex);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    rec[i].checksum = __checksum(&rec[i]);
+    wal.ring[(pos + i) & WAL_MASK] = rec[i];
+    __atomic_store_n(&wal.ready[(pos + i) & WAL_MASK], pos + i + 1,
+                     __ATOMIC_RELEASE);
+  }
+
+  if (wal.level == WAL_SYNC) {
+    pthread_mutex_lock(&wal.mutex);
+    __flush_upto_locked(pos + n);
+    pthread_mutex_unlock(&wal.mutex);
+  } else if (__atomic_load_n(&wal.idle, __ATOMIC_SEQ_CST) &&
+             __atomic_exchange_n(&wal.idle, 0, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&wal.mutex);
+    pthread_cond_signal(&wal.flush_cond);
+    pthread_mutex_unlock(&wal.mutex);
+  }
+  return pos + n;
+}
+
+/**
+ * @brief Log a successful modification.
+ * @note A no-op until wal_open(), so replaying the log does not log again.
+ *
+ * @return Log sequence number of the record, 0 if nothing was logged.
+ */
+uint64_t wal_append(uint32_t type, int id, int n, int price) {
+  wal_record rec = {
+      .type = type,
+      .id = id,
+      .n = n,
+      .price = price,
+  };
+
+  if (wal.fd < 0) {
+    return 0;
+  }
+  return last_lsn = __append(&rec, 1);
+}
+
+/**
+ * @brief Log the changes of an order as one unit: a WAL_ORDER record with
+ * the number of legs, then a WAL_DELTA record per leg.
+ * @note Replay applies the legs only if every one of them made it to disk.
+ *
+ * @param legs Id and change to its count of each leg
+ * @return Log sequence number of the last record, 0 if nothing was logged.
+ */
+uint64_t wal_append_order(const int (*legs)[2], int n) {
+  wal_record recs[ORDER_MAX_LEGS + 1] = {{.type = WAL_ORDER, .n = n}};
+
+  if (wal.fd < 0) {
+    return 0;
+  }
+  for (int i = 0; i < n; i++) {
+    recs[i + 1] = (wal_record){
+        .type = WAL_DELTA,
+        .id = legs[i][0],
+        .n = legs[i][1],
+    };
+  }
+
+  return last_lsn = __append(recs, n + 1);
+}
+
+/**
+ * @brief Number a new database snapshot and mark its position in the log.
+ * @warning The caller must make sure no trade runs concurrently, so that the
+ * snapshot holds exactly the records in front of the marker.
+ *
+ * @return Number to store with the snapshot, see wal_replay().
+ */
+uint32_t wal_checkpoint(void) {
+  wal_record rec = {.type = WAL_CHECKPOINT};
+  uint64_t lsn;
+
+  if (wal.fd < 0) {
+    return ++wal.checkpoint;
+  }
+
+  rec.id = (int32_t)++wal.checkpoint;
+  lsn = __append(&rec, 1);
+  pthread_mutex_lock(&wal.mutex);
+  wal.marker = lsn;
+  pthread_mutex_unlock(&wal.mutex);
+  return (uint32_t)rec.id;
+}
+
+/**
+ * @brief Wait until every record appended by the calling thread is durable.
+ * @note Only WAL_GROUP waits. Connections call this once per batch of
+ * requests, right before sending the replies.
+ */
+void wal_commit(void) {
+  uint64_t lsn = wal_pending();
+
+  if (!lsn) {
+    return;
+  }
+  pthread_mutex_lock(&wal.mutex);
+  while (wal.flushed < lsn) {
+    pthread_cond_wait(&wal.durable_cond, &wal.mutex);
+  }
+  pthread_mutex_unlock(&wal.mutex);
+}
+
+/**
+ * @brief Sequence number the replies of the calling thread have to wait for,
+ * for callers that must not block in wal_commit().
+ *
+ * @return Last record appended by this thread if WAL_GROUP has not made it
+ * durable yet, 0 otherwise.
+ */
+uint64_t wal_pending(void) {
+  uint64_t lsn = last_lsn;
+
+  if (wal.level != WAL_GROUP || !lsn || wal_durable(lsn)) {
+    return 0;
+  }
+  return lsn;
+}
+
+/**
+ * @brief Whether the record with sequence number @p lsn is durable.
+ */
+int wal_durable(uint64_t lsn) {
+  return __atomic_load_n(&wal.flushed, __ATOMIC_ACQUIRE) >= lsn;
+}
+
+/**
+ * @brief Have the eventfd @p fd counted up whenever records become durable,
+ * so that an event loop can wait for wal_durable() along with its sockets.
+ */
+void wal_watch(int fd) {
+  if (wal.fd < 0) {
+    return;
+  }
+  pthread_mutex_lock(&wal.mutex);
+  wal.watchers = (int *)Realloc(wal.watchers,
+                                (wal.nwatchers + 1) * sizeof(*wal.watchers));
+  wal.watchers[wal.nwatchers++] = fd;
+  pthread_mutex_unlock(&wal.mutex);
+}
+
+/**
+ * @brief Replace the log with the records from the last marker on. Called
+ * with the mutex held and every record up to the marker written.
+ * @note The new log is built aside and renamed over the old one, so a crash
+ * leaves either of them in place. Both replay to the same database.
+ */
+static void __compact_locked(void) {
+  off_t marker_off =
+      wal.end - (off_t)((wal.flushed - wal.marker + 1) * sizeof(wal_record));
+  size_t len = wal.end - marker_off;
+  char *tail = (char *)Malloc(len), tmp[MAXLINE];
+  int fd;
+
+  if (pread(wal.fd, tail, len, marker_off) != (ssize_t)len) {
+    unix_error("wal read error");
+  }
+  snprintf(tmp, sizeof(tmp), "%s.tmp", wal.path);
+  if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                 0644)) < 0) {
+    unix_error("wal open error");
+  }
+  __write_all(fd, WAL_MAGIC, WAL_MAGIC_LEN);
+  __write_all(fd, tail, len);
+  __sync(fd);
+  if (rename(tmp, wal.path) < 0) {
+    unix_error("wal rename error");
+  }
+  wal_sync_dir(wal.path);
+  Free(tail);
+
+  Close(wal.fd);
+  wal.fd = fd;
+  wal.end = WAL_MAGIC_LEN + len;
+  debug_print("wal compacted to %zu bytes", (size_t)wal.end);
+}
+
+/**
+ * @brief Drop the records that database snapshot @p checkpoint holds, once
+ * it is on disk.
+ * @note Records since the marker are not written out while they are
+ * copied, which is short as long as snapshots are taken often.
+ */
+void wal_truncate(uint32_t checkpoint) {
+  if (wal.fd < 0) {
+    // not logging. a log left over from an earlier run is now applied
+    if (wal.path && unlink(wal.path) < 0 && errno != ENOENT) {
+      unix_error("wal unlink error");
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&wal.mutex);
+  __flush_upto_locked(wal.marker);
+  __flush_locked();
+  __sync(wal.fd);
+
+  if (wal.marker && wal.checkpoint == checkpoint) {
+    __compact_locked();
+  }
+  pthread_mutex_unlock(&wal.mutex);
+}
+
+/**
+ * @brief Feed every intact record of the log at @p path that database
+ * snapshot @p checkpoint does not hold yet to @p apply.
+ * @note A torn or corrupt tail, e.g. from a crash mid-write, ends the replay
+ * and is cut off so that new records follow the last intact one.
+ *
+ * @param checkpoint Number stored with the snapshot, 0 for none. Records in
+ * front of its marker are skipped. Without the marker every record is newer,
+ * as the log was compacted past it
+ * @return Number of replayed records, 0 if there is no log.
+ */
+long wal_replay(const char *path, uint32_t checkpoint,
+                void (*apply)(const wal_record *rec)) {
+  char magic[WAL_MAGIC_LEN];
+  wal_record rec;
+  long count = 0, legs = 0;
+  off_t good, start, order = 0;
+  int fd;
+
+  wal.checkpoint = checkpoint;
+  if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    unix_error("wal open error");
+  }
+  if (rio_readn(fd, magic, WAL_MAGIC_LEN) != WAL_MAGIC_LEN ||
+      memcmp(magic, WAL_MAGIC, WAL_MAGIC_LEN)) {
+    app_error("wal replay error: not a trade log");
+  }
+
+  start = good = WAL_MAGIC_LEN;
+  while (rio_readn(fd, &rec, sizeof(rec)) == sizeof(rec) &&
+         rec.checksum == __checksum(&rec)) {
+    if (legs) {
+      legs--;
+    } else if (rec.type == WAL_ORDER) {
+      order = good;
+      legs = rec.n;
+    }
+    good += sizeof(rec);
+    if (rec.type == WAL_CHECKPOINT && (uint32_t)rec.id == checkpoint) {
+      start = good;
+    }
+  }
+  if (legs) {
+    good = order; // the order was cut short: none of its legs happened
+  }
+
+  if (Lseek(fd, 0, SEEK_END) != good) {
+    fprintf(stderr, "wal: dropping corrupt tail after %ld bytes\n",
+            (long)good);
+    if (ftruncate(fd, good) < 0) {
+      unix_error("wal ftruncate error");
+    }
+  }
+
+  Lseek(fd, start, SEEK_SET);
+  for (off_t off = start; off < good; off += sizeof(rec)) {
+    if (rio_readn(fd, &rec, sizeof(rec)) != sizeof(rec)) {
+      unix_error("wal read error");
+    }
+    if (rec.type == WAL_CHECKPOINT) {
+      // a snapshot that never made it to disk. keep numbers unique
+      if ((uint32_t)rec.id > wal.checkpoint) {
+        wal.checkpoint = rec.id;
+      }
+      continue;
+    } else if (rec.type == WAL_ORDER) {
+      continue; // complete, its legs follow
+    }
+    apply(&rec);
+    count++;
+  }
+  Close(fd);
+  debug_print("replayed %ld records from %s after checkpoint %u", count, path,
+              checkpoint);
+  return count;
+}
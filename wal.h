@@ -0,0 +1,59 @@
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "csapp.h"
+#include "misc.h"
+
+#define STOCK_WAL_FILENAME "stock.wal"
+#define WAL_MAGIC "STOCKWAL"
+#define WAL_MAGIC_LEN 8
+/* records buffered before appenders wait, a power of two. half of it flushes
+ * early */
+#define WAL_RING (1 << 16)
+#define WAL_DEFAULT_BUDGET_US 1000
+
+typedef enum {
+  WAL_OFF = 0, /* no log. trades since the last stock_write() are lost */
+  WAL_ASYNC,   /* written within the budget, never fsynced */
+  WAL_GROUP,   /* fsynced within the budget, replies wait for it */
+  WAL_SYNC,    /* every record fsynced before its trade returns */
+} wal_level;
+
+enum __wal_type {
+  WAL_INSERT = 1, /* new item with count n and price */
+  WAL_DELTA,      /* count of an existing item changed by n */
+  WAL_CHECKPOINT, /* database snapshot number id was taken here */
+  WAL_ORDER,      /* the next n records are the legs of one order */
+};
+
+/* fixed-size, self-checking log record */
+struct __wal_record {
+  uint32_t type;
+  int32_t id;
+  int32_t n;
+  int32_t price;
+  uint32_t checksum;
+};
+
+typedef struct __wal_record wal_record;
+
+void wal_open(const char *path, wal_level level, long budget_us);
+void wal_close(void);
+uint64_t wal_append(uint32_t type, int id, int n, int price);
+uint64_t wal_append_order(const int (*legs)[2], int n);
+void wal_commit(void);
+uint64_t wal_pending(void);
+int wal_durable(uint64_t lsn);
+void wal_watch(int fd);
+uint32_t wal_checkpoint(void);
+void wal_truncate(uint32_t checkpoint);
+long wal_replay(const char *path, uint32_t checkpoint,
+                void (*apply)(const wal_record *rec));
+void wal_sync_dir(const char *path);
+
+wal_level wal_parse_level(const char *s);
+
+#endif /* __WAL_H__ */